@@ -19,129 +19,83 @@
  */
 
 #include <QtCore/QString>
-#include <QtCore/QHash>
 
 #include <bluetooth/bluetooth.h>
 
-#include "gatoaddress.h"
-
-struct GatoAddressPrivate : QSharedData
-{
-	union {
-		bdaddr_t bd;
-		quint64 u64;
-	} addr;
-	quint8 addr_type;
-};
+#include <type_traits>
 
-GatoAddress::GatoAddress()
-    : d(new GatoAddressPrivate)
-{
-	d->addr.u64 = 0;
-}
+#include "gatoaddress.h"
 
-GatoAddress::GatoAddress(quint64 addr)
-    : d(new GatoAddressPrivate)
-{
-	d->addr.u64 = addr;
-	d->addr_type = BDADDR_LE_PUBLIC;
-}
+static_assert(sizeof(GatoAddress) == 8, "GatoAddress should fit in a register");
+static_assert(std::is_trivially_copyable<GatoAddress>::value, "GatoAddress should be a plain value");
 
-GatoAddress::GatoAddress(quint64 addr, quint8 addr_type)
-    : d(new GatoAddressPrivate)
+static inline int hex_digit(ushort c)
 {
-	d->addr.u64 = addr;
-	d->addr_type = addr_type;
+	if (c >= '0' && c <= '9') return c - '0';
+	c |= 0x20; // Lower case
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
 }
 
-GatoAddress::GatoAddress(quint8 addr[])
-    : d(new GatoAddressPrivate)
+/** Parses the usual most significant byte first, colon separated notation;
+ *  returns 0 if addr is malformed, like str2ba() does. */
+static quint64 parse_address(const QString &addr)
 {
-	d->addr.u64 = 0;
-	d->addr_type = BDADDR_LE_PUBLIC;
-	for (int i = 0; i < 6; i++) {
-		d->addr.bd.b[i] = addr[i];
-	}
-}
+	if (addr.size() != 17) return 0;
 
-GatoAddress::GatoAddress(quint8 addr[], quint8 addr_type)
-    : d(new GatoAddressPrivate)
-{
-	d->addr.u64 = 0;
-	d->addr_type = addr_type;
+	const QChar *s = addr.constData();
+	quint64 v = 0;
 	for (int i = 0; i < 6; i++) {
-		d->addr.bd.b[i] = addr[i];
+		int hi = hex_digit(s[i * 3].unicode());
+		int lo = hex_digit(s[i * 3 + 1].unicode());
+		if (hi < 0 || lo < 0) return 0;
+		if (i < 5 && s[i * 3 + 2].unicode() != ':') return 0;
+		v = (v << 8) | quint64(hi << 4 | lo);
 	}
-}
-
-GatoAddress::GatoAddress(const QString &addr)
-    : d(new GatoAddressPrivate)
-{
-	d->addr.u64 = 0;
-	d->addr_type = BDADDR_LE_PUBLIC;
-	str2ba(addr.toLatin1().constData(), &d->addr.bd);
-}
-
-GatoAddress::GatoAddress(const QString &addr, quint8 addr_type)
-    : d(new GatoAddressPrivate)
-{
-	d->addr.u64 = 0;
-	d->addr_type = addr_type;
-	str2ba(addr.toLatin1().constData(), &d->addr.bd);
-}
 
-GatoAddress::GatoAddress(const GatoAddress &o)
-    : d(o.d)
-{
+	return v;
 }
 
-GatoAddress::~GatoAddress()
+GatoAddress::GatoAddress(const quint8 addr[])
+    : GatoAddress(addr, BDADDR_LE_PUBLIC)
 {
 }
 
-GatoAddress & GatoAddress::operator =(const GatoAddress& o)
+GatoAddress::GatoAddress(const quint8 addr[], quint8 addr_type)
+    : v(quint64(addr_type) << 48)
 {
-	if (this != &o) {
-		d = o.d;
+	// bdaddr_t order: least significant byte first.
+	for (int i = 0; i < 6; i++) {
+		v |= quint64(addr[i]) << (i * 8);
 	}
-	return *this;
 }
 
-bool GatoAddress::isNull() const
+GatoAddress::GatoAddress(const QString &addr)
+    : GatoAddress(parse_address(addr), BDADDR_LE_PUBLIC)
 {
-	return toUInt64() == 0;
 }
 
-quint64 GatoAddress::toUInt64() const
+GatoAddress::GatoAddress(const QString &addr, quint8 addr_type)
+    : GatoAddress(parse_address(addr), addr_type)
 {
-	return d->addr.u64;
 }
 
 void GatoAddress::toUInt8Array(quint8 addr[]) const
 {
 	for (int i = 0; i < 6; i++) {
-		addr[i] = d->addr.bd.b[i];
+		addr[i] = quint8(v >> (i * 8));
 	}
 }
 
 QString GatoAddress::toString() const
 {
-	char addr[18];
-	ba2str(&d->addr.bd, addr);
-	return QString::fromLatin1(addr);
-}
-
-quint8 GatoAddress::addressType() const
-{
-	return d->addr_type;
-}
-
-bool operator==(const GatoAddress &a, const GatoAddress &b)
-{
-	return a.toUInt64() == b.toUInt64();
-}
-
-uint qHash(const GatoAddress &a)
-{
-	return qHash(a.toUInt64());
+	static const char digits[] = "0123456789ABCDEF";
+	char str[17];
+	for (int i = 0; i < 6; i++) {
+		quint8 b = quint8(v >> ((5 - i) * 8));
+		str[i * 3] = digits[b >> 4];
+		str[i * 3 + 1] = digits[b & 0xF];
+		if (i < 5) str[i * 3 + 2] = ':';
+	}
+	return QString::fromLatin1(str, sizeof(str));
 }
@@ -2,44 +2,48 @@
 #define GATOADDRESS_H
 
 #include <QtCore/QDebug>
-#include <QtCore/QSharedDataPointer>
 #include "libgato_global.h"
 
-class GatoAddressPrivate;
-
+/** A bluetooth device address and its type, packed into a plain 8 byte value
+ *  that can be copied, compared and hashed without touching the heap.
+ *  The type is one of BlueZ's BDADDR_LE_PUBLIC or BDADDR_LE_RANDOM. */
 class LIBGATO_EXPORT GatoAddress
 {
 public:
-	GatoAddress();
-	explicit GatoAddress(quint8 addr[]);
-	explicit GatoAddress(quint8 addr[], quint8 addr_type);
-	explicit GatoAddress(quint64 addr);
-	explicit GatoAddress(quint64 addr, quint8 addr_type);
+	Q_DECL_CONSTEXPR GatoAddress() : v(0) { }
+	explicit GatoAddress(const quint8 addr[]);
+	explicit GatoAddress(const quint8 addr[], quint8 addr_type);
+	/** Defaults to a LE public address (BDADDR_LE_PUBLIC). */
+	Q_DECL_CONSTEXPR explicit GatoAddress(quint64 addr, quint8 addr_type = 0x01)
+	    : v((addr & AddressMask) | (quint64(addr_type) << 48)) { }
+	/** Parses "XX:XX:XX:XX:XX:XX"; gives a null address if malformed. */
 	explicit GatoAddress(const QString &addr);
 	explicit GatoAddress(const QString &addr, quint8 addr_type);
-	GatoAddress(const GatoAddress& o);
-	~GatoAddress();
-
-	GatoAddress& operator=(const GatoAddress& o);
 
-	bool isNull() const;
+	Q_DECL_CONSTEXPR bool isNull() const { return toUInt64() == 0; }
 
 	void toUInt8Array(quint8 addr[]) const;
-	quint64 toUInt64() const;
-	quint8 addressType() const;
+	Q_DECL_CONSTEXPR quint64 toUInt64() const { return v & AddressMask; }
+	Q_DECL_CONSTEXPR quint8 addressType() const { return quint8(v >> 48); }
 	QString toString() const;
 
+	Q_DECL_CONSTEXPR friend bool operator==(const GatoAddress &a, const GatoAddress &b) { return a.v == b.v; }
+	Q_DECL_CONSTEXPR friend bool operator!=(const GatoAddress &a, const GatoAddress &b) { return a.v != b.v; }
+	friend inline uint qHash(const GatoAddress &a) { return uint(a.v ^ (a.v >> 31)); }
+
 private:
-	QSharedDataPointer<GatoAddressPrivate> d;
+	enum : quint64 { AddressMask = Q_UINT64_C(0xFFFFFFFFFFFF) };
+
+	/** Address in the lower 48 bits, address type in the next 8. */
+	quint64 v;
 };
 
+Q_DECLARE_TYPEINFO(GatoAddress, Q_PRIMITIVE_TYPE);
+
 inline QDebug operator<<(QDebug debug, const GatoAddress &a)
 {
 	debug << a.toString().toLatin1().constData();
 	return debug.space();
 }
 
-LIBGATO_EXPORT bool operator==(const GatoAddress &a, const GatoAddress &b);
-LIBGATO_EXPORT uint qHash(const GatoAddress &a);
-
 #endif // GATOADDRESS_H
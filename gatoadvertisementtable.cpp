@@ -0,0 +1,243 @@
+/*
+ *  libgato - A GATT/ATT library for use with Bluez
+ *
+ *  Copyright (C) 2013 Javier S. Pedro <maemo@javispedro.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include <string.h>
+
+#include "gatoadvertisementtable.h"
+#include "helpers.h"
+
+static inline quint64 record_key(const GatoAddress &addr)
+{
+	return addr.toUInt64() | (quint64(addr.addressType()) << 48);
+}
+
+static bool eir_lists_uuid(const quint8 *data, int len, const GatoUUID &uuid)
+{
+	GatoEIRIterator it(data, len);
+	while (it.next()) {
+		int size;
+		switch (it.type()) {
+		case EIRIncompleteUUID16List:
+		case EIRCompleteUUID16List:
+			size = 16/8;
+			break;
+		case EIRIncompleteUUID32List:
+		case EIRCompleteUUID32List:
+			size = 32/8;
+			break;
+		case EIRIncompleteUUID128List:
+		case EIRCompleteUUID128List:
+			size = 128/8;
+			break;
+		default:
+			continue;
+		}
+
+		// Skip lists that cannot contain it without decoding them.
+		if (uuid.minimumSize() > size) continue;
+
+		const quint8 *item = it.data();
+		for (int i = 0; i + size <= it.size(); i += size) {
+			if (read_gatouuid(reinterpret_cast<const char*>(&item[i]), size) == uuid) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+GatoAddress GatoAdvertisementTable::Record::address() const
+{
+	return GatoAddress(key & Q_UINT64_C(0xFFFFFFFFFFFF), quint8(key >> 48));
+}
+
+QByteArray GatoAdvertisementTable::Record::data() const
+{
+	QByteArray ba(advert_len + scan_rsp_len, Qt::Uninitialized);
+	memcpy(ba.data(), advert, advert_len);
+	memcpy(ba.data() + advert_len, scan_rsp, scan_rsp_len);
+	return ba;
+}
+
+bool GatoAdvertisementTable::Record::advertisesService(const GatoUUID &uuid) const
+{
+	return eir_lists_uuid(advert, advert_len, uuid) || eir_lists_uuid(scan_rsp, scan_rsp_len, uuid);
+}
+
+GatoAdvertisementTable::GatoAdvertisementTable()
+    : max_records(1024), ttl(5 * 60 * 1000), head(-1), tail(-1), free_list(-1)
+{
+}
+
+int GatoAdvertisementTable::capacity() const
+{
+	return max_records;
+}
+
+void GatoAdvertisementTable::setCapacity(int records)
+{
+	max_records = qMax(1, records);
+	while (index.size() > max_records) {
+		evict(tail);
+	}
+}
+
+qint64 GatoAdvertisementTable::timeout() const
+{
+	return ttl;
+}
+
+void GatoAdvertisementTable::setTimeout(qint64 msec)
+{
+	ttl = msec;
+}
+
+int GatoAdvertisementTable::size() const
+{
+	return index.size();
+}
+
+int GatoAdvertisementTable::allocatedSize() const
+{
+	return records.capacity() * sizeof(Record);
+}
+
+const GatoAdvertisementTable::Record *GatoAdvertisementTable::find(const GatoAddress &addr) const
+{
+	QHash<quint64, int>::const_iterator it = index.constFind(record_key(addr));
+	if (it == index.constEnd()) return 0;
+	return &records.at(*it);
+}
+
+const GatoAdvertisementTable::Record *GatoAdvertisementTable::update(const GatoAddress &addr, quint8 advert_type, int rssi,
+                                                                     const quint8 *data, int len, qint64 now,
+                                                                     bool *changed)
+{
+	const quint64 key = record_key(addr);
+	int i;
+
+	QHash<quint64, int>::iterator it = index.find(key);
+	if (it != index.end()) {
+		i = *it;
+		unlink(i);
+	} else {
+		if (index.size() >= max_records) {
+			evict(tail);
+		}
+		i = allocate();
+		Record &record = records[i];
+		record.key = key;
+		record.advert_type = advert_type;
+		record.advert_len = 0;
+		record.scan_rsp_len = 0;
+		index.insert(key, i);
+	}
+
+	Record &record = records[i];
+	record.last_seen = now;
+	record.rssi = rssi;
+
+	len = qBound(0, len, int(MaxDataLength));
+	quint8 *stored = record.advert;
+	quint8 *stored_len = &record.advert_len;
+	if (advert_type == ScanResponse) {
+		stored = record.scan_rsp;
+		stored_len = &record.scan_rsp_len;
+	} else {
+		record.advert_type = advert_type;
+	}
+
+	// The data is compared in place, since it is here anyway.
+	const bool differs = *stored_len != len || memcmp(stored, data, len) != 0;
+	if (differs) {
+		memcpy(stored, data, len);
+		*stored_len = len;
+	}
+	if (changed) *changed = differs;
+
+	linkFront(i);
+
+	return &record;
+}
+
+void GatoAdvertisementTable::expire(qint64 now)
+{
+	if (ttl <= 0) return;
+	while (tail != -1 && now - records.at(tail).last_seen > ttl) {
+		evict(tail);
+	}
+}
+
+void GatoAdvertisementTable::clear()
+{
+	records.clear();
+	index.clear();
+	head = tail = free_list = -1;
+}
+
+void GatoAdvertisementTable::unlink(int i)
+{
+	Record &record = records[i];
+	if (record.prev != -1) {
+		records[record.prev].next = record.next;
+	} else {
+		head = record.next;
+	}
+	if (record.next != -1) {
+		records[record.next].prev = record.prev;
+	} else {
+		tail = record.prev;
+	}
+}
+
+void GatoAdvertisementTable::linkFront(int i)
+{
+	Record &record = records[i];
+	record.prev = -1;
+	record.next = head;
+	if (head != -1) {
+		records[head].prev = i;
+	} else {
+		tail = i;
+	}
+	head = i;
+}
+
+void GatoAdvertisementTable::evict(int i)
+{
+	unlink(i);
+	index.remove(records.at(i).key);
+	records[i].next = free_list;
+	free_list = i;
+}
+
+int GatoAdvertisementTable::allocate()
+{
+	if (free_list != -1) {
+		int i = free_list;
+		free_list = records.at(i).next;
+		return i;
+	}
+
+	records.append(Record());
+	return records.size() - 1;
+}
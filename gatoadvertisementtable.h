@@ -0,0 +1,88 @@
+#ifndef GATOADVERTISEMENTTABLE_H
+#define GATOADVERTISEMENTTABLE_H
+
+#include <QtCore/QHash>
+#include <QtCore/QVector>
+
+#include "gatoaddress.h"
+#include "gatouuid.h"
+
+/** The last advertising data seen from each nearby device, kept in fixed size
+ *  records so that scanning a busy area does not need an object per address.
+ *
+ *  Once the table is full, the device seen least recently is forgotten to make
+ *  room; devices not seen for longer than the timeout are forgotten by expire().
+ *  Times are in milliseconds on any monotonic clock the caller chooses. */
+class GatoAdvertisementTable
+{
+public:
+	GatoAdvertisementTable();
+
+	enum {
+		/** Largest payload of a legacy advertising report. */
+		MaxDataLength = 31,
+		/** Event type of scan responses, whose data is kept apart from the advertisement's. */
+		ScanResponse = 0x04
+	};
+
+	struct Record
+	{
+		/** Address in the lower 48 bits, address type in the next 8. */
+		quint64 key;
+		qint64 last_seen;
+		/** Neighbours in least recently seen order, as indexes into the table. */
+		qint32 prev, next;
+		qint8 rssi;
+		/** Event type of the last report other than a scan response. */
+		quint8 advert_type;
+		quint8 advert_len;
+		quint8 scan_rsp_len;
+		quint8 advert[MaxDataLength];
+		quint8 scan_rsp[MaxDataLength];
+
+		GatoAddress address() const;
+		/** The advertising data followed by the scan response data. */
+		QByteArray data() const;
+		bool advertisesService(const GatoUUID &uuid) const;
+	};
+
+	int capacity() const;
+	void setCapacity(int records);
+
+	/** 0 disables expiry. */
+	qint64 timeout() const;
+	void setTimeout(qint64 msec);
+
+	int size() const;
+	/** Bytes currently allocated for records, free or not. */
+	int allocatedSize() const;
+
+	/** Pointers returned by find() and update() are only valid until the next call
+	 *  that changes the table. update() sets changed to whether the data differs
+	 *  from the one last stored for this device and event type. */
+	const Record *find(const GatoAddress &addr) const;
+	const Record *update(const GatoAddress &addr, quint8 advert_type, int rssi,
+	                     const quint8 *data, int len, qint64 now, bool *changed = 0);
+
+	/** Forgets the devices not seen since now - timeout(). */
+	void expire(qint64 now);
+	void clear();
+
+private:
+	void unlink(int i);
+	void linkFront(int i);
+	void evict(int i);
+	int allocate();
+
+private:
+	int max_records;
+	qint64 ttl;
+	QVector<Record> records;
+	QHash<quint64, int> index;
+	/** Most and least recently seen records. */
+	int head, tail;
+	/** Unused records, chained through their next field. */
+	int free_list;
+};
+
+#endif // GATOADVERTISEMENTTABLE_H
@@ -22,6 +22,7 @@
 #include <QtCore/QDebug>
 
 #include "gatoattclient.h"
+#include "gatosocket.h"
 #include "helpers.h"
 
 #define PROTOCOL_DEBUG 0
@@ -32,37 +33,10 @@
 #define ATT_DEFAULT_LE_MTU 23
 #define ATT_MAX_LE_MTU 0x200
 
-enum AttOpcode {
-	AttOpNone = 0,
-	AttOpErrorResponse = 0x1,
-	AttOpExchangeMTURequest = 0x2,
-	AttOpExchangeMTUResponse = 0x3,
-	AttOpFindInformationRequest = 0x4,
-	AttOpFindInformationResponse = 0x5,
-	AttOpFindByTypeValueRequest = 0x6,
-	AttOpFindByTypeValueResponse = 0x7,
-	AttOpReadByTypeRequest = 0x8,
-	AttOpReadByTypeResponse = 0x9,
-	AttOpReadRequest = 0xA,
-	AttOpReadResponse = 0xB,
-	AttOpReadBlobRequest = 0xC,
-	AttOpReadBlobResponse = 0xD,
-	AttOpReadMultipleRequest = 0xE,
-	AttOpReadMultipleResponse = 0xF,
-	AttOpReadByGroupTypeRequest = 0x10,
-	AttOpReadByGroupTypeResponse = 0x11,
-	AttOpWriteRequest = 0x12,
-	AttOpWriteResponse = 0x13,
-	AttOpWriteCommand = 0x52,
-	AttOpPrepareWriteRequest = 0x16,
-	AttOpPrepareWriteResponse = 0x17,
-	AttOpExecuteWriteRequest = 0x18,
-	AttOpExecuteWriteResponse = 0x19,
-	AttOpHandleValueNotification = 0x1B,
-	AttOpHandleValueIndication = 0x1D,
-	AttOpHandleValueConfirmation = 0x1E,
-	AttOpSignedWriteCommand = 0xD2
-};
+#define ATT_TRANSACTION_TIMEOUT 30000
+
+/** How many times a non empty lane may be passed over before it is served. */
+#define ATT_MAX_LANE_SKIPS 4
 
 static QByteArray remove_method_signature(const char *sig)
 {
@@ -74,33 +48,146 @@ static QByteArray remove_method_signature(const char *sig)
 	return QByteArray(sig + 1, bracketPosition - 1 - sig);
 }
 
+/** Wraps a SLOT() style receiver into a typed callback, so that the legacy
+ *  request overloads can share the callback based code path. */
+template<typename Arg>
+static std::function<void(uint, Arg)> slot_callback(QObject *receiver, const char *member, const char *arg_type)
+{
+	if (!receiver) {
+		return std::function<void(uint, Arg)>();
+	}
+
+	const QByteArray method = remove_method_signature(member);
+	return [receiver, method, arg_type](uint req, Arg value) {
+		QMetaObject::invokeMethod(receiver, method.constData(),
+		                          Q_ARG(uint, req),
+		                          QGenericArgument(arg_type, &value));
+	};
+}
+
+template<typename T>
+static QList<T> to_qlist(const GatoAttItemList<T> &list)
+{
+	QList<T> items;
+	items.reserve(list.size());
+	foreach (const T &item, list) {
+		items.append(item);
+	}
+	return items;
+}
+
+static QList<GatoAttClient::AttributeData> to_qlist(const GatoAttClient::AttributeDataList &list)
+{
+	QList<GatoAttClient::AttributeData> items;
+	items.reserve(list.size());
+	foreach (const GatoAttClient::AttributeRef &ref, list) {
+		GatoAttClient::AttributeData item;
+		item.handle = ref.handle;
+		item.value = ref.value.toByteArray();
+		items.append(item);
+	}
+	return items;
+}
+
+static QList<GatoAttClient::AttributeGroupData> to_qlist(const GatoAttClient::AttributeGroupDataList &list)
+{
+	QList<GatoAttClient::AttributeGroupData> items;
+	items.reserve(list.size());
+	foreach (const GatoAttClient::AttributeGroupRef &ref, list) {
+		GatoAttClient::AttributeGroupData item;
+		item.start = ref.start;
+		item.end = ref.end;
+		item.value = ref.value.toByteArray();
+		items.append(item);
+	}
+	return items;
+}
+
+/** Same as slot_callback, but the receiver gets an owning QList copy of the PDU view. */
+template<typename List>
+static std::function<void(uint, const List&)> slot_list_callback(QObject *receiver, const char *member, const char *arg_type)
+{
+	if (!receiver) {
+		return std::function<void(uint, const List&)>();
+	}
+
+	const QByteArray method = remove_method_signature(member);
+	return [receiver, method, arg_type](uint req, const List &list) {
+		const auto items = to_qlist(list);
+		QMetaObject::invokeMethod(receiver, method.constData(),
+		                          Q_ARG(uint, req),
+		                          QGenericArgument(arg_type, &items));
+	};
+}
+
+/** ATT responses always use the opcode following the request's one. */
+static bool is_response_to(quint8 req_opcode, const QByteArray &pkt)
+{
+	const quint8 opcode = pkt[0];
+	if (opcode == AttOpErrorResponse) {
+		return pkt.size() >= 2 && quint8(pkt[1]) == req_opcode;
+	}
+	return opcode == req_opcode + 1;
+}
+
+/** Whether two request packets that start with a handle refer to the same one. */
+static bool same_handle(const QByteArray &a, const QByteArray &b)
+{
+	return a.size() >= 3 && b.size() >= 3 && a[1] == b[1] && a[2] == b[2];
+}
+
+static GatoAttClient::Error att_error(const QByteArray &pkt)
+{
+	if (pkt.size() < 5) {
+		return GatoAttClient::ErrorInvalidPdu;
+	}
+	return static_cast<GatoAttClient::Error>(quint8(pkt[4]));
+}
+
 GatoAttClient::GatoAttClient(QObject *parent) :
-	QObject(parent), socket(new GatoSocket(this)), cur_mtu(ATT_DEFAULT_LE_MTU), next_id(1),
-	required_sec(GatoSocket::SecurityLow)
+	GatoAttClient(0, parent)
+{
+}
+
+GatoAttClient::GatoAttClient(GatoTransport *backend, QObject *parent) :
+	QObject(parent), transport(backend ? backend : new GatoSocket(this)), cur_mtu(ATT_DEFAULT_LE_MTU), next_id(1),
+	request_in_flight(false), request_timer(new QTimer(this)), last_error(ErrorNone), write_coalescing(false),
+	required_sec(GatoTransport::SecurityLow)
 {
-	connect(socket, SIGNAL(connected()), SLOT(handleSocketConnected()));
-	connect(socket, SIGNAL(disconnected()), SLOT(handleSocketDisconnected()));
-	connect(socket, SIGNAL(readyRead()), SLOT(handleSocketReadyRead()));
+	for (int i = 0; i < PriorityCount; i++) {
+		lane_skips[i] = 0;
+	}
+
+	transport->setParent(this);
+
+	request_timer->setSingleShot(true);
+	request_timer->setInterval(ATT_TRANSACTION_TIMEOUT);
+
+	connect(transport, SIGNAL(connected()), SLOT(handleSocketConnected()));
+	connect(transport, SIGNAL(disconnected()), SLOT(handleSocketDisconnected()));
+	connect(transport, SIGNAL(readyRead()), SLOT(handleSocketReadyRead()));
+	connect(transport, SIGNAL(writeQueueDrained()), SIGNAL(writeQueueDrained()));
+	connect(request_timer, SIGNAL(timeout()), SLOT(handleRequestTimeout()));
 }
 
 GatoAttClient::~GatoAttClient()
 {
 }
 
-GatoSocket::State GatoAttClient::state() const
+GatoTransport::State GatoAttClient::state() const
 {
-	return socket->state();
+	return transport->state();
 }
 
-bool GatoAttClient::connectTo(const GatoAddress &addr, GatoSocket::SecurityLevel sec_level)
+bool GatoAttClient::connectTo(const GatoAddress &addr, GatoTransport::SecurityLevel sec_level)
 {
 	required_sec = sec_level;
-	return socket->connectTo(addr, ATT_CID);
+	return transport->connectTo(addr, ATT_CID);
 }
 
 void GatoAttClient::close()
 {
-	socket->close();
+	transport->close();
 }
 
 int GatoAttClient::mtu() const
@@ -108,59 +195,119 @@ int GatoAttClient::mtu() const
 	return cur_mtu;
 }
 
-uint GatoAttClient::request(int opcode, const QByteArray &data, QObject *receiver, const char *member)
+int GatoAttClient::requestTimeout() const
 {
-	Request req;
-	req.id = next_id++;
-	req.opcode = opcode;
-	req.pkt = data;
-	req.pkt.prepend(static_cast<char>(opcode));
-	req.receiver = receiver;
-	req.member = remove_method_signature(member);
+	return request_timer->interval();
+}
 
-	pending_requests.enqueue(req);
+void GatoAttClient::setRequestTimeout(int msecs)
+{
+	request_timer->setInterval(msecs);
+}
 
-	if (pending_requests.size() == 1) {
-		// So we can just send this request instead of waiting for others to complete
-		sendARequest();
-	}
+bool GatoAttClient::writeCoalescing() const
+{
+	return write_coalescing;
+}
 
-	return req.id;
+void GatoAttClient::setWriteCoalescing(bool enabled)
+{
+	write_coalescing = enabled;
+}
+
+GatoAttClient::Error GatoAttClient::lastError() const
+{
+	return last_error;
+}
+
+bool GatoAttClient::requestAborted() const
+{
+	return last_error == ErrorTimeout || last_error == ErrorDisconnected;
+}
+
+uint GatoAttClient::request(int opcode, const QByteArray &data, const ResponseCallback &callback, Priority priority)
+{
+	Request req;
+	req.response_cb = callback;
+	return enqueueRequest(req, opcode, data, priority);
 }
 
 void GatoAttClient::cancelRequest(uint id)
 {
-	QQueue<Request>::iterator it = pending_requests.begin();
-	while (it != pending_requests.end()) {
-		if (it->id == id) {
-			it = pending_requests.erase(it);
-		} else {
-			++it;
+	if (request_in_flight && detachWaiter(cur_request, id)) {
+		return;
+	}
+	if (request_in_flight && cur_request.id == id) {
+		// The response may still arrive, so keep the request around
+		// to swallow it, but forget about its callbacks.
+		Request cancelled;
+		cancelled.id = cur_request.id;
+		cancelled.opcode = cur_request.opcode;
+		if (cur_request.opcode == AttOpPrepareWriteRequest) {
+			// Make the server drop the fragments it has queued so far.
+			Request discard;
+			queueExecuteWrite(discard, false);
+		}
+		cur_request = cancelled;
+		return;
+	}
+
+	for (int i = 0; i < pending_continuations.size(); i++) {
+		if (detachWaiter(pending_continuations[i], id)) {
+			return;
+		}
+		if (pending_continuations.at(i).id == id) {
+			const bool writing = pending_continuations.at(i).opcode != AttOpReadBlobRequest;
+			pending_continuations.removeAt(i);
+			if (writing) {
+				// A long write whose first fragments the server already holds;
+				// have it drop them instead of carrying on with the write.
+				Request discard;
+				queueExecuteWrite(discard, false);
+			}
+			return;
+		}
+	}
+
+	for (int i = 0; i < PriorityCount; i++) {
+		QQueue<Request>::iterator it = pending_requests[i].begin();
+		while (it != pending_requests[i].end()) {
+			if (detachWaiter(*it, id)) {
+				++it;
+			} else if (it->id == id) {
+				it = pending_requests[i].erase(it);
+			} else {
+				++it;
+			}
 		}
 	}
 }
 
-uint GatoAttClient::requestExchangeMTU(quint16 client_mtu, QObject *receiver, const char *member)
+uint GatoAttClient::requestExchangeMTU(quint16 client_mtu, const ExchangeMTUCallback &callback)
 {
 	QByteArray data;
 	QDataStream s(&data, QIODevice::WriteOnly);
 	s.setByteOrder(QDataStream::LittleEndian);
 	s << client_mtu;
 
-	return request(AttOpExchangeMTURequest, data, receiver, member);
+	Request req;
+	req.mtu_cb = callback;
+	return enqueueRequest(req, AttOpExchangeMTURequest, data, PriorityInteractive);
 }
 
-uint GatoAttClient::requestFindInformation(GatoHandle start, GatoHandle end, QObject *receiver, const char *member)
+uint GatoAttClient::requestFindInformation(GatoHandle start, GatoHandle end, const FindInformationCallback &callback, Priority priority)
 {
 	QByteArray data;
 	QDataStream s(&data, QIODevice::WriteOnly);
 	s.setByteOrder(QDataStream::LittleEndian);
 	s << start << end;
 
-	return request(AttOpFindInformationRequest, data, receiver, member);
+	Request req;
+	req.info_cb = callback;
+	return enqueueRequest(req, AttOpFindInformationRequest, data, priority);
 }
 
-uint GatoAttClient::requestFindByTypeValue(GatoHandle start, GatoHandle end, const GatoUUID &uuid, const QByteArray &value, QObject *receiver, const char *member)
+uint GatoAttClient::requestFindByTypeValue(GatoHandle start, GatoHandle end, const GatoUUID &uuid, const QByteArray &value, const FindByTypeValueCallback &callback, Priority priority)
 {
 	QByteArray data;
 	QDataStream s(&data, QIODevice::WriteOnly);
@@ -178,10 +325,12 @@ uint GatoAttClient::requestFindByTypeValue(GatoHandle start, GatoHandle end, con
 
 	s << value;
 
-	return request(AttOpFindByTypeValueRequest, data, receiver, member);
+	Request req;
+	req.handle_info_cb = callback;
+	return enqueueRequest(req, AttOpFindByTypeValueRequest, data, priority);
 }
 
-uint GatoAttClient::requestReadByType(GatoHandle start, GatoHandle end, const GatoUUID &uuid, QObject *receiver, const char *member)
+uint GatoAttClient::requestReadByType(GatoHandle start, GatoHandle end, const GatoUUID &uuid, const ReadByTypeCallback &callback, Priority priority)
 {
 	QByteArray data;
 	QDataStream s(&data, QIODevice::WriteOnly);
@@ -189,20 +338,24 @@ uint GatoAttClient::requestReadByType(GatoHandle start, GatoHandle end, const Ga
 	s << start << end;
 	write_gatouuid(s, uuid, true, false);
 
-	return request(AttOpReadByTypeRequest, data, receiver, member);
+	Request req;
+	req.attr_cb = callback;
+	return enqueueRequest(req, AttOpReadByTypeRequest, data, priority);
 }
 
-uint GatoAttClient::requestRead(GatoHandle handle, QObject *receiver, const char *member)
+uint GatoAttClient::requestRead(GatoHandle handle, const ReadCallback &callback, Priority priority)
 {
 	QByteArray data;
 	QDataStream s(&data, QIODevice::WriteOnly);
 	s.setByteOrder(QDataStream::LittleEndian);
 	s << handle;
 
-	return request(AttOpReadRequest, data, receiver, member);
+	Request req;
+	req.read_cb = callback;
+	return enqueueRequest(req, AttOpReadRequest, data, priority);
 }
 
-uint GatoAttClient::requestReadByGroupType(GatoHandle start, GatoHandle end, const GatoUUID &uuid, QObject *receiver, const char *member)
+uint GatoAttClient::requestReadByGroupType(GatoHandle start, GatoHandle end, const GatoUUID &uuid, const ReadByGroupTypeCallback &callback, Priority priority)
 {
 	QByteArray data;
 	QDataStream s(&data, QIODevice::WriteOnly);
@@ -210,10 +363,12 @@ uint GatoAttClient::requestReadByGroupType(GatoHandle start, GatoHandle end, con
 	s << start << end;
 	write_gatouuid(s, uuid, true, false);
 
-	return request(AttOpReadByGroupTypeRequest, data, receiver, member);
+	Request req;
+	req.group_cb = callback;
+	return enqueueRequest(req, AttOpReadByGroupTypeRequest, data, priority);
 }
 
-uint GatoAttClient::requestWrite(GatoHandle handle, const QByteArray &value, QObject *receiver, const char *member)
+uint GatoAttClient::requestWrite(GatoHandle handle, const QByteArray &value, const WriteCallback &callback, Priority priority)
 {
 	QByteArray data;
 	QDataStream s(&data, QIODevice::WriteOnly);
@@ -221,48 +376,390 @@ uint GatoAttClient::requestWrite(GatoHandle handle, const QByteArray &value, QOb
 	s << handle;
 	s.writeRawData(value.constData(), value.length());
 
-	return request(AttOpWriteRequest, data, receiver, member);
+	Request req;
+	req.write_cb = callback;
+	return enqueueRequest(req, AttOpWriteRequest, data, priority);
+}
+
+uint GatoAttClient::requestReadMultiple(const QList<GatoHandle> &handles, const ReadCallback &callback, Priority priority)
+{
+	QByteArray data;
+	QDataStream s(&data, QIODevice::WriteOnly);
+	s.setByteOrder(QDataStream::LittleEndian);
+	foreach (GatoHandle handle, handles) {
+		s << handle;
+	}
+
+	Request req;
+	req.read_cb = callback;
+	return enqueueRequest(req, AttOpReadMultipleRequest, data, priority);
+}
+
+uint GatoAttClient::requestReadMultipleVariable(const QList<GatoHandle> &handles, const ReadMultipleVariableCallback &callback, Priority priority)
+{
+	QByteArray data;
+	QDataStream s(&data, QIODevice::WriteOnly);
+	s.setByteOrder(QDataStream::LittleEndian);
+	foreach (GatoHandle handle, handles) {
+		s << handle;
+	}
+
+	Request req;
+	req.multi_cb = callback;
+	return enqueueRequest(req, AttOpReadMultipleVariableRequest, data, priority);
+}
+
+uint GatoAttClient::requestReadLong(GatoHandle handle, const ReadCallback &callback, int max_length, Priority priority)
+{
+	QByteArray data;
+	QDataStream s(&data, QIODevice::WriteOnly);
+	s.setByteOrder(QDataStream::LittleEndian);
+	s << handle;
+
+	Request req;
+	req.read_cb = callback;
+	req.long_read = true;
+	req.max_length = max_length;
+	return enqueueRequest(req, AttOpReadRequest, data, priority);
+}
+
+uint GatoAttClient::requestReadLongStream(GatoHandle handle, const ReadChunkCallback &sink, int max_length, Priority priority)
+{
+	QByteArray data;
+	QDataStream s(&data, QIODevice::WriteOnly);
+	s.setByteOrder(QDataStream::LittleEndian);
+	s << handle;
+
+	Request req;
+	req.chunk_cb = sink;
+	req.long_read = true;
+	req.max_length = max_length;
+	return enqueueRequest(req, AttOpReadRequest, data, priority);
+}
+
+uint GatoAttClient::requestWriteLong(GatoHandle handle, const QByteArray &value, const WriteCallback &callback, bool reliable, Priority priority)
+{
+	if (value.isEmpty()) {
+		// Prepare Write needs at least one byte; nothing to split anyway.
+		return requestWrite(handle, value, callback, priority);
+	}
+
+	QByteArray data;
+	QDataStream s(&data, QIODevice::WriteOnly);
+	s.setByteOrder(QDataStream::LittleEndian);
+	s << handle << quint16(0);
+	s.writeRawData(value.constData(), qMin(value.length(), cur_mtu - 5));
+
+	Request req;
+	req.write_cb = callback;
+	req.value = value;
+	req.reliable = reliable;
+	return enqueueRequest(req, AttOpPrepareWriteRequest, data, priority);
+}
+
+uint GatoAttClient::request(int opcode, const QByteArray &data, QObject *receiver, const char *member)
+{
+	ResponseCallback callback;
+	if (receiver) {
+		// This variant never passed the request id to the receiver.
+		const QByteArray method = remove_method_signature(member);
+		callback = [receiver, method](uint req, const QByteArray &response) {
+			Q_UNUSED(req);
+			QMetaObject::invokeMethod(receiver, method.constData(),
+			                          Q_ARG(const QByteArray&, response));
+		};
+	}
+	return request(opcode, data, callback);
+}
+
+uint GatoAttClient::requestExchangeMTU(quint16 client_mtu, QObject *receiver, const char *member)
+{
+	return requestExchangeMTU(client_mtu,
+	                          slot_callback<quint16>(receiver, member, "quint16"));
+}
+
+uint GatoAttClient::requestFindInformation(GatoHandle start, GatoHandle end, QObject *receiver, const char *member)
+{
+	return requestFindInformation(start, end,
+	                              slot_list_callback<InformationDataList>(receiver, member, "QList<GatoAttClient::InformationData>"));
+}
+
+uint GatoAttClient::requestFindByTypeValue(GatoHandle start, GatoHandle end, const GatoUUID &uuid, const QByteArray &value, QObject *receiver, const char *member)
+{
+	return requestFindByTypeValue(start, end, uuid, value,
+	                              slot_list_callback<HandleInformationList>(receiver, member, "QList<GatoAttClient::HandleInformation>"));
+}
+
+uint GatoAttClient::requestReadByType(GatoHandle start, GatoHandle end, const GatoUUID &uuid, QObject *receiver, const char *member)
+{
+	return requestReadByType(start, end, uuid,
+	                         slot_list_callback<AttributeDataList>(receiver, member, "QList<GatoAttClient::AttributeData>"));
+}
+
+uint GatoAttClient::requestRead(GatoHandle handle, QObject *receiver, const char *member)
+{
+	return requestRead(handle,
+	                   slot_callback<const QByteArray&>(receiver, member, "QByteArray"));
+}
+
+uint GatoAttClient::requestReadByGroupType(GatoHandle start, GatoHandle end, const GatoUUID &uuid, QObject *receiver, const char *member)
+{
+	return requestReadByGroupType(start, end, uuid,
+	                              slot_list_callback<AttributeGroupDataList>(receiver, member, "QList<GatoAttClient::AttributeGroupData>"));
+}
+
+uint GatoAttClient::requestWrite(GatoHandle handle, const QByteArray &value, QObject *receiver, const char *member)
+{
+	return requestWrite(handle, value,
+	                    slot_callback<bool>(receiver, member, "bool"));
 }
 
-void GatoAttClient::command(int opcode, const QByteArray &data)
+bool GatoAttClient::command(int opcode, const QByteArray &data)
 {
 	QByteArray packet = data;
 	packet.prepend(static_cast<char>(opcode));
 
-	socket->send(packet);
-
 #if PROTOCOL_DEBUG
 	qDebug() << "Wrote" << packet.size() << "bytes (command)" << packet.toHex();
 #endif
+
+	return transport->send(packet);
 }
 
-void GatoAttClient::commandWrite(GatoHandle handle, const QByteArray &value)
+bool GatoAttClient::commandWrite(GatoHandle handle, const QByteArray &value)
 {
+	if (!transport->canWrite()) {
+		return false;
+	}
+
 	QByteArray data;
 	QDataStream s(&data, QIODevice::WriteOnly);
 	s.setByteOrder(QDataStream::LittleEndian);
 	s << handle;
 	s.writeRawData(value.constData(), value.length());
 
-	command(AttOpWriteCommand, data);
+	return command(AttOpWriteCommand, data);
+}
+
+bool GatoAttClient::canWriteCommand() const
+{
+	return transport->canWrite();
+}
+
+int GatoAttClient::writeHighWaterMark() const
+{
+	return transport->writeHighWaterMark();
+}
+
+void GatoAttClient::setWriteHighWaterMark(int bytes)
+{
+	transport->setWriteHighWaterMark(bytes);
+}
+
+int GatoAttClient::pendingWriteBytes() const
+{
+	return transport->pendingWriteBytes();
+}
+
+int GatoAttClient::pendingWritePackets() const
+{
+	return transport->pendingWritePackets();
+}
+
+uint GatoAttClient::enqueueRequest(Request &req, int opcode, const QByteArray &data, Priority priority)
+{
+	if (transport->state() == GatoTransport::StateDisconnected) {
+		qWarning() << "Not connected";
+		return 0;
+	}
+
+	req.id = next_id++;
+	req.opcode = opcode;
+	req.pkt = data;
+	req.pkt.prepend(static_cast<char>(opcode));
+
+	if (mergeRequest(req, priority)) {
+		return req.id;
+	}
+
+	req.priority = priority;
+	pending_requests[priority].enqueue(req);
+
+	if (!request_in_flight) {
+		// So we can just send this request instead of waiting for others to complete
+		sendARequest();
+	}
+
+	return req.id;
+}
+
+/** Tries to fold req into an equivalent request that is already queued or in flight.
+ *  Returns true if it did, in which case req must not be queued itself. */
+bool GatoAttClient::mergeRequest(Request &req, Priority priority)
+{
+	if (req.opcode == AttOpReadRequest && !req.chunk_cb) {
+		// A pending write to this handle would make an earlier read return a stale value.
+		if (isWritePending(req.pkt)) {
+			return false;
+		}
+
+		Waiter waiter;
+		waiter.id = req.id;
+		waiter.read_cb = req.read_cb;
+
+		if (request_in_flight && cur_request.opcode == AttOpReadRequest && cur_request.pkt == req.pkt &&
+		        cur_request.long_read == req.long_read && cur_request.max_length == req.max_length &&
+		        !cur_request.chunk_cb) {
+			cur_request.waiters.append(waiter);
+			return true;
+		}
+
+		for (int i = 0; i < PriorityCount; i++) {
+			QQueue<Request> &lane = pending_requests[i];
+			for (int j = 0; j < lane.size(); j++) {
+				Request &other = lane[j];
+				if (other.opcode == AttOpReadRequest && other.pkt == req.pkt &&
+				        other.long_read == req.long_read && other.max_length == req.max_length &&
+				        !other.chunk_cb) {
+					other.waiters.append(waiter);
+					if (priority < i) {
+						// Move it up to the most urgent of its waiters
+						Request merged = lane.takeAt(j);
+						merged.priority = priority;
+						pending_requests[priority].enqueue(merged);
+					}
+					return true;
+				}
+			}
+		}
+	} else if (req.opcode == AttOpWriteRequest && write_coalescing) {
+		for (int i = 0; i < PriorityCount; i++) {
+			QQueue<Request> &lane = pending_requests[i];
+			for (int j = 0; j < lane.size(); j++) {
+				Request &other = lane[j];
+				if (other.opcode == AttOpWriteRequest && same_handle(other.pkt, req.pkt)) {
+					// Last writer wins; keep the slot but send the newest value.
+					Waiter waiter;
+					waiter.id = other.id;
+					waiter.write_cb = other.write_cb;
+					other.waiters.append(waiter);
+					other.id = req.id;
+					other.pkt = req.pkt;
+					other.write_cb = req.write_cb;
+					if (priority < i) {
+						Request merged = lane.takeAt(j);
+						merged.priority = priority;
+						pending_requests[priority].enqueue(merged);
+					}
+					return true;
+				}
+			}
+		}
+	}
+
+	return false;
+}
+
+/** If id is one of the completions of a merged request, forgets about it and returns true.
+ *  The request itself is kept, since someone else is still waiting for it. */
+bool GatoAttClient::detachWaiter(Request &req, uint id)
+{
+	if (req.waiters.isEmpty()) {
+		return false;
+	}
+
+	if (req.id == id) {
+		const Waiter waiter = req.waiters.takeFirst();
+		req.id = waiter.id;
+		req.read_cb = waiter.read_cb;
+		req.write_cb = waiter.write_cb;
+		return true;
+	}
+
+	for (int i = 0; i < req.waiters.size(); i++) {
+		if (req.waiters.at(i).id == id) {
+			req.waiters.removeAt(i);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/** Whether a write to the handle in the given request packet is queued or in flight. */
+bool GatoAttClient::isWritePending(const QByteArray &handle_pkt) const
+{
+	if (request_in_flight && (cur_request.opcode == AttOpWriteRequest || cur_request.opcode == AttOpPrepareWriteRequest) &&
+	        same_handle(cur_request.pkt, handle_pkt)) {
+		return true;
+	}
+
+	for (int i = 0; i < PriorityCount; i++) {
+		foreach (const Request &other, pending_requests[i]) {
+			if ((other.opcode == AttOpWriteRequest || other.opcode == AttOpPrepareWriteRequest) &&
+			        same_handle(other.pkt, handle_pkt)) {
+				return true;
+			}
+		}
+	}
+
+	return false;
 }
 
 void GatoAttClient::sendARequest()
 {
-	if (pending_requests.isEmpty()) {
+	if (request_in_flight) {
 		return;
 	}
 
-	Request &req = pending_requests.head();
-	socket->send(req.pkt);
+	// Only one request may be outstanding at a time.
+	if (!pending_continuations.isEmpty()) {
+		cur_request = pending_continuations.dequeue();
+	} else {
+		int lane = -1;
+		for (int i = 0; i < PriorityCount; i++) {
+			if (!pending_requests[i].isEmpty() && lane_skips[i] >= ATT_MAX_LANE_SKIPS) {
+				lane = i;
+				break;
+			}
+		}
+		if (lane < 0) {
+			for (int i = 0; i < PriorityCount; i++) {
+				if (!pending_requests[i].isEmpty()) {
+					lane = i;
+					break;
+				}
+			}
+		}
+		if (lane < 0) {
+			return;
+		}
+
+		for (int i = 0; i < PriorityCount; i++) {
+			if (i == lane) {
+				lane_skips[i] = 0;
+			} else if (!pending_requests[i].isEmpty()) {
+				lane_skips[i]++;
+			}
+		}
+
+		cur_request = pending_requests[lane].dequeue();
+	}
+	request_in_flight = true;
+	request_timer->start();
+
+	transport->send(cur_request.pkt);
 
 #if PROTOCOL_DEBUG
-	qDebug() << "Wrote" << req.pkt.size() << "bytes (request)" << req.pkt.toHex();
+	qDebug() << "Wrote" << cur_request.pkt.size() << "bytes (request)" << cur_request.pkt.toHex();
 #endif
 }
 
-bool GatoAttClient::handleEvent(const QByteArray &event)
+/** Values are handed out in place: the header is stripped from the received
+ *  buffer itself, so the socket can reuse it unless a receiver keeps a copy. */
+bool GatoAttClient::handleEvent(QByteArray &event)
 {
+	static const QByteArray confirmation(1, char(AttOpHandleValueConfirmation));
 	const char *data = event.constData();
 	quint8 opcode = event[0];
 	GatoHandle handle;
@@ -270,39 +767,37 @@ bool GatoAttClient::handleEvent(const QByteArray &event)
 	switch (opcode) {
 	case AttOpHandleValueNotification:
 		handle = read_le<GatoHandle>(&data[1]);
-		emit attributeUpdated(handle, event.mid(3), false);
+		event.remove(0, 3);
+		emit attributeUpdated(handle, event, false);
 		return true;
 	case AttOpHandleValueIndication:
 		handle = read_le<GatoHandle>(&data[1]);
 
 		// Send the confirmation back
-		command(AttOpHandleValueConfirmation, QByteArray());
+		transport->send(confirmation);
 
-		emit attributeUpdated(handle, event.mid(3), true);
+		event.remove(0, 3);
+		emit attributeUpdated(handle, event, true);
 		return true;
 	default:
 		return false;
 	}
 }
 
-bool GatoAttClient::handleResponse(const Request &req, const QByteArray &response)
+bool GatoAttClient::handleResponse(Request &req, const QByteArray &response)
 {
+	last_error = ErrorNone;
+
 	// If we know the request, we can provide a decoded answer
 	switch (req.opcode) {
 	case AttOpExchangeMTURequest:
 		if (response[0] == AttOpExchangeMTUResponse) {
-			if (req.receiver) {
-				QMetaObject::invokeMethod(req.receiver, req.member.constData(),
-				                          Q_ARG(uint, req.id),
-				                          Q_ARG(quint16, read_le<quint16>(response.constData() + 1)));
+			if (req.mtu_cb) {
+				req.mtu_cb(req.id, read_le<quint16>(response.constData() + 1));
 			}
 			return true;
 		} else if (response[0] == AttOpErrorResponse && response[1] == AttOpExchangeMTURequest) {
-			if (req.receiver) {
-				QMetaObject::invokeMethod(req.receiver, req.member.constData(),
-				                          Q_ARG(uint, req.id),
-					                      Q_ARG(quint16, 0));
-			}
+			failRequest(req, att_error(response));
 			return true;
 		} else {
 			return false;
@@ -310,18 +805,12 @@ bool GatoAttClient::handleResponse(const Request &req, const QByteArray &respons
 		break;
 	case AttOpFindInformationRequest:
 		if (response[0] == AttOpFindInformationResponse) {
-			if (req.receiver) {
-				QMetaObject::invokeMethod(req.receiver, req.member.constData(),
-				                          Q_ARG(uint, req.id),
-				                          Q_ARG(QList<GatoAttClient::InformationData>, parseInformationData(response.mid(1))));
+			if (req.info_cb) {
+				req.info_cb(req.id, parseInformationData(response.constData() + 1, response.size() - 1));
 			}
 			return true;
 		} else if (response[0] == AttOpErrorResponse && response[1] == AttOpFindInformationRequest) {
-			if (req.receiver) {
-				QMetaObject::invokeMethod(req.receiver, req.member.constData(),
-				                          Q_ARG(uint, req.id),
-				                          Q_ARG(QList<GatoAttClient::InformationData>, QList<InformationData>()));
-			}
+			failRequest(req, att_error(response));
 			return true;
 		} else {
 			return false;
@@ -329,18 +818,12 @@ bool GatoAttClient::handleResponse(const Request &req, const QByteArray &respons
 		break;
 	case AttOpFindByTypeValueRequest:
 		if (response[0] == AttOpFindByTypeValueResponse) {
-			if (req.receiver) {
-				QMetaObject::invokeMethod(req.receiver, req.member.constData(),
-				                          Q_ARG(uint, req.id),
-				                          Q_ARG(QList<GatoAttClient::HandleInformation>, parseHandleInformation(response.mid(1))));
+			if (req.handle_info_cb) {
+				req.handle_info_cb(req.id, parseHandleInformation(response.constData() + 1, response.size() - 1));
 			}
 			return true;
 		} else if (response[0] == AttOpErrorResponse && response[1] == AttOpFindByTypeValueRequest) {
-			if (req.receiver) {
-				QMetaObject::invokeMethod(req.receiver, req.member.constData(),
-				                          Q_ARG(uint, req.id),
-				                          Q_ARG(QList<GatoAttClient::HandleInformation>, QList<HandleInformation>()));
-			}
+			failRequest(req, att_error(response));
 			return true;
 		} else {
 			return false;
@@ -348,18 +831,12 @@ bool GatoAttClient::handleResponse(const Request &req, const QByteArray &respons
 		break;
 	case AttOpReadByTypeRequest:
 		if (response[0] == AttOpReadByTypeResponse) {
-			if (req.receiver) {
-				QMetaObject::invokeMethod(req.receiver, req.member.constData(),
-				                          Q_ARG(uint, req.id),
-				                          Q_ARG(QList<GatoAttClient::AttributeData>, parseAttributeData(response.mid(1))));
+			if (req.attr_cb) {
+				req.attr_cb(req.id, parseAttributeData(response.constData() + 1, response.size() - 1));
 			}
 			return true;
 		} else if (response[0] == AttOpErrorResponse && response[1] == AttOpReadByTypeRequest) {
-			if (req.receiver) {
-				QMetaObject::invokeMethod(req.receiver, req.member.constData(),
-				                          Q_ARG(uint, req.id),
-				                          Q_ARG(QList<GatoAttClient::AttributeData>, QList<AttributeData>()));
-			}
+			failRequest(req, att_error(response));
 			return true;
 		} else {
 			return false;
@@ -367,37 +844,71 @@ bool GatoAttClient::handleResponse(const Request &req, const QByteArray &respons
 		break;
 	case AttOpReadRequest:
 		if (response[0] == AttOpReadResponse) {
-			if (req.receiver) {
-				QMetaObject::invokeMethod(req.receiver, req.member.constData(),
-				                          Q_ARG(uint, req.id),
-				                          Q_ARG(QByteArray, response.mid(1)));
+			if (req.long_read) {
+				continueLongRead(req, response);
+			} else {
+				completeRead(req, response.mid(1));
 			}
 			return true;
 		} else if (response[0] == AttOpErrorResponse && response[1] == AttOpReadRequest) {
-			if (req.receiver) {
-				QMetaObject::invokeMethod(req.receiver, req.member.constData(),
-				                          Q_ARG(uint, req.id),
-				                          Q_ARG(QByteArray, QByteArray()));
+			failRequest(req, att_error(response));
+			return true;
+		} else {
+			return false;
+		}
+		break;
+	case AttOpReadBlobRequest:
+		if (response[0] == AttOpReadBlobResponse) {
+			continueLongRead(req, response);
+			return true;
+		} else if (response[0] == AttOpErrorResponse && response[1] == AttOpReadBlobRequest) {
+			const Error error = att_error(response);
+			if (error == ErrorAttributeNotLong || error == ErrorInvalidOffset) {
+				// The value length was a multiple of the chunk size,
+				// so the previous chunk was already the last one.
+				finishLongRead(req);
+			} else {
+				failRequest(req, error);
+			}
+			return true;
+		} else {
+			return false;
+		}
+		break;
+	case AttOpReadMultipleRequest:
+		if (response[0] == AttOpReadMultipleResponse) {
+			if (req.read_cb) {
+				req.read_cb(req.id, response.mid(1));
+			}
+			return true;
+		} else if (response[0] == AttOpErrorResponse && response[1] == AttOpReadMultipleRequest) {
+			failRequest(req, att_error(response));
+			return true;
+		} else {
+			return false;
+		}
+		break;
+	case AttOpReadMultipleVariableRequest:
+		if (response[0] == AttOpReadMultipleVariableResponse) {
+			if (req.multi_cb) {
+				req.multi_cb(req.id, parseLengthValueList(response.constData() + 1, response.size() - 1));
 			}
 			return true;
+		} else if (response[0] == AttOpErrorResponse && response[1] == AttOpReadMultipleVariableRequest) {
+			failRequest(req, att_error(response));
+			return true;
 		} else {
 			return false;
 		}
 		break;
 	case AttOpReadByGroupTypeRequest:
 		if (response[0] == AttOpReadByGroupTypeResponse) {
-			if (req.receiver) {
-				QMetaObject::invokeMethod(req.receiver, req.member.constData(),
-				                          Q_ARG(uint, req.id),
-				                          Q_ARG(QList<GatoAttClient::AttributeGroupData>, parseAttributeGroupData(response.mid(1))));
+			if (req.group_cb) {
+				req.group_cb(req.id, parseAttributeGroupData(response.constData() + 1, response.size() - 1));
 			}
 			return true;
 		} else if (response[0] == AttOpErrorResponse && response[1] == AttOpReadByGroupTypeRequest) {
-			if (req.receiver) {
-				QMetaObject::invokeMethod(req.receiver, req.member.constData(),
-				                          Q_ARG(uint, req.id),
-				                          Q_ARG(QList<GatoAttClient::AttributeGroupData>, QList<AttributeGroupData>()));
-			}
+			failRequest(req, att_error(response));
 			return true;
 		} else {
 			return false;
@@ -405,36 +916,274 @@ bool GatoAttClient::handleResponse(const Request &req, const QByteArray &respons
 		break;
 	case AttOpWriteRequest:
 		if (response[0] == AttOpWriteResponse) {
-			if (req.receiver) {
-				QMetaObject::invokeMethod(req.receiver, req.member.constData(),
-				                          Q_ARG(uint, req.id),
-				                          Q_ARG(bool, true));
-			}
+			completeWrite(req, true);
 			return true;
 		} else if (response[0] == AttOpErrorResponse && response[1] == AttOpWriteRequest) {
-			if (req.receiver) {
-				QMetaObject::invokeMethod(req.receiver, req.member.constData(),
-				                          Q_ARG(uint, req.id),
-				                          Q_ARG(bool, false));
+			failRequest(req, att_error(response));
+			return true;
+		} else {
+			return false;
+		}
+		break;
+	case AttOpPrepareWriteRequest:
+		if (response[0] == AttOpPrepareWriteResponse) {
+			continueLongWrite(req, response);
+			return true;
+		} else if (response[0] == AttOpErrorResponse && response[1] == AttOpPrepareWriteRequest) {
+			// Discard whatever fragments were already accepted.
+			Request discard;
+			queueExecuteWrite(discard, false);
+			failRequest(req, att_error(response));
+			return true;
+		} else {
+			return false;
+		}
+		break;
+	case AttOpExecuteWriteRequest:
+		if (response[0] == AttOpExecuteWriteResponse) {
+			if (req.write_cb) {
+				req.write_cb(req.id, true);
 			}
 			return true;
+		} else if (response[0] == AttOpErrorResponse && response[1] == AttOpExecuteWriteRequest) {
+			failRequest(req, att_error(response));
+			return true;
 		} else {
 			return false;
 		}
 		break;
 	default: // Otherwise just send a QByteArray.
-		if (req.receiver) {
-			QMetaObject::invokeMethod(req.receiver, req.member.constData(),
-			                          Q_ARG(const QByteArray&, response));
+		if (req.response_cb) {
+			req.response_cb(req.id, response);
 		}
 		return true;
 	}
 }
 
-QList<GatoAttClient::InformationData> GatoAttClient::parseInformationData(const QByteArray &data)
+void GatoAttClient::continueLongRead(Request &req, const QByteArray &response)
+{
+	ValueRef chunk;
+	chunk.data = response.constData() + 1;
+	chunk.size = response.size() - 1;
+
+	// A response that does not fill the PDU means there is nothing more to read
+	bool last = chunk.size < cur_mtu - 1;
+	if (req.max_length >= 0 && req.offset + chunk.size >= req.max_length) {
+		chunk.size = req.max_length - req.offset;
+		last = true;
+	}
+	if (!req.chunk_cb && !req.read_cb) {
+		// Cancelled while in flight
+		return;
+	}
+
+	const int offset = req.offset;
+	req.offset += chunk.size;
+
+	if (req.chunk_cb) {
+		if (!last) {
+			// Queue the follow up before handing out the chunk,
+			// so that the sink may still cancel the request.
+			Request next = req;
+			next.opcode = AttOpReadBlobRequest;
+			next.pkt.resize(1 + sizeof(GatoHandle) + sizeof(quint16));
+			next.pkt[0] = AttOpReadBlobRequest;
+			write_le<quint16>(next.offset, next.pkt.data() + 1 + sizeof(GatoHandle));
+			pending_continuations.prepend(next);
+		}
+		last_error = ErrorNone;
+		req.chunk_cb(req.id, offset, chunk, last);
+	} else {
+		if (offset == 0 && !last && req.max_length >= 0) {
+			req.value.reserve(req.max_length);
+		}
+		req.value.append(chunk.data, chunk.size);
+		if (last) {
+			completeRead(req, req.value);
+		} else {
+			// Continue right away, ahead of any other request, so that no write
+			// can slip in between the fragments and tear the value.
+			req.opcode = AttOpReadBlobRequest;
+			req.pkt.resize(1 + sizeof(GatoHandle) + sizeof(quint16));
+			req.pkt[0] = AttOpReadBlobRequest;
+			write_le<quint16>(req.offset, req.pkt.data() + 1 + sizeof(GatoHandle));
+			pending_continuations.prepend(req);
+		}
+	}
+}
+
+void GatoAttClient::finishLongRead(Request &req)
+{
+	last_error = ErrorNone;
+	if (req.chunk_cb) {
+		req.chunk_cb(req.id, req.offset, ValueRef(), true);
+	} else {
+		completeRead(req, req.value);
+	}
+}
+
+void GatoAttClient::completeRead(const Request &req, const QByteArray &value)
+{
+	if (req.read_cb) {
+		req.read_cb(req.id, value);
+	}
+	foreach (const Waiter &waiter, req.waiters) {
+		if (waiter.read_cb) {
+			waiter.read_cb(waiter.id, value);
+		}
+	}
+}
+
+void GatoAttClient::completeWrite(const Request &req, bool ok)
+{
+	if (req.write_cb) {
+		req.write_cb(req.id, ok);
+	}
+	foreach (const Waiter &waiter, req.waiters) {
+		if (waiter.write_cb) {
+			waiter.write_cb(waiter.id, ok);
+		}
+	}
+}
+
+void GatoAttClient::continueLongWrite(Request &req, const QByteArray &response)
+{
+	if (req.value.isEmpty()) {
+		// Cancelled while in flight; cancelRequest() already queued the discard.
+		return;
+	}
+
+	if (req.reliable) {
+		// The server echoes handle, offset and fragment back.
+		if (response.size() != req.pkt.size() ||
+		        memcmp(response.constData() + 1, req.pkt.constData() + 1, req.pkt.size() - 1) != 0) {
+			qWarning() << "Reliable write fragment was not echoed back correctly";
+			Request discard;
+			queueExecuteWrite(discard, false);
+			failRequest(req, ErrorWriteVerificationFailed);
+			return;
+		}
+	}
+
+	req.offset += req.pkt.size() - (1 + sizeof(GatoHandle) + sizeof(quint16));
+
+	if (req.offset < req.value.size()) {
+		preparePartialWrite(req);
+		pending_continuations.prepend(req);
+	} else {
+		queueExecuteWrite(req, true);
+	}
+}
+
+void GatoAttClient::preparePartialWrite(Request &req)
+{
+	const int header_len = 1 + sizeof(GatoHandle) + sizeof(quint16);
+	const int part = qMin(req.value.size() - req.offset, cur_mtu - header_len);
+
+	// Keeps the handle already in the packet
+	req.opcode = AttOpPrepareWriteRequest;
+	req.pkt.resize(header_len + part);
+	req.pkt[0] = AttOpPrepareWriteRequest;
+	write_le<quint16>(req.offset, req.pkt.data() + 1 + sizeof(GatoHandle));
+	memcpy(req.pkt.data() + header_len, req.value.constData() + req.offset, part);
+}
+
+void GatoAttClient::queueExecuteWrite(Request &req, bool commit)
+{
+	req.opcode = AttOpExecuteWriteRequest;
+	req.pkt.resize(2);
+	req.pkt[0] = AttOpExecuteWriteRequest;
+	req.pkt[1] = commit ? 1 : 0;
+	pending_continuations.prepend(req);
+}
+
+void GatoAttClient::failRequest(const Request &req, Error error)
+{
+	last_error = error;
+
+	switch (req.opcode) {
+	case AttOpExchangeMTURequest:
+		if (req.mtu_cb) {
+			req.mtu_cb(req.id, 0);
+		}
+		break;
+	case AttOpFindInformationRequest:
+		if (req.info_cb) {
+			req.info_cb(req.id, InformationDataList());
+		}
+		break;
+	case AttOpFindByTypeValueRequest:
+		if (req.handle_info_cb) {
+			req.handle_info_cb(req.id, HandleInformationList());
+		}
+		break;
+	case AttOpReadByTypeRequest:
+		if (req.attr_cb) {
+			req.attr_cb(req.id, AttributeDataList());
+		}
+		break;
+	case AttOpReadRequest:
+	case AttOpReadBlobRequest:
+	case AttOpReadMultipleRequest:
+		if (req.chunk_cb) {
+			req.chunk_cb(req.id, req.offset, ValueRef(), true);
+		} else {
+			completeRead(req, QByteArray());
+		}
+		break;
+	case AttOpReadByGroupTypeRequest:
+		if (req.group_cb) {
+			req.group_cb(req.id, AttributeGroupDataList());
+		}
+		break;
+	case AttOpReadMultipleVariableRequest:
+		if (req.multi_cb) {
+			req.multi_cb(req.id, LengthValueList());
+		}
+		break;
+	case AttOpWriteRequest:
+	case AttOpPrepareWriteRequest:
+	case AttOpExecuteWriteRequest:
+		completeWrite(req, false);
+		break;
+	default:
+		if (req.response_cb) {
+			req.response_cb(req.id, QByteArray());
+		}
+		break;
+	}
+
+	last_error = ErrorNone;
+}
+
+void GatoAttClient::abortRequests(Error error)
+{
+	QQueue<Request> requests;
+	requests.swap(pending_continuations);
+	for (int i = 0; i < PriorityCount; i++) {
+		requests.append(pending_requests[i]);
+		pending_requests[i].clear();
+		lane_skips[i] = 0;
+	}
+	if (request_in_flight) {
+		requests.prepend(cur_request);
+		cur_request = Request();
+		request_in_flight = false;
+		request_timer->stop();
+	}
+
+	foreach (const Request &req, requests) {
+		failRequest(req, error);
+	}
+}
+
+GatoAttClient::InformationDataList GatoAttClient::parseInformationData(const char *data, int len)
 {
+	if (len < 1) {
+		return InformationDataList();
+	}
+
 	const int format = data[0];
-	QList<InformationData> list;
 	int item_len;
 
 	switch (format) {
@@ -446,95 +1195,52 @@ QList<GatoAttClient::InformationData> GatoAttClient::parseInformationData(const
 		break;
 	default:
 		qWarning() << "Unknown InformationData format!";
-		return list;
-	}
-
-	int items = (data.size() - 1) / item_len;
-	list.reserve(items);
-
-	int pos = 1;
-	const char *s = data.constData();
-	for (int i = 0; i < items; i++) {
-		InformationData d;
-		QByteArray uuid;
-		d.handle = read_le<GatoHandle>(&s[pos]);
-		switch (format) {
-		case 1:
-			uuid = data.mid(pos + 2, 2);
-			break;
-		case 2:
-			uuid = data.mid(pos + 2, 16);
-			break;
-		}
-		d.uuid = bytearray_to_gatouuid(uuid);
-
-		list.append(d);
-
-		pos += item_len;
+		return InformationDataList();
 	}
 
-	return list;
+	return InformationDataList(&data[1], item_len, (len - 1) / item_len);
 }
 
-QList<GatoAttClient::HandleInformation> GatoAttClient::parseHandleInformation(const QByteArray &data)
+GatoAttClient::HandleInformationList GatoAttClient::parseHandleInformation(const char *data, int len)
 {
-	const int item_len = 2;
-	const int items = data.size() / item_len;
-	QList<HandleInformation> list;
-	list.reserve(items);
-
-	int pos = 0;
-	const char *s = data.constData();
-	for (int i = 0; i < items; i++) {
-		HandleInformation d;
-		d.start = read_le<GatoHandle>(&s[pos]);
-		d.end = read_le<GatoHandle>(&s[pos + 2]);
-		list.append(d);
+	const int item_len = 2 + 2;
+	return HandleInformationList(data, item_len, len / item_len);
+}
 
-		pos += item_len;
+GatoAttClient::AttributeDataList GatoAttClient::parseAttributeData(const char *data, int len)
+{
+	const int item_len = len > 0 ? quint8(data[0]) : 0;
+	if (item_len < 2) {
+		qWarning() << "Invalid AttributeData length";
+		return AttributeDataList();
 	}
 
-	return list;
+	return AttributeDataList(&data[1], item_len, (len - 1) / item_len);
 }
 
-QList<GatoAttClient::AttributeData> GatoAttClient::parseAttributeData(const QByteArray &data)
+GatoAttClient::AttributeGroupDataList GatoAttClient::parseAttributeGroupData(const char *data, int len)
 {
-	const int item_len = data[0];
-	const int items = (data.size() - 1) / item_len;
-	QList<AttributeData> list;
-	list.reserve(items);
-
-	int pos = 1;
-	const char *s = data.constData();
-	for (int i = 0; i < items; i++) {
-		AttributeData d;
-		d.handle = read_le<GatoHandle>(&s[pos]);
-		d.value = data.mid(pos + 2, item_len - 2);
-		list.append(d);
-
-		pos += item_len;
+	const int item_len = len > 0 ? quint8(data[0]) : 0;
+	if (item_len < 4) {
+		qWarning() << "Invalid AttributeGroupData length";
+		return AttributeGroupDataList();
 	}
 
-	return list;
+	return AttributeGroupDataList(&data[1], item_len, (len - 1) / item_len);
 }
 
-QList<GatoAttClient::AttributeGroupData> GatoAttClient::parseAttributeGroupData(const QByteArray &data)
+GatoAttClient::LengthValueList GatoAttClient::parseLengthValueList(const char *data, int len)
 {
-	const int item_len = data[0];
-	const int items = (data.size() - 1) / item_len;
-	QList<AttributeGroupData> list;
-	list.reserve(items);
-
-	int pos = 1;
-	const char *s = data.constData();
-	for (int i = 0; i < items; i++) {
-		AttributeGroupData d;
-		d.start = read_le<GatoHandle>(&s[pos]);
-		d.end = read_le<GatoHandle>(&s[pos + 2]);
-		d.value = data.mid(pos + 4, item_len - 4);
-		list.append(d);
+	LengthValueList list;
+	int pos = 0;
 
-		pos += item_len;
+	while (pos + 2 <= len) {
+		LengthValueTuple tuple;
+		tuple.length = read_le<quint16>(&data[pos]);
+		tuple.value.data = &data[pos + 2];
+		tuple.value.size = qMin(tuple.length, len - pos - 2);
+		list.append(tuple);
+		pos += 2 + tuple.value.size;
 	}
 
 	return list;
@@ -542,57 +1248,89 @@ QList<GatoAttClient::AttributeGroupData> GatoAttClient::parseAttributeGroupData(
 
 void GatoAttClient::handleSocketConnected()
 {
-	if (socket->securityLevel() < required_sec) {
-		socket->setSecurityLevel(required_sec);
+	if (transport->securityLevel() < required_sec) {
+		transport->setSecurityLevel(required_sec);
 	}
 
-	requestExchangeMTU(ATT_MAX_LE_MTU, this, SLOT(handleServerMTU(quint16)));
+	requestExchangeMTU(ATT_MAX_LE_MTU, [this](uint req, quint16 server_mtu) {
+		handleServerMTU(req, server_mtu);
+	});
 	emit connected();
 }
 
 void GatoAttClient::handleSocketDisconnected()
 {
+	// Nothing will answer the queued requests anymore
+	abortRequests(ErrorDisconnected);
+	cur_mtu = ATT_DEFAULT_LE_MTU;
+
 	emit disconnected();
 }
 
 void GatoAttClient::handleSocketReadyRead()
 {
-	QByteArray pkt = socket->receive();
-	if (!pkt.isEmpty()) {
+	// Handle every packet received in this wakeup in one go.
+	// Callbacks may close the socket, which empties its queue.
+	QByteArray pkt;
+	while (!(pkt = transport->receive()).isEmpty()) {
+		handlePacket(pkt);
+		transport->recycle(pkt);
+	}
+}
+
+void GatoAttClient::handlePacket(QByteArray &pkt)
+{
 #if PROTOCOL_DEBUG
-		qDebug() << "Received" << pkt.size() << "bytes" << pkt.toHex();
+	qDebug() << "Received" << pkt.size() << "bytes" << pkt.toHex();
 #endif
 
-		// Check if it is an event
-		if (handleEvent(pkt)) {
-			return;
-		}
+	// Check if it is an event
+	if (handleEvent(pkt)) {
+		return;
+	}
 
-		// Otherwise, if we have a request waiting, check if this answers it
-		if (!pending_requests.isEmpty()) {
-			if (handleResponse(pending_requests.head(), pkt)) {
-				pending_requests.dequeue();
-				// Proceed to next request
-				if (!pending_requests.isEmpty()) {
-					sendARequest();
-				}
-				return;
-			}
-		}
+	// Otherwise, if we have a request waiting, check if this answers it
+	if (request_in_flight && is_response_to(cur_request.opcode, pkt)) {
+		// Take the request off the wire first, since its callback may
+		// queue new requests or even close the connection.
+		Request req = cur_request;
+		cur_request = Request();
+		request_in_flight = false;
+		request_timer->stop();
 
-		qDebug() << "No idea what this packet ("
-		         << QString("0x%1").arg(uint(pkt.at(0)), 2, 16, QLatin1Char('0'))
-		         << ") is";
+		handleResponse(req, pkt);
+
+		// Proceed to next request
+		sendARequest();
+		return;
 	}
+
+	qDebug() << "No idea what this packet ("
+	         << QString("0x%1").arg(uint(pkt.at(0)), 2, 16, QLatin1Char('0'))
+	         << ") is";
+}
+
+void GatoAttClient::handleRequestTimeout()
+{
+	Q_ASSERT(request_in_flight);
+	qWarning() << "ATT request timed out";
+
+	Request req = cur_request;
+	cur_request = Request();
+	request_in_flight = false;
+
+	failRequest(req, ErrorTimeout);
+
+	// A timed out bearer cannot be used for any further requests,
+	// so the rest of the queue is aborted when the socket disconnects.
+	close();
 }
 
 void GatoAttClient::handleServerMTU(uint req, quint16 server_mtu)
 {
 	Q_UNUSED(req);
 	if (server_mtu) {
-		cur_mtu = server_mtu;
-		if (cur_mtu < ATT_DEFAULT_LE_MTU) {
-			cur_mtu = ATT_DEFAULT_LE_MTU;
-		}
+		// The ATT_MTU is the smaller of both sides' receive MTU.
+		cur_mtu = qBound<int>(ATT_DEFAULT_LE_MTU, server_mtu, ATT_MAX_LE_MTU);
 	}
 }
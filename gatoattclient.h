@@ -1,10 +1,93 @@
 #ifndef GATOATTCLIENT_H
 #define GATOATTCLIENT_H
 
+#include <functional>
 #include <QtCore/QObject>
 #include <QtCore/QQueue>
-#include "gatosocket.h"
+#include <QtCore/QTimer>
+#include "gatotransport.h"
 #include "gatouuid.h"
+#include "helpers.h"
+
+/** ATT PDU opcodes. */
+enum AttOpcode {
+	AttOpNone = 0,
+	AttOpErrorResponse = 0x1,
+	AttOpExchangeMTURequest = 0x2,
+	AttOpExchangeMTUResponse = 0x3,
+	AttOpFindInformationRequest = 0x4,
+	AttOpFindInformationResponse = 0x5,
+	AttOpFindByTypeValueRequest = 0x6,
+	AttOpFindByTypeValueResponse = 0x7,
+	AttOpReadByTypeRequest = 0x8,
+	AttOpReadByTypeResponse = 0x9,
+	AttOpReadRequest = 0xA,
+	AttOpReadResponse = 0xB,
+	AttOpReadBlobRequest = 0xC,
+	AttOpReadBlobResponse = 0xD,
+	AttOpReadMultipleRequest = 0xE,
+	AttOpReadMultipleResponse = 0xF,
+	AttOpReadByGroupTypeRequest = 0x10,
+	AttOpReadByGroupTypeResponse = 0x11,
+	AttOpWriteRequest = 0x12,
+	AttOpWriteResponse = 0x13,
+	AttOpWriteCommand = 0x52,
+	AttOpPrepareWriteRequest = 0x16,
+	AttOpPrepareWriteResponse = 0x17,
+	AttOpExecuteWriteRequest = 0x18,
+	AttOpExecuteWriteResponse = 0x19,
+	AttOpReadMultipleVariableRequest = 0x20,
+	AttOpReadMultipleVariableResponse = 0x21,
+	AttOpHandleValueNotification = 0x1B,
+	AttOpHandleValueIndication = 0x1D,
+	AttOpHandleValueConfirmation = 0x1E,
+	AttOpSignedWriteCommand = 0xD2
+};
+
+/** Read-only view over the fixed size items of a received ATT PDU.
+ *  Items are decoded on access and the PDU bytes are not copied, so the
+ *  list is only valid while the callback it was passed to runs. */
+template<typename T>
+class GatoAttItemList
+{
+public:
+	GatoAttItemList()
+	    : d(0), item_len(0), count(0)
+	{
+	}
+	GatoAttItemList(const char *data, int item_len, int count)
+	    : d(data), item_len(item_len), count(count)
+	{
+	}
+
+	class const_iterator
+	{
+	public:
+		const_iterator() : p(0), len(0) { }
+		const_iterator(const char *p, int len) : p(p), len(len) { }
+		T operator*() const { return T::fromPdu(p, len); }
+		const_iterator &operator++() { p += len; return *this; }
+		bool operator==(const const_iterator &o) const { return p == o.p; }
+		bool operator!=(const const_iterator &o) const { return p != o.p; }
+	private:
+		const char *p;
+		int len;
+	};
+
+	int size() const { return count; }
+	bool isEmpty() const { return count == 0; }
+	T at(int i) const { return T::fromPdu(d + i * item_len, item_len); }
+	T front() const { return at(0); }
+	T back() const { return at(count - 1); }
+
+	const_iterator begin() const { return const_iterator(d, item_len); }
+	const_iterator end() const { return const_iterator(d + count * item_len, item_len); }
+
+private:
+	const char *d;
+	int item_len;
+	int count;
+};
 
 class GatoAttClient : public QObject
 {
@@ -12,23 +95,138 @@ class GatoAttClient : public QObject
 
 public:
 	explicit GatoAttClient(QObject *parent = 0);
+	/** Talks over the given transport instead of a bluetooth socket,
+	 *  and takes ownership of it. */
+	GatoAttClient(GatoTransport *backend, QObject *parent = 0);
 	~GatoAttClient();
 
-	GatoSocket::State state() const;
+	/** Why a request completed without a regular response.
+	 *  Error codes sent by the server (0x01-0xFF) are passed through as is. */
+	enum Error {
+		ErrorNone = 0,
+		ErrorInvalidHandle = 0x01,
+		ErrorReadNotPermitted = 0x02,
+		ErrorWriteNotPermitted = 0x03,
+		ErrorInvalidPdu = 0x04,
+		ErrorInsufficientAuthentication = 0x05,
+		ErrorRequestNotSupported = 0x06,
+		ErrorInvalidOffset = 0x07,
+		ErrorInsufficientAuthorization = 0x08,
+		ErrorPrepareQueueFull = 0x09,
+		ErrorAttributeNotFound = 0x0A,
+		ErrorAttributeNotLong = 0x0B,
+		ErrorInsufficientEncryptionKeySize = 0x0C,
+		ErrorInvalidAttributeValueLength = 0x0D,
+		ErrorUnlikely = 0x0E,
+		ErrorInsufficientEncryption = 0x0F,
+		ErrorUnsupportedGroupType = 0x10,
+		ErrorInsufficientResources = 0x11,
+		// The following ones are generated locally; no response was received.
+		ErrorTimeout = 0x100,
+		ErrorDisconnected,
+		ErrorWriteVerificationFailed
+	};
+
+	/** Requests are sent in priority order. A lower priority request that has
+	 *  been passed over several times in a row is sent anyway, so that no
+	 *  class is starved. */
+	enum Priority {
+		PriorityInteractive = 0,
+		PriorityNormal,
+		PriorityBackground,
+		PriorityCount
+	};
+
+	GatoTransport::State state() const;
 
-	bool connectTo(const GatoAddress& addr, GatoSocket::SecurityLevel sec_level);
+	bool connectTo(const GatoAddress& addr, GatoTransport::SecurityLevel sec_level);
 	void close();
 
+	/** Points into a received PDU; see GatoAttItemList. */
+	struct ValueRef
+	{
+		const char *data;
+		int size;
+
+		QByteArray toByteArray() const { return QByteArray(data, size); }
+		GatoUUID toUuid() const { return read_gatouuid(data, size); }
+	};
+
 	struct InformationData
 	{
 		GatoHandle handle;
 		GatoUUID uuid;
+
+		static InformationData fromPdu(const char *item, int len)
+		{
+			InformationData d;
+			d.handle = read_le<GatoHandle>(item);
+			d.uuid = read_gatouuid(item + 2, len - 2);
+			return d;
+		}
 	};
 	struct HandleInformation
 	{
 		GatoHandle start;
 		GatoHandle end;
+
+		static HandleInformation fromPdu(const char *item, int len)
+		{
+			Q_UNUSED(len);
+			HandleInformation d;
+			d.start = read_le<GatoHandle>(item);
+			d.end = read_le<GatoHandle>(item + 2);
+			return d;
+		}
+	};
+	struct AttributeRef
+	{
+		GatoHandle handle;
+		ValueRef value;
+
+		static AttributeRef fromPdu(const char *item, int len)
+		{
+			AttributeRef d;
+			d.handle = read_le<GatoHandle>(item);
+			d.value.data = item + 2;
+			d.value.size = len - 2;
+			return d;
+		}
 	};
+	struct AttributeGroupRef
+	{
+		GatoHandle start;
+		GatoHandle end;
+		ValueRef value;
+
+		static AttributeGroupRef fromPdu(const char *item, int len)
+		{
+			AttributeGroupRef d;
+			d.start = read_le<GatoHandle>(item);
+			d.end = read_le<GatoHandle>(item + 2);
+			d.value.data = item + 4;
+			d.value.size = len - 4;
+			return d;
+		}
+	};
+
+	/** One entry of a Read Multiple Variable response. The server truncates the
+	 *  last value if it does not fit the MTU; length is always the full one. */
+	struct LengthValueTuple
+	{
+		int length;
+		ValueRef value;
+
+		bool isTruncated() const { return value.size < length; }
+	};
+
+	typedef GatoAttItemList<InformationData> InformationDataList;
+	typedef GatoAttItemList<HandleInformation> HandleInformationList;
+	typedef GatoAttItemList<AttributeRef> AttributeDataList;
+	typedef GatoAttItemList<AttributeGroupRef> AttributeGroupDataList;
+	typedef QList<LengthValueTuple> LengthValueList;
+
+	/** Owning copies of the above, as delivered to the SLOT() based variants. */
 	struct AttributeData
 	{
 		GatoHandle handle;
@@ -41,8 +239,66 @@ public:
 		QByteArray value;
 	};
 
+	typedef std::function<void(uint req, const QByteArray &response)> ResponseCallback;
+	typedef std::function<void(uint req, quint16 server_mtu)> ExchangeMTUCallback;
+	typedef std::function<void(uint req, const InformationDataList &list)> FindInformationCallback;
+	typedef std::function<void(uint req, const HandleInformationList &list)> FindByTypeValueCallback;
+	typedef std::function<void(uint req, const AttributeDataList &list)> ReadByTypeCallback;
+	typedef std::function<void(uint req, const QByteArray &value)> ReadCallback;
+	typedef std::function<void(uint req, const AttributeGroupDataList &list)> ReadByGroupTypeCallback;
+	typedef std::function<void(uint req, bool ok)> WriteCallback;
+	typedef std::function<void(uint req, const LengthValueList &values)> ReadMultipleVariableCallback;
+	/** Receives the value piece by piece; last is set on the final call,
+	 *  which may carry an empty chunk. */
+	typedef std::function<void(uint req, int offset, const ValueRef &chunk, bool last)> ReadChunkCallback;
+
 	int mtu() const;
 
+	/** Time to wait for a response before giving up on the link (ATT transaction timeout). */
+	int requestTimeout() const;
+	void setRequestTimeout(int msecs);
+
+	/** If enabled, a write request replaces any not yet sent write request to the
+	 *  same handle; the callbacks of both complete with the result of the last one.
+	 *  Identical read requests are always merged, regardless of this setting. */
+	bool writeCoalescing() const;
+	void setWriteCoalescing(bool enabled);
+
+	/** Error for the completion being delivered; only meaningful inside a callback.
+	 *  Failed requests still have their callback invoked, with an empty result. */
+	Error lastError() const;
+	/** True if the completion being delivered is for a request that never got a response. */
+	bool requestAborted() const;
+
+	uint request(int opcode, const QByteArray &data, const ResponseCallback &callback, Priority priority = PriorityNormal);
+	uint requestExchangeMTU(quint16 client_mtu, const ExchangeMTUCallback &callback);
+	uint requestFindInformation(GatoHandle start, GatoHandle end, const FindInformationCallback &callback, Priority priority = PriorityNormal);
+	uint requestFindByTypeValue(GatoHandle start, GatoHandle end, const GatoUUID &uuid, const QByteArray& value, const FindByTypeValueCallback &callback, Priority priority = PriorityNormal);
+	uint requestReadByType(GatoHandle start, GatoHandle end, const GatoUUID &uuid, const ReadByTypeCallback &callback, Priority priority = PriorityNormal);
+	uint requestRead(GatoHandle handle, const ReadCallback &callback, Priority priority = PriorityNormal);
+	uint requestReadByGroupType(GatoHandle start, GatoHandle end, const GatoUUID &uuid, const ReadByGroupTypeCallback &callback, Priority priority = PriorityNormal);
+	uint requestWrite(GatoHandle handle, const QByteArray &value, const WriteCallback &callback, Priority priority = PriorityNormal);
+	/** The response is the concatenation of all values, so it can only be split
+	 *  by a caller that knows their lengths. */
+	uint requestReadMultiple(const QList<GatoHandle> &handles, const ReadCallback &callback, Priority priority = PriorityNormal);
+	/** Values come back separately, in the same order as the handles.
+	 *  Servers older than Bluetooth 5.2 answer with ErrorRequestNotSupported. */
+	uint requestReadMultipleVariable(const QList<GatoHandle> &handles, const ReadMultipleVariableCallback &callback, Priority priority = PriorityNormal);
+
+	/** Reads a value longer than the MTU by following up with Read Blob requests
+	 *  for as long as the server fills the PDU. If max_length is not negative,
+	 *  reading stops once that many bytes have been received. */
+	uint requestReadLong(GatoHandle handle, const ReadCallback &callback, int max_length = -1, Priority priority = PriorityNormal);
+	/** As requestReadLong(), but each chunk is handed to the sink as it arrives
+	 *  instead of being assembled into a single buffer. */
+	uint requestReadLongStream(GatoHandle handle, const ReadChunkCallback &sink, int max_length = -1, Priority priority = PriorityNormal);
+	/** Writes a value of any length using Prepare Write requests split at the MTU,
+	 *  then commits all fragments at once with an Execute Write request.
+	 *  If reliable is set, every fragment echoed back by the server is compared
+	 *  with the one sent, and the whole write is cancelled on a mismatch. */
+	uint requestWriteLong(GatoHandle handle, const QByteArray &value, const WriteCallback &callback, bool reliable = false, Priority priority = PriorityNormal);
+
+	// Slot based variants, kept for compatibility. Prefer the callback variants above.
 	uint request(int opcode, const QByteArray &data, QObject *receiver, const char *member);
 	uint requestExchangeMTU(quint16 client_mtu, QObject *receiver, const char *member);
 	uint requestFindInformation(GatoHandle start, GatoHandle end, QObject *receiver, const char *member);
@@ -51,49 +307,122 @@ public:
 	uint requestRead(GatoHandle handle, QObject *receiver, const char *member);
 	uint requestReadByGroupType(GatoHandle start, GatoHandle end, const GatoUUID &uuid, QObject *receiver, const char *member);
 	uint requestWrite(GatoHandle handle, const QByteArray &value, QObject *receiver, const char *member);
+	/** The callback of a cancelled request will not be invoked.
+	 *  If the request is already on the wire, its response is still waited for and then discarded. */
 	void cancelRequest(uint id);
 
-	void command(int opcode, const QByteArray &data);
-	void commandWrite(GatoHandle handle, const QByteArray &value);
+	/** Returns false if the socket is not connected. */
+	bool command(int opcode, const QByteArray &data);
+	/** Flow controlled: returns false without sending anything if the socket
+	 *  already holds more than writeHighWaterMark() bytes; retry once
+	 *  writeQueueDrained() is emitted. */
+	bool commandWrite(GatoHandle handle, const QByteArray &value);
+	bool canWriteCommand() const;
+
+	int writeHighWaterMark() const;
+	void setWriteHighWaterMark(int bytes);
+	/** Bytes and packets handed to the socket but not written to the kernel yet. */
+	int pendingWriteBytes() const;
+	int pendingWritePackets() const;
 
 signals:
 	void connected();
 	void disconnected();
+	void writeQueueDrained();
 
 	void attributeUpdated(GatoHandle handle, const QByteArray &value, bool confirmed);
 
 private:
+	/** Completion of a request that was merged into another one. */
+	struct Waiter
+	{
+		uint id;
+		ReadCallback read_cb;
+		WriteCallback write_cb;
+	};
+
+	/** Only the callback matching the request opcode is set. */
 	struct Request
 	{
+		Request() : id(0), opcode(0), priority(PriorityNormal), long_read(false), offset(0), max_length(-1), reliable(false) { }
+
 		uint id;
 		quint8 opcode;
+		Priority priority;
 		QByteArray pkt;
-		QObject *receiver;
-		QByteArray member;
+		ResponseCallback response_cb;
+		ExchangeMTUCallback mtu_cb;
+		FindInformationCallback info_cb;
+		FindByTypeValueCallback handle_info_cb;
+		ReadByTypeCallback attr_cb;
+		ReadCallback read_cb;
+		ReadByGroupTypeCallback group_cb;
+		WriteCallback write_cb;
+		ReadMultipleVariableCallback multi_cb;
+
+		// Long reads: either read_cb gets the assembled value or chunk_cb each piece
+		bool long_read;
+		ReadChunkCallback chunk_cb;
+		QByteArray value;
+		int offset;
+		int max_length;
+
+		// Long writes reuse value and offset for the data still to be sent
+		bool reliable;
+
+		/** Merged duplicate reads, or writes superseded by this one. */
+		QList<Waiter> waiters;
 	};
 
+	uint enqueueRequest(Request &req, int opcode, const QByteArray &data, Priority priority);
+	bool mergeRequest(Request &req, Priority priority);
+	bool detachWaiter(Request &req, uint id);
+	bool isWritePending(const QByteArray &handle_pkt) const;
 	void sendARequest();
-	bool handleEvent(const QByteArray &event);
-	bool handleResponse(const Request& req, const QByteArray &response);
+	void handlePacket(QByteArray &pkt);
+	bool handleEvent(QByteArray &event);
+	bool handleResponse(Request &req, const QByteArray &response);
+	void continueLongRead(Request &req, const QByteArray &response);
+	void finishLongRead(Request &req);
+	void continueLongWrite(Request &req, const QByteArray &response);
+	void preparePartialWrite(Request &req);
+	void queueExecuteWrite(Request &req, bool commit);
+	void completeRead(const Request &req, const QByteArray &value);
+	void completeWrite(const Request &req, bool ok);
+	void failRequest(const Request &req, Error error);
+	void abortRequests(Error error);
 
-	QList<InformationData> parseInformationData(const QByteArray &data);
-	QList<HandleInformation> parseHandleInformation(const QByteArray &data);
-	QList<AttributeData> parseAttributeData(const QByteArray &data);
-	QList<AttributeGroupData> parseAttributeGroupData(const QByteArray &data);
+	static InformationDataList parseInformationData(const char *data, int len);
+	static HandleInformationList parseHandleInformation(const char *data, int len);
+	static AttributeDataList parseAttributeData(const char *data, int len);
+	static AttributeGroupDataList parseAttributeGroupData(const char *data, int len);
+	static LengthValueList parseLengthValueList(const char *data, int len);
 
 private slots:
 	void handleSocketConnected();
 	void handleSocketDisconnected();
 	void handleSocketReadyRead();
+	void handleRequestTimeout();
 
+private:
 	void handleServerMTU(uint req, quint16 server_mtu);
 
 private:
-	GatoSocket *socket;
+	GatoTransport *transport;
 	quint16 cur_mtu;
 	uint next_id;
-	QQueue<Request> pending_requests;
-	GatoSocket::SecurityLevel required_sec;
+	QQueue<Request> pending_requests[PriorityCount];
+	/** Rest of a long read or prepared write; sent before anything else so that
+	 *  no other request comes between the fragments of a value, and the
+	 *  server's prepare queue never mixes fragments of different writes. */
+	QQueue<Request> pending_continuations;
+	int lane_skips[PriorityCount];
+	Request cur_request;
+	bool request_in_flight;
+	QTimer *request_timer;
+	Error last_error;
+	bool write_coalescing;
+	GatoTransport::SecurityLevel required_sec;
 };
 
 #endif // GATOATTCLIENT_H
@@ -0,0 +1,280 @@
+/*
+ *  libgato - A GATT/ATT library for use with Bluez
+ *
+ *  Copyright (C) 2013 Javier S. Pedro <maemo@javispedro.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include <QtCore/QDebug>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QSaveFile>
+
+#include "gatoattributecache.h"
+#include "gatocharacteristic.h"
+#include "gatodescriptor.h"
+#include "helpers.h"
+
+#define CACHE_MAGIC "GATC"
+#define CACHE_VERSION 2
+#define CACHE_HEADER_SIZE 24
+#define CACHE_HASH_SIZE 16
+#define CACHE_RECORD_SIZE 28
+
+/* Header layout:
+ *  0  magic, 4 bytes
+ *  4  version
+ *  5  flags
+ *  6  record count, 2 bytes
+ *  8  database hash, 16 bytes
+ *
+ * Record layout:
+ *  0  type
+ *  1  flags
+ *  2  characteristic properties
+ *  3  reserved
+ *  4  start handle (descriptors: handle), 2 bytes
+ *  6  end handle, 2 bytes
+ *  8  characteristic value handle, 2 bytes
+ *  10 reserved, 2 bytes
+ *  12 uuid, 16 bytes in network order
+ */
+
+enum CacheFlag {
+	CacheFlagCompleteServices = 1 << 0,
+	CacheFlagDatabaseHash = 1 << 1
+};
+
+enum RecordType {
+	RecordService = 1,
+	RecordCharacteristic,
+	RecordDescriptor
+};
+
+enum RecordFlag {
+	/** Characteristics of a service, or descriptors of a characteristic, are known. */
+	RecordFlagKnownChildren = 1 << 0
+};
+
+static char * write_record(char *rec, RecordType type, bool known_children, quint8 props,
+                           GatoHandle start, GatoHandle end, GatoHandle value, const GatoUUID &uuid)
+{
+	memset(rec, 0, CACHE_RECORD_SIZE);
+	rec[0] = type;
+	rec[1] = known_children ? RecordFlagKnownChildren : 0;
+	rec[2] = props;
+	write_le<quint16>(start, &rec[4]);
+	write_le<quint16>(end, &rec[6]);
+	write_le<quint16>(value, &rec[8]);
+	uuid.toRfc4122(reinterpret_cast<uchar*>(&rec[12]));
+	return rec + CACHE_RECORD_SIZE;
+}
+
+static GatoUUID read_record_uuid(const uchar *rec)
+{
+	return GatoUUID::fromRfc4122(&rec[12]);
+}
+
+QString GatoAttributeCache::fileName(const QString &directory, const GatoAddress &addr)
+{
+	// The type is part of the device's identity: a public and a random address
+	// may share the same 48 bits.
+	return QDir(directory).filePath(QString("%1-%2.gatt").arg(addr.toUInt64(), 12, 16, QChar('0'))
+	                                                      .arg(int(addr.addressType())));
+}
+
+bool GatoAttributeCache::load(const QString &fileName, Table *table)
+{
+	QFile file(fileName);
+	if (!file.open(QIODevice::ReadOnly)) {
+		return false;
+	}
+
+	const qint64 size = file.size();
+	if (size < CACHE_HEADER_SIZE) {
+		qWarning() << "Attribute cache" << fileName << "is truncated";
+		return false;
+	}
+
+	const uchar *data = file.map(0, size);
+	if (!data) {
+		qWarning() << "Could not map attribute cache" << fileName;
+		return false;
+	}
+
+	const bool complete_services = data[5] & CacheFlagCompleteServices;
+	QByteArray database_hash;
+	if (data[5] & CacheFlagDatabaseHash) {
+		database_hash = QByteArray(reinterpret_cast<const char*>(&data[8]), CACHE_HASH_SIZE);
+	}
+	const int count = read_le<quint16>(&data[6]);
+	if (memcmp(data, CACHE_MAGIC, 4) != 0 || data[4] != CACHE_VERSION ||
+	        size != CACHE_HEADER_SIZE + qint64(count) * CACHE_RECORD_SIZE) {
+		qWarning() << "Ignoring invalid attribute cache" << fileName;
+		file.unmap(const_cast<uchar*>(data));
+		return false;
+	}
+
+	QMap<GatoHandle, GatoService> services;
+	QSet<GatoHandle> known_handles;
+	GatoService service;
+	GatoCharacteristic characteristic;
+	bool in_service = false, in_characteristic = false;
+	bool ok = true;
+
+	// Children are accumulated in the local copies and flushed when the next sibling or parent starts.
+	const uchar *rec = &data[CACHE_HEADER_SIZE];
+	for (int i = 0; i <= count && ok; i++, rec += CACHE_RECORD_SIZE) {
+		const int type = i < count ? rec[0] : RecordService;
+
+		if (in_characteristic && type != RecordDescriptor) {
+			service.addCharacteristic(characteristic);
+			in_characteristic = false;
+		}
+		if (in_service && type == RecordService) {
+			services.insert(service.startHandle(), service);
+			in_service = false;
+		}
+		if (i == count) break;
+
+		const GatoHandle start = read_le<quint16>(&rec[4]);
+		const GatoHandle end = read_le<quint16>(&rec[6]);
+		const bool known_children = rec[1] & RecordFlagKnownChildren;
+
+		switch (type) {
+		case RecordService:
+			if (start == 0 || end < start) {
+				ok = false;
+				break;
+			}
+			service = GatoService();
+			service.setUuid(read_record_uuid(rec));
+			service.setStartHandle(start);
+			service.setEndHandle(end);
+			in_service = true;
+			break;
+		case RecordCharacteristic:
+			if (!in_service || start < service.startHandle() || end > service.endHandle() || end < start) {
+				ok = false;
+				break;
+			}
+			characteristic = GatoCharacteristic();
+			characteristic.setUuid(read_record_uuid(rec));
+			characteristic.setProperties(GatoCharacteristic::Properties(rec[2]));
+			characteristic.setStartHandle(start);
+			characteristic.setEndHandle(end);
+			characteristic.setValueHandle(read_le<quint16>(&rec[8]));
+			in_characteristic = true;
+			break;
+		case RecordDescriptor:
+			if (!in_characteristic || start <= characteristic.startHandle() || start > characteristic.endHandle()) {
+				ok = false;
+				break;
+			} else {
+				GatoDescriptor descriptor;
+				descriptor.setUuid(read_record_uuid(rec));
+				descriptor.setHandle(start);
+				characteristic.addDescriptor(descriptor);
+			}
+			break;
+		default:
+			ok = false;
+			break;
+		}
+
+		if (ok && known_children) {
+			known_handles.insert(start);
+		}
+	}
+
+	file.unmap(const_cast<uchar*>(data));
+
+	if (!ok) {
+		qWarning() << "Ignoring corrupt attribute cache" << fileName;
+		return false;
+	}
+
+	table->services = services;
+	table->complete_services = complete_services;
+	table->known_handles = known_handles;
+	table->database_hash = database_hash;
+
+	return true;
+}
+
+bool GatoAttributeCache::save(const QString &fileName, const Table &table)
+{
+	int count = 0;
+	foreach (const GatoService &service, table.services) {
+		count++;
+		foreach (const GatoCharacteristic &characteristic, service.characteristics()) {
+			count += 1 + characteristic.descriptors().size();
+		}
+	}
+
+	if (count > 0xFFFF) {
+		qWarning() << "Too many attributes to cache";
+		return false;
+	}
+
+	QByteArray buf(CACHE_HEADER_SIZE + count * CACHE_RECORD_SIZE, Qt::Uninitialized);
+	char *data = buf.data();
+
+	memcpy(data, CACHE_MAGIC, 4);
+	data[4] = CACHE_VERSION;
+	data[5] = table.complete_services ? CacheFlagCompleteServices : 0;
+	write_le<quint16>(count, &data[6]);
+	memset(&data[8], 0, CACHE_HASH_SIZE);
+	if (table.database_hash.size() == CACHE_HASH_SIZE) {
+		data[5] |= CacheFlagDatabaseHash;
+		memcpy(&data[8], table.database_hash.constData(), CACHE_HASH_SIZE);
+	}
+
+	char *rec = &data[CACHE_HEADER_SIZE];
+	foreach (const GatoService &service, table.services) {
+		rec = write_record(rec, RecordService, table.known_handles.contains(service.startHandle()), 0,
+		                   service.startHandle(), service.endHandle(), 0, service.uuid());
+		foreach (const GatoCharacteristic &characteristic, service.characteristics()) {
+			rec = write_record(rec, RecordCharacteristic, table.known_handles.contains(characteristic.startHandle()),
+			                   characteristic.properties(),
+			                   characteristic.startHandle(), characteristic.endHandle(),
+			                   characteristic.valueHandle(), characteristic.uuid());
+			foreach (const GatoDescriptor &descriptor, characteristic.descriptors()) {
+				rec = write_record(rec, RecordDescriptor, false, 0,
+				                   descriptor.handle(), descriptor.handle(), 0, descriptor.uuid());
+			}
+		}
+	}
+
+	Q_ASSERT(rec == data + buf.size());
+
+	QDir().mkpath(QFileInfo(fileName).path());
+
+	QSaveFile file(fileName);
+	if (!file.open(QIODevice::WriteOnly) || file.write(buf) != buf.size() || !file.commit()) {
+		qWarning() << "Could not write attribute cache" << fileName;
+		return false;
+	}
+
+	return true;
+}
+
+bool GatoAttributeCache::remove(const QString &fileName)
+{
+	return QFile::remove(fileName);
+}
@@ -0,0 +1,42 @@
+#ifndef GATOATTRIBUTECACHE_H
+#define GATOATTRIBUTECACHE_H
+
+#include <QtCore/QMap>
+#include <QtCore/QSet>
+#include <QtCore/QString>
+
+#include "gatoaddress.h"
+#include "gatoservice.h"
+
+/** Keeps a peripheral's discovered attribute table on disk, one file per
+ *  address, so that reconnecting does not need to rediscover it.
+ *
+ *  A file is a 24 byte header ("GATC", version, flags, record count, database
+ *  hash) followed by fixed size little endian records in handle order: each
+ *  service record is followed by its characteristics, and each characteristic
+ *  by its descriptors. Loading maps the file and walks the records in place. */
+class GatoAttributeCache
+{
+public:
+	/** Everything known about a peripheral's attributes. */
+	struct Table
+	{
+		QMap<GatoHandle, GatoService> services;
+		/** Whether the services list is complete. */
+		bool complete_services;
+		/** Services and characteristics whose characteristics, resp. descriptors,
+		 *  have been discovered. */
+		QSet<GatoHandle> known_handles;
+		/** Value of the device's Database Hash characteristic when the table
+		 *  was discovered; empty if unknown. */
+		QByteArray database_hash;
+	};
+
+	static QString fileName(const QString &directory, const GatoAddress &addr);
+
+	static bool load(const QString &fileName, Table *table);
+	static bool save(const QString &fileName, const Table &table);
+	static bool remove(const QString &fileName);
+};
+
+#endif // GATOATTRIBUTECACHE_H
@@ -41,7 +41,9 @@ GatoCentralManager::GatoCentralManager(QObject *parent) :
 	d->dev_id = hci_get_route(NULL);
 	d->timeout = 1000;
 	d->hci = -1;
+	d->hci_external = false;
 	d->notifier = 0;
+	d->clock.start();
 }
 
 GatoCentralManager::~GatoCentralManager()
@@ -59,9 +61,58 @@ GatoPeripheral * GatoCentralManager::getPeripheral(const GatoAddress &address)
 	if (peripheral) {
 		return peripheral;
 	} else {
-		peripheral = new GatoPeripheral(address, this);
-		d->peripherals.insert(address, peripheral);
-		return peripheral;
+		return d->createPeripheral(address);
+	}
+}
+
+int GatoCentralManager::advertisementCapacity() const
+{
+	Q_D(const GatoCentralManager);
+	return d->adverts.capacity();
+}
+
+void GatoCentralManager::setAdvertisementCapacity(int devices)
+{
+	Q_D(GatoCentralManager);
+	d->adverts.setCapacity(devices);
+}
+
+int GatoCentralManager::advertisementTimeout() const
+{
+	Q_D(const GatoCentralManager);
+	return d->adverts.timeout();
+}
+
+void GatoCentralManager::setAdvertisementTimeout(int msec)
+{
+	Q_D(GatoCentralManager);
+	d->adverts.setTimeout(msec);
+	d->adverts.expire(d->clock.elapsed());
+}
+
+QByteArray GatoCentralManager::advertData(const GatoAddress &address) const
+{
+	Q_D(const GatoCentralManager);
+	const GatoAdvertisementTable::Record *record = d->adverts.find(address);
+	if (record) {
+		return record->data();
+	} else {
+		return QByteArray();
+	}
+}
+
+QString GatoCentralManager::cacheDirectory() const
+{
+	Q_D(const GatoCentralManager);
+	return d->cache_dir;
+}
+
+void GatoCentralManager::setCacheDirectory(const QString &path)
+{
+	Q_D(GatoCentralManager);
+	d->cache_dir = path;
+	foreach (GatoPeripheral *peripheral, d->peripherals) {
+		peripheral->setCacheDirectory(path);
 	}
 }
 
@@ -130,8 +181,10 @@ void GatoCentralManager::stopScan()
 	Q_D(GatoCentralManager);
 	if (d->scanning()) {
 		delete d->notifier;
-		setsockopt(d->hci, SOL_HCI, HCI_FILTER, &d->hci_of, sizeof(d->hci_of));
-		hci_le_set_scan_enable(d->hci, 0, 0, d->timeout);
+		if (!d->hci_external) {
+			setsockopt(d->hci, SOL_HCI, HCI_FILTER, &d->hci_of, sizeof(d->hci_of));
+			hci_le_set_scan_enable(d->hci, 0, 0, d->timeout);
+		}
 		d->closeDevice();
 	} else {
 		qDebug() << "No scan to stop";
@@ -142,6 +195,20 @@ void GatoCentralManager::stopScan()
 	hci_filter_clear(&d->hci_of);
 }
 
+void GatoCentralManager::scanFromSocket(int fd, const QList<GatoUUID> &uuids)
+{
+	Q_D(GatoCentralManager);
+
+	if (d->scanning()) stopScan();
+
+	d->hci = fd;
+	d->hci_external = true;
+	d->filter_uuids = uuids;
+
+	d->notifier = new QSocketNotifier(d->hci, QSocketNotifier::Read);
+	connect(d->notifier, SIGNAL(activated(int)), this, SLOT(_q_readNotify()));
+}
+
 void GatoCentralManager::_q_readNotify()
 {
 	Q_D(GatoCentralManager);
@@ -204,6 +271,30 @@ void GatoCentralManagerPrivate::closeDevice()
 {
 	hci_close_dev(hci);
 	hci = -1;
+	hci_external = false;
+}
+
+GatoPeripheral *GatoCentralManagerPrivate::createPeripheral(const GatoAddress &addr)
+{
+	Q_Q(GatoCentralManager);
+
+	GatoPeripheral *peripheral = new GatoPeripheral(addr, q);
+	peripheral->setCacheDirectory(cache_dir);
+	peripherals.insert(addr, peripheral);
+
+	const GatoAdvertisementTable::Record *record = adverts.find(addr);
+	if (record) {
+		if (record->advert_len > 0) {
+			peripheral->parseEIR(const_cast<quint8*>(record->advert), record->advert_len,
+			                     record->advert_type);
+		}
+		if (record->scan_rsp_len > 0) {
+			peripheral->parseEIR(const_cast<quint8*>(record->scan_rsp), record->scan_rsp_len,
+			                     GatoAdvertisementTable::ScanResponse);
+		}
+	}
+
+	return peripheral;
 }
 
 void GatoCentralManagerPrivate::handleAdvertising(le_advertising_info *info, int rssi)
@@ -217,20 +308,16 @@ void GatoCentralManagerPrivate::handleAdvertising(le_advertising_info *info, int
 	         << "rssi" << rssi;
 	*/
 
-	GatoAddress addr(info->bdaddr.b, info->bdaddr_type);
-
-	GatoPeripheral *peripheral;
-	QHash<GatoAddress, GatoPeripheral*>::iterator it = peripherals.find(addr);
-	if (it == peripherals.end()) {
-		peripheral = new GatoPeripheral(addr, q);
-		peripherals.insert(addr, peripheral);
-	} else {
-		peripheral = *it;
-	}
+	// HCI reports 0 (public) or 1 (random), with 2 and 3 for resolved identities;
+	// GatoAddress keeps the BDADDR_LE_* values the rest of BlueZ uses.
+	const quint8 addr_type = (info->bdaddr_type & 0x1) ? BDADDR_LE_RANDOM : BDADDR_LE_PUBLIC;
+	GatoAddress addr(info->bdaddr.b, addr_type);
 
-	if (info->length > 0) {
-		peripheral->parseEIR(info->data, info->length);
-	}
+	const qint64 now = clock.elapsed();
+	bool changed;
+	adverts.expire(now);
+	const GatoAdvertisementTable::Record *record = adverts.update(addr, info->evt_type, rssi,
+	                                                              info->data, info->length, now, &changed);
 
 	bool passes_filter;
 	if (filter_uuids.isEmpty()) {
@@ -238,14 +325,26 @@ void GatoCentralManagerPrivate::handleAdvertising(le_advertising_info *info, int
 	} else {
 		passes_filter = false;
 		foreach (const GatoUUID & filter_uuid, filter_uuids) {
-			if (peripheral->advertisesService(filter_uuid)) {
+			if (record->advertisesService(filter_uuid)) {
 				passes_filter = true;
 				break;
 			}
 		}
 	}
 
+	GatoPeripheral *peripheral = peripherals.value(addr);
+	if (peripheral && changed && info->length > 0) {
+		peripheral->parseEIR(info->data, info->length, info->evt_type);
+	}
+
 	if (passes_filter) {
-		emit q->discoveredPeripheral(peripheral, info->evt_type, rssi);
+		emit q->discoveredAdvertisement(addr, info->evt_type, rssi);
+
+		if (q->receivers(SIGNAL(discoveredPeripheral(GatoPeripheral*,quint8,int))) > 0) {
+			if (!peripheral) {
+				peripheral = createPeripheral(addr);
+			}
+			emit q->discoveredPeripheral(peripheral, info->evt_type, rssi);
+		}
 	}
 }
@@ -25,16 +25,48 @@ public:
 	};
 	Q_DECLARE_FLAGS(PeripheralScanOptions, PeripheralScanOption)
 
+	/** Returns the peripheral object for address, creating it (and filling it in with
+	 *  the last advertising data received from it, if any) the first time.
+	 *  Peripherals are kept until the manager is destroyed. */
 	GatoPeripheral *getPeripheral(const GatoAddress& address);
 
+	/** Scan results are kept for at most this many devices; once there are more,
+	 *  the one seen least recently is forgotten. */
+	int advertisementCapacity() const;
+	void setAdvertisementCapacity(int devices);
+	/** Scan results of devices not seen for this long are forgotten; 0 keeps them. */
+	int advertisementTimeout() const;
+	void setAdvertisementTimeout(int msec);
+	/** Last advertising and scan response data received from address, or empty
+	 *  if it has not been seen recently. */
+	QByteArray advertData(const GatoAddress &address) const;
+
+	/** Given to every peripheral this manager creates;
+	 *  see GatoPeripheral::setCacheDirectory(). */
+	QString cacheDirectory() const;
+	void setCacheDirectory(const QString &path);
+
 public slots:
 	void scanForPeripherals(PeripheralScanOptions options = 0);
 	void scanForPeripheralsWithServices(const QList<GatoUUID>& uuids, PeripheralScanOptions options = 0);
 	void stopScan();
 
 signals:
+	/** Emitted for every advertising report that passes the service filter.
+	 *  Unlike discoveredPeripheral(), it does not need a GatoPeripheral to exist;
+	 *  call getPeripheral() for the devices of interest. */
+	void discoveredAdvertisement(const GatoAddress &address, quint8 advertType, int rssi);
+	/** Only emitted while something is connected to it, since it needs a
+	 *  GatoPeripheral for every device found; prefer discoveredAdvertisement()
+	 *  when scanning busy areas. */
 	void discoveredPeripheral(GatoPeripheral *peripheral, quint8 advertType, int rssi);
 
+protected:
+	/** Handles the HCI events read from fd, a socket standing in for the
+	 *  adapter's, as if scanning with the given service filter; takes ownership
+	 *  of fd. Mainly useful to test or benchmark the scan path without a radio. */
+	void scanFromSocket(int fd, const QList<GatoUUID>& uuids = QList<GatoUUID>());
+
 private slots:
 	void _q_readNotify();
 
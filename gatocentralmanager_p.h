@@ -1,6 +1,7 @@
 #ifndef GATOCENTRALMANAGER_P_H
 #define GATOCENTRALMANAGER_P_H
 
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QSocketNotifier>
 
 #include <bluetooth/bluetooth.h>
@@ -8,6 +9,7 @@
 
 #include "gatocentralmanager.h"
 #include "gatoaddress.h"
+#include "gatoadvertisementtable.h"
 
 class GatoCentralManagerPrivate
 {
@@ -17,15 +19,23 @@ class GatoCentralManagerPrivate
 	int dev_id;
 	int timeout;
 	int hci;
+	/** hci is a stand-in socket given to scanFromSocket(), not an HCI device. */
+	bool hci_external;
 	QSocketNotifier *notifier;
 	QList<GatoUUID> filter_uuids;
 	hci_filter hci_nf, hci_of;
+	/** Peripherals the application asked for; never evicted. */
 	QHash<GatoAddress, GatoPeripheral*> peripherals;
+	/** Scan results of every device recently seen. */
+	GatoAdvertisementTable adverts;
+	QElapsedTimer clock;
+	QString cache_dir;
 
 	bool scanning();
 	bool openDevice();
 	void closeDevice();
 
+	GatoPeripheral *createPeripheral(const GatoAddress &addr);
 	void handleAdvertising(le_advertising_info *info, int rssi);
 };
 
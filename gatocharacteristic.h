@@ -19,7 +19,7 @@ public:
 		PropertyBroadcast = 0x1,
 		PropertyRead = 0x2,
 		PropertyWriteWithoutResponse = 0x4,
-		PropertyWrite = 0x5,
+		PropertyWrite = 0x8,
 		PropertyNotify = 0x10,
 		PropertyIndicate = 0x20,
 		PropertyAuthenticatedSignedWrites = 0x40,
@@ -0,0 +1,354 @@
+/*
+ *  libgato - A GATT/ATT library for use with Bluez
+ *
+ *  Copyright (C) 2013 Javier S. Pedro <maemo@javispedro.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include <QtCore/QDebug>
+
+#include "gatolinkemulator.h"
+
+#define L2CAP_HEADER_SIZE 4
+
+GatoLinkEmulator::GatoLinkEmulator(GatoTransport *backend, QObject *parent)
+    : GatoTransport(parent), link(backend),
+      interval(30), packets_per_event(6), link_mtu(27), bytes_per_second(0), jitter_msec(0),
+      high_water_mark(4096), tx_was_queued(false),
+      event_timer(new QTimer(this)), last_event(0), credit(0)
+{
+	link->setParent(this);
+
+	tx.bytes = rx.bytes = 0;
+	tx.fragments_sent = rx.fragments_sent = 0;
+
+	event_timer->setSingleShot(true);
+	connect(event_timer, SIGNAL(timeout()), SLOT(handleConnectionEvent()));
+
+	connect(link, SIGNAL(connected()), SLOT(handleBackendConnected()));
+	connect(link, SIGNAL(disconnected()), SLOT(handleBackendDisconnected()));
+	connect(link, SIGNAL(readyRead()), SLOT(handleBackendReadyRead()));
+	connect(link, SIGNAL(writeQueueDrained()), SLOT(handleBackendWriteQueueDrained()));
+	connect(link, SIGNAL(error(GatoTransport::Error)), SIGNAL(error(GatoTransport::Error)));
+}
+
+GatoLinkEmulator::~GatoLinkEmulator()
+{
+}
+
+GatoTransport *GatoLinkEmulator::backend() const
+{
+	return link;
+}
+
+int GatoLinkEmulator::connectionInterval() const
+{
+	return interval;
+}
+
+void GatoLinkEmulator::setConnectionInterval(int msec)
+{
+	interval = qMax(0, msec);
+	if (interval == 0) {
+		flush();
+	} else if (event_timer->isActive()) {
+		event_timer->stop();
+		scheduleEvent();
+	}
+}
+
+int GatoLinkEmulator::packetsPerEvent() const
+{
+	return packets_per_event;
+}
+
+void GatoLinkEmulator::setPacketsPerEvent(int packets)
+{
+	packets_per_event = qMax(0, packets);
+}
+
+int GatoLinkEmulator::linkMtu() const
+{
+	return link_mtu;
+}
+
+void GatoLinkEmulator::setLinkMtu(int bytes)
+{
+	if (bytes < 1) {
+		qWarning() << "Invalid link layer MTU" << bytes;
+		return;
+	}
+	link_mtu = bytes;
+}
+
+int GatoLinkEmulator::bandwidth() const
+{
+	return bytes_per_second;
+}
+
+void GatoLinkEmulator::setBandwidth(int bytes_per_second)
+{
+	this->bytes_per_second = qMax(0, bytes_per_second);
+}
+
+int GatoLinkEmulator::jitter() const
+{
+	return jitter_msec;
+}
+
+void GatoLinkEmulator::setJitter(int msec)
+{
+	jitter_msec = qMax(0, msec);
+}
+
+GatoTransport::State GatoLinkEmulator::state() const
+{
+	return link->state();
+}
+
+bool GatoLinkEmulator::connectTo(const GatoAddress &addr, unsigned short cid)
+{
+	reset();
+	return link->connectTo(addr, cid);
+}
+
+void GatoLinkEmulator::close()
+{
+	reset();
+	link->close();
+}
+
+QByteArray GatoLinkEmulator::receive()
+{
+	if (rx_ready.isEmpty()) {
+		return QByteArray();
+	} else {
+		return rx_ready.dequeue();
+	}
+}
+
+void GatoLinkEmulator::recycle(QByteArray &pkt)
+{
+	link->recycle(pkt);
+}
+
+bool GatoLinkEmulator::send(const QByteArray &pkt)
+{
+	if (link->state() != StateConnected) {
+		qWarning() << "Not connected";
+		return false;
+	}
+
+	if (interval == 0) {
+		return link->send(pkt);
+	}
+
+	tx.queue.enqueue(pkt);
+	tx.bytes += pkt.size();
+	tx_was_queued = true;
+	scheduleEvent();
+
+	return true;
+}
+
+int GatoLinkEmulator::pendingWritePackets() const
+{
+	return tx.queue.size() + link->pendingWritePackets();
+}
+
+int GatoLinkEmulator::pendingWriteBytes() const
+{
+	return tx.bytes + link->pendingWriteBytes();
+}
+
+int GatoLinkEmulator::writeHighWaterMark() const
+{
+	return high_water_mark;
+}
+
+void GatoLinkEmulator::setWriteHighWaterMark(int bytes)
+{
+	high_water_mark = bytes;
+}
+
+bool GatoLinkEmulator::canWrite() const
+{
+	return high_water_mark <= 0 || pendingWriteBytes() < high_water_mark;
+}
+
+GatoTransport::SecurityLevel GatoLinkEmulator::securityLevel() const
+{
+	return link->securityLevel();
+}
+
+bool GatoLinkEmulator::setSecurityLevel(SecurityLevel level)
+{
+	return link->setSecurityLevel(level);
+}
+
+int GatoLinkEmulator::fragmentCount(const QByteArray &pkt) const
+{
+	return (pkt.size() + L2CAP_HEADER_SIZE + link_mtu - 1) / link_mtu;
+}
+
+bool GatoLinkEmulator::transferFragment(Direction *dir, int *budget)
+{
+	if (dir->queue.isEmpty()) return false;
+	if (packets_per_event > 0 && *budget <= 0) return false;
+
+	const QByteArray &head = dir->queue.head();
+	const int total = head.size() + L2CAP_HEADER_SIZE;
+	const int size = qMin(link_mtu, total - dir->fragments_sent * link_mtu);
+
+	if (bytes_per_second > 0) {
+		if (credit < size) return false;
+		credit -= size;
+	}
+
+	(*budget)--;
+	dir->fragments_sent++;
+
+	if (dir->fragments_sent >= fragmentCount(head)) {
+		QByteArray pkt = dir->queue.dequeue();
+		dir->bytes -= pkt.size();
+		dir->fragments_sent = 0;
+		if (dir == &tx) {
+			link->send(pkt);
+		} else {
+			rx_ready.enqueue(pkt);
+		}
+	}
+
+	return true;
+}
+
+void GatoLinkEmulator::flush()
+{
+	event_timer->stop();
+
+	while (!tx.queue.isEmpty()) {
+		link->send(tx.queue.dequeue());
+	}
+	while (!rx.queue.isEmpty()) {
+		rx_ready.enqueue(rx.queue.dequeue());
+	}
+	tx.bytes = rx.bytes = 0;
+	tx.fragments_sent = rx.fragments_sent = 0;
+
+	if (!rx_ready.isEmpty()) {
+		emit readyRead();
+	}
+}
+
+void GatoLinkEmulator::scheduleEvent()
+{
+	if (event_timer->isActive()) return;
+	if (tx.queue.isEmpty() && rx.queue.isEmpty()) return;
+	if (link->state() != StateConnected) return;
+
+	// Wait for the next event on the connection interval grid.
+	int delay = interval - int(clock.elapsed() % interval);
+	if (jitter_msec > 0) {
+		delay += qrand() % (jitter_msec + 1);
+	}
+
+	event_timer->start(delay);
+}
+
+void GatoLinkEmulator::reset()
+{
+	event_timer->stop();
+	tx.queue.clear();
+	rx.queue.clear();
+	rx_ready.clear();
+	tx.bytes = rx.bytes = 0;
+	tx.fragments_sent = rx.fragments_sent = 0;
+	tx_was_queued = false;
+}
+
+void GatoLinkEmulator::handleBackendConnected()
+{
+	clock.start();
+	last_event = 0;
+	credit = 0;
+	emit connected();
+}
+
+void GatoLinkEmulator::handleBackendDisconnected()
+{
+	reset();
+	emit disconnected();
+}
+
+void GatoLinkEmulator::handleBackendReadyRead()
+{
+	QByteArray pkt;
+	while (!(pkt = link->receive()).isNull()) {
+		if (interval == 0) {
+			rx_ready.enqueue(pkt);
+		} else {
+			rx.queue.enqueue(pkt);
+			rx.bytes += pkt.size();
+		}
+	}
+
+	if (interval == 0) {
+		if (!rx_ready.isEmpty()) {
+			emit readyRead();
+		}
+	} else {
+		scheduleEvent();
+	}
+}
+
+void GatoLinkEmulator::handleBackendWriteQueueDrained()
+{
+	if (tx.queue.isEmpty()) {
+		tx_was_queued = false;
+		emit writeQueueDrained();
+	}
+}
+
+void GatoLinkEmulator::handleConnectionEvent()
+{
+	const qint64 now = clock.elapsed();
+
+	if (bytes_per_second > 0) {
+		// Air time not used by idle events does not accumulate past one event's worth.
+		const qint64 max_credit = qMax<qint64>(qint64(bytes_per_second) * interval / 1000, link_mtu);
+		credit = qMin(credit + (now - last_event) * bytes_per_second / 1000, max_credit);
+	}
+	last_event = now;
+
+	// Both directions share the event, one fragment at a time.
+	int budget = packets_per_event;
+	bool moved;
+	do {
+		moved = transferFragment(&tx, &budget);
+		moved = transferFragment(&rx, &budget) || moved;
+	} while (moved);
+
+	scheduleEvent();
+
+	if (tx_was_queued && tx.queue.isEmpty() && link->pendingWritePackets() == 0) {
+		tx_was_queued = false;
+		emit writeQueueDrained();
+	}
+	if (!rx_ready.isEmpty()) {
+		emit readyRead();
+	}
+}
@@ -0,0 +1,110 @@
+#ifndef GATOLINKEMULATOR_H
+#define GATOLINKEMULATOR_H
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QQueue>
+#include <QtCore/QTimer>
+
+#include "gatotransport.h"
+
+/** A transport that wraps another one and holds back traffic in both
+ *  directions the way a BLE link layer would: packets only move at connection
+ *  events, each event carries a limited number of link layer packets, and
+ *  PDUs are fragmented to the link layer payload size.
+ *  With a 0 connection interval packets pass straight through. */
+class GatoLinkEmulator : public GatoTransport
+{
+	Q_OBJECT
+
+public:
+	/** Takes ownership of backend. */
+	explicit GatoLinkEmulator(GatoTransport *backend, QObject *parent = 0);
+	~GatoLinkEmulator();
+
+	GatoTransport *backend() const;
+
+	/** Time between connection events, in milliseconds. Default is 30. */
+	int connectionInterval() const;
+	void setConnectionInterval(int msec);
+
+	/** Link layer packets exchanged per connection event, both directions
+	 *  together. Default is 6; 0 means no limit. */
+	int packetsPerEvent() const;
+	void setPacketsPerEvent(int packets);
+
+	/** Link layer payload size; each PDU plus its 4 byte L2CAP header is sent
+	 *  as this many byte fragments. Default is 27 (no data length extension). */
+	int linkMtu() const;
+	void setLinkMtu(int bytes);
+
+	/** Air bytes per second, both directions together; 0 means no limit. */
+	int bandwidth() const;
+	void setBandwidth(int bytes_per_second);
+
+	/** Each connection event is delayed by up to this many extra milliseconds. */
+	int jitter() const;
+	void setJitter(int msec);
+
+	State state() const;
+
+	bool connectTo(const GatoAddress &addr, unsigned short cid);
+	void close();
+
+	QByteArray receive();
+	void recycle(QByteArray &pkt);
+	bool send(const QByteArray &pkt);
+
+	int pendingWritePackets() const;
+	int pendingWriteBytes() const;
+
+	int writeHighWaterMark() const;
+	void setWriteHighWaterMark(int bytes);
+	bool canWrite() const;
+
+	SecurityLevel securityLevel() const;
+	bool setSecurityLevel(SecurityLevel level);
+
+private:
+	struct Direction
+	{
+		QQueue<QByteArray> queue;
+		int bytes;
+		/** Fragments of the packet at the head of the queue already sent. */
+		int fragments_sent;
+	};
+
+	int fragmentCount(const QByteArray &pkt) const;
+	bool transferFragment(Direction *dir, int *budget);
+	void flush();
+	void scheduleEvent();
+	void reset();
+
+private slots:
+	void handleBackendConnected();
+	void handleBackendDisconnected();
+	void handleBackendReadyRead();
+	void handleBackendWriteQueueDrained();
+	void handleConnectionEvent();
+
+private:
+	GatoTransport *link;
+	int interval;
+	int packets_per_event;
+	int link_mtu;
+	int bytes_per_second;
+	int jitter_msec;
+	int high_water_mark;
+
+	Direction tx;
+	Direction rx;
+	/** Packets that crossed the emulated link, waiting for receive(). */
+	QQueue<QByteArray> rx_ready;
+	bool tx_was_queued;
+
+	QTimer *event_timer;
+	QElapsedTimer clock;
+	qint64 last_event;
+	qint64 credit;
+};
+
+#endif // GATOLINKEMULATOR_H
@@ -0,0 +1,103 @@
+/*
+ *  libgato - A GATT/ATT library for use with Bluez
+ *
+ *  Copyright (C) 2013 Javier S. Pedro <maemo@javispedro.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <QtCore/QDebug>
+
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "gatolocaltransport.h"
+
+GatoLocalTransport::GatoLocalTransport(QObject *parent)
+    : GatoSocket(parent), peer_fd(-1), sec_level(SecurityLow)
+{
+}
+
+GatoLocalTransport::~GatoLocalTransport()
+{
+	close();
+}
+
+bool GatoLocalTransport::connectTo(const GatoAddress &addr, unsigned short cid)
+{
+	Q_UNUSED(addr);
+	Q_UNUSED(cid);
+
+	if (state() != StateDisconnected) {
+		qWarning() << "Already connecting or connected";
+		return false;
+	}
+
+	int fds[2];
+	if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, fds) == -1) {
+		qErrnoWarning("Could not create local socket pair");
+		return false;
+	}
+
+	if (peer_fd != -1) {
+		::close(peer_fd);
+	}
+	peer_fd = fds[1];
+	sec_level = SecurityLow;
+
+	// Connects as soon as the event loop sees the socket writable.
+	attach(fds[0]);
+
+	return true;
+}
+
+void GatoLocalTransport::close()
+{
+	GatoSocket::close();
+	if (peer_fd != -1) {
+		::close(peer_fd);
+		peer_fd = -1;
+	}
+}
+
+bool GatoLocalTransport::open(int fd)
+{
+	if (state() != StateDisconnected) {
+		qWarning() << "Already connecting or connected";
+		return false;
+	}
+
+	attach(fd);
+
+	return true;
+}
+
+int GatoLocalTransport::takePeerDescriptor()
+{
+	int fd = peer_fd;
+	peer_fd = -1;
+	return fd;
+}
+
+GatoTransport::SecurityLevel GatoLocalTransport::securityLevel() const
+{
+	return sec_level;
+}
+
+bool GatoLocalTransport::setSecurityLevel(SecurityLevel level)
+{
+	sec_level = level;
+	return true;
+}
@@ -0,0 +1,38 @@
+#ifndef GATOLOCALTRANSPORT_H
+#define GATOLOCALTRANSPORT_H
+
+#include "gatosocket.h"
+
+/** Transport over one end of a socketpair(AF_UNIX, SOCK_SEQPACKET), so that the
+ *  ATT/GATT stack can be driven in-process without any bluetooth hardware.
+ *  Whatever owns the other end of the pair plays the remote device. */
+class GatoLocalTransport : public GatoSocket
+{
+	Q_OBJECT
+
+public:
+	explicit GatoLocalTransport(QObject *parent = 0);
+	~GatoLocalTransport();
+
+	/** Creates a new pair; the address and channel are ignored. */
+	bool connectTo(const GatoAddress &addr, unsigned short cid);
+	void close();
+
+	/** Drives an existing non-blocking SOCK_SEQPACKET socket instead, e.g. the
+	 *  peer end of another transport, and takes ownership of it. */
+	bool open(int fd);
+
+	/** Hands over the remote end of the pair created by the last connectTo().
+	 *  The caller becomes its owner; returns -1 if there is none. */
+	int takePeerDescriptor();
+
+	/** There is no link layer security; the requested level is just remembered. */
+	SecurityLevel securityLevel() const;
+	bool setSecurityLevel(SecurityLevel level);
+
+private:
+	int peer_fd;
+	SecurityLevel sec_level;
+};
+
+#endif // GATOLOCALTRANSPORT_H
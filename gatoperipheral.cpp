@@ -21,52 +21,44 @@
 #include <QtCore/QDebug>
 
 #include <assert.h>
+#include <string.h>
 #include <bluetooth/bluetooth.h>
 
 #include "gatoperipheral_p.h"
+#include "gatoattributecache.h"
 #include "gatoaddress.h"
 #include "gatouuid.h"
 #include "helpers.h"
 
-/* Consult Bluetooth.org "Generic Access Profile" assigned numbers specification */
-enum EIRDataFields {
-	EIRFlags = 0x01,
-	EIRIncompleteUUID16List = 0x02,
-	EIRCompleteUUID16List = 0x03,
-	EIRIncompleteUUID32List = 0x04,
-	EIRCompleteUUID32List = 0x05,
-	EIRIncompleteUUID128List = 0x06,
-	EIRCompleteUUID128List = 0x07,
-	EIRIncompleteLocalName = 0x08,
-	EIRCompleteLocalName = 0x09,
-	EIRTxPowerLevel = 0x0A,
-	EIRDeviceClass = 0x0D,
-	EIRSecurityManagerTKValue = 0x10,
-	EIRSecurityManagerOutOfBandFlags = 0x11,
-	EIRSolicitedUUID16List = 0x14,
-	EIRSolicitedUUID32List = 0x1F,
-	EIRSolicitedUUID128List = 0x15,
-	EIRAppearance = 0x19,
-	EIRAdvertisingInterval = 0x1A,
-	EIRLEBluetoothDeviceAddress = 0x1B,
-	EIRLERole = 0x1C,
-	EIRManufacturerData = 0xFF
-};
+static inline GatoAttClient::Priority att_priority(GatoPeripheral::RequestPriority priority)
+{
+	return static_cast<GatoAttClient::Priority>(priority);
+}
 
 GatoPeripheral::GatoPeripheral(const GatoAddress &addr, QObject *parent) :
+    GatoPeripheral(0, addr, parent)
+{
+}
+
+GatoPeripheral::GatoPeripheral(GatoTransport *transport, const GatoAddress &addr, QObject *parent) :
     QObject(parent), d_ptr(new GatoPeripheralPrivate(this))
 {
 	Q_D(GatoPeripheral);
 	d->addr = addr;
-	d->att = new GatoAttClient(this);
+	d->att = new GatoAttClient(transport, this);
 
 	connect(d->att, SIGNAL(connected()), d, SLOT(handleAttConnected()));
 	connect(d->att, SIGNAL(disconnected()), d, SLOT(handleAttDisconnected()));
 	connect(d->att, SIGNAL(attributeUpdated(GatoHandle,QByteArray,bool)), d, SLOT(handleAttAttributeUpdated(GatoHandle,QByteArray,bool)));
+	connect(d->att, SIGNAL(writeQueueDrained()), SIGNAL(readyToWriteWithoutResponse()));
 }
 
 GatoPeripheral::~GatoPeripheral()
 {
+	Q_D(GatoPeripheral);
+	if (d->cache_dirty) {
+		d->saveCache();
+	}
 	if (state() != StateDisconnected) {
 		disconnect();
 	}
@@ -100,54 +92,50 @@ QList<GatoService> GatoPeripheral::services() const
 QByteArray GatoPeripheral::advertData() const
 {
 	Q_D(const GatoPeripheral);
-	return d->advert_data;
+	return d->advert_data + d->scan_rsp_data;
 }
 
-void GatoPeripheral::parseEIR(quint8 data[], int len)
+void GatoPeripheral::parseEIR(quint8 data[], int len, quint8 advertType)
 {
 	Q_D(GatoPeripheral);
+	QByteArray &last = advertType == 0x04 ? d->scan_rsp_data : d->advert_data;
 
-	d->advert_data = QByteArray((char*)data, len);
-
-	int pos = 0;
-	while (pos < len) {
-		int item_len = data[pos];
-		pos++;
-		if (item_len == 0) break;
+	// With duplicates allowed, the same payload keeps coming several times per second.
+	if (len == last.size() && memcmp(last.constData(), data, len) == 0) {
+		return;
+	}
 
-		int type = data[pos];
-		if (pos + item_len > len) {
-			qWarning() << "Malformed EIR data";
-			return;
-		}
+	last = QByteArray(reinterpret_cast<char*>(data), len);
 
-		switch (type) {
+	GatoEIRIterator it(data, len);
+	while (it.next()) {
+		switch (it.type()) {
 		case EIRFlags:
-			d->parseEIRFlags(&data[pos + 1], item_len - 1);
+			d->parseEIRFlags(it.data(), it.size());
 			break;
 		case EIRIncompleteUUID16List:
-			d->parseEIRUUIDs(16/8, false, &data[pos + 1], item_len - 1);
+			d->parseEIRUUIDs(16/8, false, it.data(), it.size());
 			break;
 		case EIRCompleteUUID16List:
-			d->parseEIRUUIDs(16/8, true, &data[pos + 1], item_len - 1);
+			d->parseEIRUUIDs(16/8, true, it.data(), it.size());
 			break;
 		case EIRIncompleteUUID32List:
-			d->parseEIRUUIDs(32/8, false, &data[pos + 1], item_len - 1);
+			d->parseEIRUUIDs(32/8, false, it.data(), it.size());
 			break;
 		case EIRCompleteUUID32List:
-			d->parseEIRUUIDs(32/8, true, &data[pos + 1], item_len - 1);
+			d->parseEIRUUIDs(32/8, true, it.data(), it.size());
 			break;
 		case EIRIncompleteUUID128List:
-			d->parseEIRUUIDs(128/8, false, &data[pos + 1], item_len - 1);
+			d->parseEIRUUIDs(128/8, false, it.data(), it.size());
 			break;
 		case EIRCompleteUUID128List:
-			d->parseEIRUUIDs(128/8, true, &data[pos + 1], item_len - 1);
+			d->parseEIRUUIDs(128/8, true, it.data(), it.size());
 			break;
 		case EIRIncompleteLocalName:
-			d->parseName(false, &data[pos + 1], item_len - 1);
+			d->parseName(false, it.data(), it.size());
 			break;
 		case EIRCompleteLocalName:
-			d->parseName(true, &data[pos + 1], item_len - 1);
+			d->parseName(true, it.data(), it.size());
 			break;
 
 		// Following EIR fields are purposefully ignored:
@@ -160,19 +148,16 @@ void GatoPeripheral::parseEIR(quint8 data[], int len)
 		case EIRLEBluetoothDeviceAddress:
 		case EIRLERole:
 		case EIRManufacturerData:
-			//qDebug() << "Ignored EIR data type" << type;
+			//qDebug() << "Ignored EIR data type" << it.type();
 			break;
 		default:
-			//qWarning() << "Unknown EIR data type" << type;
+			//qWarning() << "Unknown EIR data type" << it.type();
 			break;
 		}
-
-		pos += item_len;
 	}
 
-	if (pos != len) {
-		qWarning() << "Invalid trailing data after EIR";
-		return;
+	if (it.isMalformed()) {
+		qWarning() << "Malformed EIR data";
 	}
 }
 
@@ -182,17 +167,63 @@ bool GatoPeripheral::advertisesService(const GatoUUID &uuid) const
 	return d->service_uuids.contains(uuid);
 }
 
+bool GatoPeripheral::writeCoalescing() const
+{
+	Q_D(const GatoPeripheral);
+	return d->att->writeCoalescing();
+}
+
+void GatoPeripheral::setWriteCoalescing(bool enabled)
+{
+	Q_D(GatoPeripheral);
+	d->att->setWriteCoalescing(enabled);
+}
+
+int GatoPeripheral::writeHighWaterMark() const
+{
+	Q_D(const GatoPeripheral);
+	return d->att->writeHighWaterMark();
+}
+
+void GatoPeripheral::setWriteHighWaterMark(int bytes)
+{
+	Q_D(GatoPeripheral);
+	d->att->setWriteHighWaterMark(bytes);
+}
+
+bool GatoPeripheral::canWriteWithoutResponse() const
+{
+	Q_D(const GatoPeripheral);
+	return d->att->canWriteCommand();
+}
+
+QString GatoPeripheral::cacheDirectory() const
+{
+	Q_D(const GatoPeripheral);
+	return d->cache_dir;
+}
+
+void GatoPeripheral::setCacheDirectory(const QString &path)
+{
+	Q_D(GatoPeripheral);
+	d->cache_dir = path;
+}
+
 void GatoPeripheral::connectPeripheral(PeripheralConnectOptions options)
 {
 	Q_D(GatoPeripheral);
-	if (d->att->state() != GatoSocket::StateDisconnected) {
+	if (d->att->state() != GatoTransport::StateDisconnected) {
 		qDebug() << "Already connecting";
 		return;
 	}
 
-	GatoSocket::SecurityLevel sec_level = GatoSocket::SecurityLow;
+	GatoTransport::SecurityLevel sec_level = GatoTransport::SecurityLow;
 	if (options & PeripheralConnectOptionRequireEncryption) {
-		sec_level = GatoSocket::SecurityMedium;
+		sec_level = GatoTransport::SecurityMedium;
+	}
+
+	if (!d->cache_dir.isEmpty() && d->services.isEmpty()) {
+		d->loadCache();
 	}
 
 	d->att->connectTo(d->addr, sec_level);
@@ -208,10 +239,12 @@ void GatoPeripheral::disconnectPeripheral()
 void GatoPeripheral::discoverServices()
 {
 	Q_D(GatoPeripheral);
-	if (!d->complete_services && state() == StateConnected) {
+	if (d->complete_services) {
+		emit servicesDiscovered();
+	} else if (state() == StateConnected) {
 		d->clearServices();
 		d->att->requestReadByGroupType(0x0001, 0xFFFF, GatoUUID::GattPrimaryService,
-		                               d, SLOT(handlePrimary(QList<GatoAttClient::AttributeGroupData>)));
+		                               [d](uint req, const GatoAttClient::AttributeGroupDataList &list) { d->handlePrimary(req, list); });
 	} else {
 		qWarning() << "Not connected";
 	}
@@ -221,11 +254,13 @@ void GatoPeripheral::discoverServices(const QList<GatoUUID> &serviceUUIDs)
 {
 	Q_D(GatoPeripheral);
 	if (serviceUUIDs.isEmpty()) return;
-	if (state() == StateConnected) {
+	if (d->complete_services) {
+		emit servicesDiscovered();
+	} else if (state() == StateConnected) {
 		foreach (const GatoUUID& uuid, serviceUUIDs) {
 			QByteArray value = gatouuid_to_bytearray(uuid, true, false);
 			uint req = d->att->requestFindByTypeValue(0x0001, 0xFFFF, GatoUUID::GattPrimaryService, value,
-			                                          d, SLOT(handlePrimaryForService(uint,QList<GatoAttClient::HandleInformation>)));
+			                                          [d](uint req, const GatoAttClient::HandleInformationList &list) { d->handlePrimaryForService(req, list); });
 			d->pending_primary_reqs.insert(req, uuid);
 		}
 	} else {
@@ -251,6 +286,11 @@ void GatoPeripheral::discoverCharacteristics(const GatoService &service)
 		return;
 	}
 
+	if (d->known_handles.contains(our_service.startHandle())) {
+		emit characteristicsDiscovered(our_service);
+		return;
+	}
+
 	if (state() == StateConnected) {
 		GatoHandle start = our_service.startHandle();
 		GatoHandle end = our_service.endHandle();
@@ -258,7 +298,7 @@ void GatoPeripheral::discoverCharacteristics(const GatoService &service)
 		d->clearServiceCharacteristics(&our_service);
 
 		uint req = d->att->requestReadByType(start, end, GatoUUID::GattCharacteristic,
-		                                     d, SLOT(handleCharacteristic(QList<GatoAttClient::AttributeData>)));
+		                                     [d](uint req, const GatoAttClient::AttributeDataList &list) { d->handleCharacteristic(req, list); });
 		d->pending_characteristic_reqs.insert(req, start);
 	} else {
 		qWarning() << "Not connected";
@@ -277,137 +317,237 @@ void GatoPeripheral::discoverDescriptors(const GatoCharacteristic &characteristi
 	Q_D(GatoPeripheral);
 
 	GatoHandle char_handle = characteristic.startHandle();
-	GatoHandle service_handle = d->characteristic_to_service.value(char_handle);
+	GatoCharacteristic our_char = d->characteristicAt(char_handle);
 
-	if (!service_handle) {
+	if (our_char.isNull()) {
 		qWarning() << "Unknown characteristic for this peripheral";
 		return;
 	}
 
-	GatoService &our_service = d->services[service_handle];
-	Q_ASSERT(our_service.containsCharacteristic(char_handle));
-	GatoCharacteristic our_char = our_service.getCharacteristic(char_handle);
-	Q_ASSERT(our_char.startHandle() == char_handle);
+	if (d->known_handles.contains(char_handle)) {
+		d->finishSetNotifyOperations(our_char);
+		emit descriptorsDiscovered(our_char);
+		return;
+	}
 
 	if (state() == StateConnected) {
 		d->clearCharacteristicDescriptors(&our_char);
-		our_service.addCharacteristic(our_char); // Update service with empty descriptors list
+		d->storeCharacteristic(d->attribute(char_handle).service, our_char); // Update service with empty descriptors list
 		uint req = d->att->requestFindInformation(our_char.startHandle() + 1, our_char.endHandle(),
-		                                          d, SLOT(handleDescriptors(uint,QList<GatoAttClient::InformationData>)));
+		                                          [d](uint req, const GatoAttClient::InformationDataList &list) { d->handleDescriptors(req, list); });
 		d->pending_descriptor_reqs.insert(req, char_handle);
 	} else {
 		qWarning() << "Not connected";
 	}
 }
 
-void GatoPeripheral::readValue(const GatoCharacteristic &characteristic)
+void GatoPeripheral::discoverAll()
+{
+	Q_D(GatoPeripheral);
+
+	if (d->pending_discover_all > 0) {
+		// Already running; discoveryFinished() will follow.
+		return;
+	}
+
+	if (d->isFullyDiscovered()) {
+		emit discoveryFinished();
+		return;
+	}
+
+	if (state() != StateConnected) {
+		qWarning() << "Not connected";
+		return;
+	}
+
+	d->complete_services = false;
+	d->clearServices();
+	d->discover_all_chars.clear();
+
+	// Services and characteristic declarations are swept over the whole handle
+	// range at the same time; characteristics are sorted into services later.
+	d->pending_discover_all = 2;
+	d->discover_all_reqs.insert(d->att->requestReadByGroupType(0x0001, 0xFFFF, GatoUUID::GattPrimaryService,
+	                                                           [d](uint req, const GatoAttClient::AttributeGroupDataList &list) { d->handleDiscoverAllPrimary(req, list); }));
+	d->discover_all_reqs.insert(d->att->requestReadByType(0x0001, 0xFFFF, GatoUUID::GattCharacteristic,
+	                                                      [d](uint req, const GatoAttClient::AttributeDataList &list) { d->handleDiscoverAllCharacteristics(req, list); }));
+}
+
+void GatoPeripheral::readValue(const GatoCharacteristic &characteristic, RequestPriority priority)
 {
 	Q_D(GatoPeripheral);
 
 	GatoHandle char_handle = characteristic.startHandle();
-	GatoHandle service_handle = d->characteristic_to_service.value(char_handle);
 
-	if (!service_handle) {
+	if (!d->knowsCharacteristic(char_handle)) {
 		qWarning() << "Unknown characteristic for this peripheral";
 		return;
 	}
 
-	GatoService &our_service = d->services[service_handle];
-	Q_ASSERT(our_service.containsCharacteristic(char_handle));
-	Q_UNUSED(our_service);
-
 	if (state() == StateConnected) {
-		uint req = d->att->requestRead(characteristic.valueHandle(),
-		                               d, SLOT(handleCharacteristicRead(uint,QByteArray)));
+		uint req = d->att->requestReadLong(characteristic.valueHandle(),
+		                                   [d](uint req, const QByteArray &value) { d->handleCharacteristicRead(req, value); },
+		                                   -1, att_priority(priority));
 		d->pending_characteristic_read_reqs.insert(req, char_handle);
 	} else {
 		qWarning() << "Not connected";
 	}
 }
 
-void GatoPeripheral::readValue(const GatoDescriptor &descriptor)
+void GatoPeripheral::readValue(const GatoDescriptor &descriptor, RequestPriority priority)
 {
 	Q_D(GatoPeripheral);
 
 	GatoHandle desc_handle = descriptor.handle();
-	GatoHandle char_handle = d->descriptor_to_characteristic.value(desc_handle);
 
-	if (!char_handle) {
+	if (!d->knowsDescriptor(desc_handle)) {
 		qWarning() << "Unknown descriptor for this peripheral";
 		return;
 	}
 
-	GatoHandle service_handle = d->characteristic_to_service.value(char_handle);
-	Q_ASSERT(service_handle);
-
-	GatoService &our_service = d->services[service_handle];
-	Q_ASSERT(our_service.containsCharacteristic(char_handle));
-	Q_UNUSED(our_service);
-
 	if (state() == StateConnected) {
-		uint req = d->att->requestRead(descriptor.handle(),
-		                               d, SLOT(handleDescriptorRead(uint,QByteArray)));
-		d->pending_descriptor_read_reqs.insert(req, char_handle);
+		uint req = d->att->requestReadLong(desc_handle,
+		                                   [d](uint req, const QByteArray &value) { d->handleDescriptorRead(req, value); },
+		                                   -1, att_priority(priority));
+		d->pending_descriptor_read_reqs.insert(req, desc_handle);
 	} else {
 		qWarning() << "Not connected";
 	}
 }
 
-void GatoPeripheral::writeValue(const GatoCharacteristic &characteristic, const QByteArray &data, WriteType type)
+void GatoPeripheral::readValues(const QList<GatoCharacteristic> &characteristics, RequestPriority priority)
+{
+	Q_D(GatoPeripheral);
+
+	if (state() != StateConnected) {
+		qWarning() << "Not connected";
+		return;
+	}
+
+	if (!d->read_multiple_variable || characteristics.size() < 2) {
+		foreach (const GatoCharacteristic &characteristic, characteristics) {
+			readValue(characteristic, priority);
+		}
+		return;
+	}
+
+	QList<GatoCharacteristic> known;
+	foreach (const GatoCharacteristic &characteristic, characteristics) {
+		if (d->knowsCharacteristic(characteristic.startHandle())) {
+			known.append(characteristic);
+		} else {
+			qWarning() << "Unknown characteristic for this peripheral";
+		}
+	}
+
+	// Pack as many handles as fit in a request; a request needs at least two.
+	const int max_handles = (d->att->mtu() - 1) / sizeof(GatoHandle);
+
+	for (int first = 0; first < known.size(); first += max_handles) {
+		const int count = qMin(max_handles, known.size() - first);
+		if (count == 1) {
+			readValue(known.at(first), priority);
+			break;
+		}
+
+		QList<GatoHandle> char_handles;
+		QList<GatoHandle> value_handles;
+		for (int i = first; i < first + count; i++) {
+			char_handles.append(known.at(i).startHandle());
+			value_handles.append(known.at(i).valueHandle());
+		}
+
+		uint req = d->att->requestReadMultipleVariable(value_handles,
+		                                               [d, priority](uint req, const GatoAttClient::LengthValueList &values) { d->handleCharacteristicMultipleRead(req, values, priority); },
+		                                               att_priority(priority));
+		d->pending_characteristic_multi_read_reqs.insert(req, char_handles);
+	}
+}
+
+void GatoPeripheral::streamValue(const GatoCharacteristic &characteristic, int maxLength, RequestPriority priority)
 {
 	Q_D(GatoPeripheral);
 
 	GatoHandle char_handle = characteristic.startHandle();
-	GatoHandle service_handle = d->characteristic_to_service.value(char_handle);
 
-	if (!service_handle) {
+	if (!d->knowsCharacteristic(char_handle)) {
 		qWarning() << "Unknown characteristic for this peripheral";
 		return;
 	}
 
-	GatoService &our_service = d->services[service_handle];
-	Q_ASSERT(our_service.containsCharacteristic(char_handle));
-	Q_UNUSED(our_service);
+	if (state() == StateConnected) {
+		uint req = d->att->requestReadLongStream(characteristic.valueHandle(),
+		                                         [d](uint req, int offset, const GatoAttClient::ValueRef &chunk, bool last) { d->handleCharacteristicChunk(req, offset, chunk, last); },
+		                                         maxLength, att_priority(priority));
+		d->pending_characteristic_stream_reqs.insert(req, char_handle);
+	} else {
+		qWarning() << "Not connected";
+	}
+}
+
+void GatoPeripheral::writeValue(const GatoCharacteristic &characteristic, const QByteArray &data, WriteType type, RequestPriority priority)
+{
+	Q_D(GatoPeripheral);
+
+	if (!d->knowsCharacteristic(characteristic.startHandle())) {
+		qWarning() << "Unknown characteristic for this peripheral";
+		return;
+	}
 
 	if (state() == StateConnected) {
+		// Values that do not fit in a single Write Request go out as a long write
+		const bool fits = data.size() <= d->att->mtu() - 3;
 		switch (type) {
 		case WriteWithResponse:
-			d->att->requestWrite(characteristic.valueHandle(), data,
-			                     d, SLOT(handleCharacteristicWrite(uint,bool)));
+			if (fits) {
+				d->att->requestWrite(characteristic.valueHandle(), data,
+				                     [d](uint req, bool ok) { d->handleCharacteristicWrite(req, ok); },
+				                     att_priority(priority));
+			} else {
+				d->att->requestWriteLong(characteristic.valueHandle(), data,
+				                         [d](uint req, bool ok) { d->handleCharacteristicWrite(req, ok); },
+				                         false, att_priority(priority));
+			}
 			break;
 		case WriteWithoutResponse:
-			d->att->commandWrite(characteristic.valueHandle(), data);
+			if (!fits) {
+				qWarning() << "Value too long to be written without response";
+				return;
+			}
+			if (!d->att->commandWrite(characteristic.valueHandle(), data)) {
+				qWarning() << "Write queue full, value not sent";
+			}
+			break;
+		case WriteReliable:
+			d->att->requestWriteLong(characteristic.valueHandle(), data,
+			                         [d](uint req, bool ok) { d->handleCharacteristicWrite(req, ok); },
+			                         true, att_priority(priority));
 			break;
 		}
-
-
 	} else {
 		qWarning() << "Not connected";
 	}
 }
 
-void GatoPeripheral::writeValue(const GatoDescriptor &descriptor, const QByteArray &data)
+void GatoPeripheral::writeValue(const GatoDescriptor &descriptor, const QByteArray &data, RequestPriority priority)
 {
 	Q_D(GatoPeripheral);
 
-	GatoHandle desc_handle = descriptor.handle();
-	GatoHandle char_handle = d->descriptor_to_characteristic.value(desc_handle);
-
-	if (!char_handle) {
+	if (!d->knowsDescriptor(descriptor.handle())) {
 		qWarning() << "Unknown descriptor for this peripheral";
 		return;
 	}
 
-	GatoHandle service_handle = d->characteristic_to_service.value(char_handle);
-	Q_ASSERT(service_handle);
-
-	GatoService &our_service = d->services[service_handle];
-	Q_ASSERT(our_service.containsCharacteristic(char_handle));
-	Q_UNUSED(our_service);
-
 	if (state() == StateConnected) {
-		d->att->requestWrite(descriptor.handle(), data,
-		                     d, SLOT(handleDescriptorWrite(uint,bool)));
+		if (data.size() <= d->att->mtu() - 3) {
+			d->att->requestWrite(descriptor.handle(), data,
+			                     [d](uint req, bool ok) { d->handleDescriptorWrite(req, ok); },
+			                     att_priority(priority));
+		} else {
+			d->att->requestWriteLong(descriptor.handle(), data,
+			                         [d](uint req, bool ok) { d->handleDescriptorWrite(req, ok); },
+			                         false, att_priority(priority));
+		}
 	} else {
 		qWarning() << "Not connected";
 	}
@@ -418,17 +558,13 @@ void GatoPeripheral::setNotification(const GatoCharacteristic &characteristic, b
 	Q_D(GatoPeripheral);
 
 	GatoHandle char_handle = characteristic.startHandle();
-	GatoHandle service_handle = d->characteristic_to_service.value(char_handle);
+	GatoCharacteristic our_char = d->characteristicAt(char_handle);
 
-	if (!service_handle) {
+	if (our_char.isNull()) {
 		qWarning() << "Unknown characteristic for this peripheral";
 		return;
 	}
 
-	GatoService &our_service = d->services[service_handle];
-	Q_ASSERT(our_service.containsCharacteristic(char_handle));
-	GatoCharacteristic our_char = our_service.getCharacteristic(char_handle);
-
 	if (!(our_char.properties() & GatoCharacteristic::PropertyNotify)) {
 		qWarning() << "Characteristic does not support notifications";
 		return;
@@ -443,7 +579,7 @@ void GatoPeripheral::setNotification(const GatoCharacteristic &characteristic, b
 	if (our_char.containsDescriptor(uuid)) {
 		GatoDescriptor desc = our_char.getDescriptor(uuid);
 		d->pending_set_notify.remove(char_handle);
-		writeValue(characteristic, d->genClientCharConfiguration(true, false));
+		writeValue(desc, d->genClientCharConfiguration(enabled, false));
 	} else {
 		d->pending_set_notify[char_handle] = enabled;
 		discoverDescriptors(our_char); // May need to find appropiate descriptor
@@ -452,7 +588,9 @@ void GatoPeripheral::setNotification(const GatoCharacteristic &characteristic, b
 
 GatoPeripheralPrivate::GatoPeripheralPrivate(GatoPeripheral *parent)
     : QObject(parent), q_ptr(parent),
-      complete_name(false), complete_services(false)
+      complete_name(false), complete_services(false), read_multiple_variable(true),
+      cache_loaded(false), cache_dirty(false), validating_cache(false),
+      pending_discover_all(0)
 {
 }
 
@@ -461,14 +599,14 @@ GatoPeripheralPrivate::~GatoPeripheralPrivate()
 	delete att;
 }
 
-void GatoPeripheralPrivate::parseEIRFlags(quint8 data[], int len)
+void GatoPeripheralPrivate::parseEIRFlags(const quint8 data[], int len)
 {
 	Q_UNUSED(data);
 	Q_UNUSED(len);
 	// Nothing to do for now.
 }
 
-void GatoPeripheralPrivate::parseEIRUUIDs(int size, bool complete, quint8 data[], int len)
+void GatoPeripheralPrivate::parseEIRUUIDs(int size, bool complete, const quint8 data[], int len)
 {
 	Q_UNUSED(complete);
 
@@ -477,28 +615,33 @@ void GatoPeripheralPrivate::parseEIRUUIDs(int size, bool complete, quint8 data[]
 		return;
 	}
 
-	for (int pos = 0; pos < len; pos += size) {
-		char *ptr = reinterpret_cast<char*>(&data[pos]);
-		QByteArray ba = QByteArray::fromRawData(ptr, size);
-
-		service_uuids.insert(bytearray_to_gatouuid(ba));
+	for (int pos = 0; pos + size <= len; pos += size) {
+		service_uuids.insert(read_gatouuid(reinterpret_cast<const char*>(&data[pos]), size));
 	}
 }
 
-void GatoPeripheralPrivate::parseName(bool complete, quint8 data[], int len)
+void GatoPeripheralPrivate::parseName(bool complete, const quint8 data[], int len)
 {
 	Q_Q(GatoPeripheral);
 	if (complete || !complete_name) {
-		name = QString::fromUtf8(reinterpret_cast<char*>(data), len);
+		if (complete == complete_name && len == name_data.size()
+		        && memcmp(name_data.constData(), data, len) == 0) {
+			return;
+		}
+		name_data = QByteArray(reinterpret_cast<const char*>(data), len);
+		const QString new_name = QString::fromUtf8(name_data);
 		complete_name = complete;
-		emit q->nameChanged();
+		if (new_name != name) {
+			name = new_name;
+			emit q->nameChanged();
+		}
 	}
 }
 
-GatoCharacteristic GatoPeripheralPrivate::parseCharacteristicValue(const QByteArray &ba)
+GatoCharacteristic GatoPeripheralPrivate::parseCharacteristicValue(const GatoAttClient::ValueRef &value)
 {
 	GatoCharacteristic characteristic;
-	const char *data = ba.constData();
+	const char *data = value.data;
 
 	quint8 properties = data[0];
 	characteristic.setProperties(GatoCharacteristic::Properties(properties));
@@ -506,7 +649,7 @@ GatoCharacteristic GatoPeripheralPrivate::parseCharacteristicValue(const QByteAr
 	GatoHandle handle = read_le<quint16>(&data[1]);
 	characteristic.setValueHandle(handle);
 
-	GatoUUID uuid = bytearray_to_gatouuid(ba.mid(3));
+	GatoUUID uuid = read_gatouuid(&data[3], value.size - 3);
 	characteristic.setUuid(uuid);
 
 	return characteristic;
@@ -528,12 +671,168 @@ QByteArray GatoPeripheralPrivate::genClientCharConfiguration(bool notification,
 	return ba;
 }
 
+const GatoPeripheralPrivate::AttributeEntry &GatoPeripheralPrivate::attribute(GatoHandle handle) const
+{
+	static const AttributeEntry none;
+	if (handle < attributes.size()) {
+		return attributes.at(handle);
+	} else {
+		return none;
+	}
+}
+
+bool GatoPeripheralPrivate::knowsCharacteristic(GatoHandle char_handle) const
+{
+	return attribute(char_handle).type == AttributeCharacteristic;
+}
+
+bool GatoPeripheralPrivate::knowsDescriptor(GatoHandle desc_handle) const
+{
+	return attribute(desc_handle).type == AttributeDescriptor;
+}
+
+GatoHandle GatoPeripheralPrivate::characteristicOwning(GatoHandle handle) const
+{
+	// Descriptors follow their characteristic's declaration and value.
+	for (int h = qMin<int>(handle, attributes.size() - 1); h > 0; h--) {
+		const AttributeEntry &entry = attributes.at(h);
+		if (entry.type == AttributeCharacteristic) {
+			return entry.object.endHandle() >= handle ? h : 0;
+		} else if (entry.type == AttributeService) {
+			break;
+		}
+	}
+	return 0;
+}
+
+GatoCharacteristic GatoPeripheralPrivate::characteristicAt(GatoHandle char_handle) const
+{
+	const AttributeEntry &entry = attribute(char_handle);
+	if (entry.type == AttributeCharacteristic) {
+		return entry.object;
+	} else {
+		return GatoCharacteristic();
+	}
+}
+
+void GatoPeripheralPrivate::addService(const GatoService &service)
+{
+	const GatoHandle start = service.startHandle();
+
+	services.insert(start, service);
+
+	if (attributes.size() <= start) {
+		attributes.resize(start + 1);
+	}
+	AttributeEntry &entry = attributes[start];
+	entry.type = AttributeService;
+	entry.service = start;
+	entry.characteristic = 0;
+	entry.object = GatoCharacteristic();
+}
+
+void GatoPeripheralPrivate::storeCharacteristic(GatoHandle service_start, const GatoCharacteristic &characteristic)
+{
+	QMap<GatoHandle, GatoService>::iterator it = services.find(service_start);
+	if (it == services.end()) {
+		qWarning() << "Unknown service for characteristic" << characteristic.startHandle();
+		return;
+	}
+	it->addCharacteristic(characteristic);
+	indexCharacteristic(service_start, characteristic);
+}
+
+void GatoPeripheralPrivate::indexCharacteristic(GatoHandle service_start, const GatoCharacteristic &characteristic)
+{
+	const GatoHandle char_handle = characteristic.startHandle();
+	const QList<GatoDescriptor> descriptors = characteristic.descriptors();
+
+	GatoHandle last = qMax(char_handle, characteristic.valueHandle());
+	if (!descriptors.isEmpty()) {
+		last = qMax(last, descriptors.last().handle());
+	}
+	if (attributes.size() <= last) {
+		attributes.resize(last + 1);
+	}
+
+	AttributeEntry &decl = attributes[char_handle];
+	decl.type = AttributeCharacteristic;
+	decl.service = service_start;
+	decl.characteristic = char_handle;
+	decl.object = characteristic;
+
+	if (characteristic.valueHandle() != char_handle) {
+		AttributeEntry &value = attributes[characteristic.valueHandle()];
+		value.type = AttributeValue;
+		value.service = service_start;
+		value.characteristic = char_handle;
+		value.object = characteristic;
+	}
+
+	foreach (const GatoDescriptor &descriptor, descriptors) {
+		AttributeEntry &entry = attributes[descriptor.handle()];
+		entry.type = AttributeDescriptor;
+		entry.service = service_start;
+		entry.characteristic = char_handle;
+		entry.object = GatoCharacteristic();
+	}
+}
+
+void GatoPeripheralPrivate::clearAttributes(GatoHandle start, GatoHandle end)
+{
+	const int last = qMin<int>(end, attributes.size() - 1);
+	for (int handle = start; handle <= last; handle++) {
+		attributes[handle] = AttributeEntry();
+	}
+}
+
 void GatoPeripheralPrivate::clearServices()
 {
-	characteristic_to_service.clear();
-	value_to_characteristic.clear();
-	descriptor_to_characteristic.clear();
+	cancelDiscovery(0x0001, 0xFFFF);
+	attributes.clear();
 	services.clear();
+	known_handles.clear();
+	cache_loaded = false;
+}
+
+bool GatoPeripheralPrivate::cancelDiscovery(GatoHandle start, GatoHandle end)
+{
+	QMap<uint, GatoHandle>::iterator it = pending_characteristic_reqs.begin();
+	while (it != pending_characteristic_reqs.end()) {
+		if (it.value() >= start && it.value() <= end) {
+			att->cancelRequest(it.key());
+			it = pending_characteristic_reqs.erase(it);
+		} else {
+			++it;
+		}
+	}
+	it = pending_descriptor_reqs.begin();
+	while (it != pending_descriptor_reqs.end()) {
+		if (it.value() >= start && it.value() <= end) {
+			att->cancelRequest(it.key());
+			it = pending_descriptor_reqs.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	foreach (GatoHandle handle, characteristic_builders.keys()) {
+		if (handle >= start && handle <= end) characteristic_builders.remove(handle);
+	}
+	foreach (GatoHandle handle, descriptor_builders.keys()) {
+		if (handle >= start && handle <= end) descriptor_builders.remove(handle);
+	}
+
+	if (pending_discover_all == 0) return false;
+
+	// The sweeps cover every handle, so whatever the range the whole run is stale.
+	foreach (uint req, discover_all_reqs) {
+		att->cancelRequest(req);
+	}
+	discover_all_reqs.clear();
+	discover_all_chars.clear();
+	pending_discover_all = 0;
+	return true;
 }
 
 void GatoPeripheralPrivate::clearServiceCharacteristics(GatoService *service)
@@ -542,9 +841,11 @@ void GatoPeripheralPrivate::clearServiceCharacteristics(GatoService *service)
 	QList<GatoCharacteristic>::iterator it;
 	for (it = chars.begin(); it != chars.end(); ++it) {
 		clearCharacteristicDescriptors(&*it);
-		characteristic_to_service.remove(it->startHandle());
-		value_to_characteristic.remove(it->valueHandle());
+		clearAttributes(it->startHandle(), it->startHandle());
+		clearAttributes(it->valueHandle(), it->valueHandle());
 	}
+	known_handles.remove(service->startHandle());
+	characteristic_builders.remove(service->startHandle());
 	service->clearCharacteristics();
 }
 
@@ -552,8 +853,10 @@ void GatoPeripheralPrivate::clearCharacteristicDescriptors(GatoCharacteristic *c
 {
 	QList<GatoDescriptor> descs = characteristic->descriptors();
 	foreach (const GatoDescriptor& d, descs) {
-		descriptor_to_characteristic.remove(d.handle());
+		clearAttributes(d.handle(), d.handle());
 	}
+	known_handles.remove(characteristic->startHandle());
+	descriptor_builders.remove(characteristic->startHandle());
 	characteristic->clearDescriptors();
 }
 
@@ -577,10 +880,287 @@ void GatoPeripheralPrivate::finishSetNotifyOperations(const GatoCharacteristic &
 	}
 }
 
+void GatoPeripheralPrivate::loadCache()
+{
+	GatoAttributeCache::Table table;
+	if (!GatoAttributeCache::load(GatoAttributeCache::fileName(cache_dir, addr), &table)) {
+		return;
+	}
+
+	clearServices();
+	complete_services = table.complete_services;
+	known_handles = table.known_handles;
+	database_hash = table.database_hash;
+
+	// Size the table once, up to the last attribute actually loaded. The last
+	// service usually ends at 0xFFFF, far past anything stored in it.
+	GatoHandle last = 0;
+	foreach (const GatoService &service, table.services) {
+		last = qMax(last, service.startHandle());
+		foreach (const GatoCharacteristic &characteristic, service.characteristics()) {
+			last = qMax(last, qMax(characteristic.startHandle(), characteristic.valueHandle()));
+			foreach (const GatoDescriptor &descriptor, characteristic.descriptors()) {
+				last = qMax(last, descriptor.handle());
+			}
+		}
+	}
+	if (last > 0) {
+		attributes.resize(last + 1);
+	}
+
+	foreach (const GatoService &service, table.services) {
+		addService(service);
+		service_uuids.insert(service.uuid());
+		foreach (const GatoCharacteristic &characteristic, service.characteristics()) {
+			indexCharacteristic(service.startHandle(), characteristic);
+		}
+	}
+
+	cache_loaded = true;
+	cache_dirty = false;
+}
+
+void GatoPeripheralPrivate::saveCache()
+{
+	cache_dirty = false;
+	if (cache_dir.isEmpty()) return;
+
+	GatoAttributeCache::Table table;
+	table.services = services;
+	table.complete_services = complete_services;
+	table.known_handles = known_handles;
+	table.database_hash = database_hash;
+
+	GatoAttributeCache::save(GatoAttributeCache::fileName(cache_dir, addr), table);
+}
+
+bool GatoPeripheralPrivate::checkCacheError(GatoAttClient::Error error)
+{
+	Q_Q(GatoPeripheral);
+
+	if (!cache_loaded) return false;
+	if (error != GatoAttClient::ErrorInvalidHandle && error != GatoAttClient::ErrorAttributeNotFound) return false;
+
+	// The device no longer has the attributes we remembered; start over.
+	qWarning() << "Cached attributes for" << addr << "are stale, rediscovering";
+	GatoAttributeCache::remove(GatoAttributeCache::fileName(cache_dir, addr));
+	const bool discovering_all = pending_discover_all > 0;
+	complete_services = false;
+	clearServices();
+	database_hash.clear();
+	readDatabaseHash();
+	if (discovering_all) {
+		q->discoverAll();
+	} else {
+		q->discoverServices();
+	}
+
+	return true;
+}
+
+bool GatoPeripheralPrivate::isFullyDiscovered() const
+{
+	if (!complete_services) return false;
+
+	foreach (const GatoService &service, services) {
+		if (!known_handles.contains(service.startHandle())) return false;
+		foreach (const GatoCharacteristic &characteristic, service.characteristics()) {
+			if (!known_handles.contains(characteristic.startHandle())) return false;
+		}
+	}
+
+	return true;
+}
+
+void GatoPeripheralPrivate::finishDiscoverAllSweep()
+{
+	if (--pending_discover_all > 0) return;
+
+	// Both sweeps are done; sort characteristics into their services.
+	for (int i = 0; i < discover_all_chars.size(); i++) {
+		GatoCharacteristic &characteristic = discover_all_chars[i];
+		const GatoHandle char_handle = characteristic.startHandle();
+
+		QMap<GatoHandle, GatoService>::iterator it = services.upperBound(char_handle);
+		if (it == services.begin()) {
+			qDebug() << "Characteristic outside of any service:" << char_handle;
+			continue;
+		}
+		--it;
+		GatoService &service = *it;
+		if (char_handle > service.endHandle()) {
+			qDebug() << "Characteristic outside of any service:" << char_handle;
+			continue;
+		}
+
+		GatoHandle end = service.endHandle();
+		if (i + 1 < discover_all_chars.size()) {
+			end = qMin<GatoHandle>(end, discover_all_chars.at(i + 1).startHandle() - 1);
+		}
+		characteristic.setEndHandle(end);
+
+		storeCharacteristic(service.startHandle(), characteristic);
+
+		// Nothing after the value attribute means no descriptors to look for.
+		if (end <= characteristic.valueHandle()) {
+			known_handles.insert(char_handle);
+		}
+	}
+	discover_all_chars.clear();
+
+	// Then find descriptors one service at a time.
+	foreach (const GatoService &service, services) {
+		known_handles.insert(service.startHandle());
+
+		bool needs_descriptors = false;
+		foreach (const GatoCharacteristic &characteristic, service.characteristics()) {
+			if (!known_handles.contains(characteristic.startHandle())) {
+				needs_descriptors = true;
+				break;
+			}
+		}
+		if (!needs_descriptors) continue;
+
+		const GatoHandle service_start = service.startHandle();
+		discover_all_reqs.insert(att->requestFindInformation(service_start + 1, service.endHandle(),
+		                                                     [this, service_start](uint req, const GatoAttClient::InformationDataList &list) { handleDiscoverAllDescriptors(req, list, service_start); }));
+		pending_discover_all++;
+	}
+
+	if (pending_discover_all == 0) {
+		finishDiscoverAll();
+	}
+}
+
+void GatoPeripheralPrivate::finishDiscoverAll()
+{
+	Q_Q(GatoPeripheral);
+
+	cache_dirty = true;
+	subscribeServiceChanged();
+
+	emit q->discoveryFinished();
+}
+
+void GatoPeripheralPrivate::finishCharacteristicDiscovery(const GatoService &service)
+{
+	Q_Q(GatoPeripheral);
+
+	known_handles.insert(service.startHandle());
+	cache_dirty = true;
+
+	// Find the Service Changed descriptors even if the user is not interested in them.
+	const GatoUUID service_changed_uuid(GatoUUID::GattServiceChanged);
+	QList<GatoCharacteristic> characteristics = service.characteristics();
+	foreach (const GatoCharacteristic &characteristic, characteristics) {
+		if (characteristic.uuid() == service_changed_uuid && !known_handles.contains(characteristic.startHandle())) {
+			q->discoverDescriptors(characteristic);
+		}
+	}
+
+	emit q->characteristicsDiscovered(service);
+}
+
+void GatoPeripheralPrivate::finishDescriptorDiscovery(const GatoCharacteristic &characteristic)
+{
+	Q_Q(GatoPeripheral);
+
+	known_handles.insert(characteristic.startHandle());
+	cache_dirty = true;
+
+	finishSetNotifyOperations(characteristic);
+	if (characteristic.uuid() == GatoUUID(GatoUUID::GattServiceChanged)) {
+		subscribeServiceChanged();
+	}
+
+	emit q->descriptorsDiscovered(characteristic);
+}
+
+void GatoPeripheralPrivate::readDatabaseHash()
+{
+	att->requestReadByType(0x0001, 0xFFFF, GatoUUID::GattDatabaseHash,
+	                       [this](uint req, const GatoAttClient::AttributeDataList &list) { handleDatabaseHash(req, list); },
+	                       GatoAttClient::PriorityInteractive);
+}
+
+void GatoPeripheralPrivate::subscribeServiceChanged()
+{
+	Q_Q(GatoPeripheral);
+
+	const GatoUUID service_changed_uuid(GatoUUID::GattServiceChanged);
+	const GatoUUID cccd_uuid(GatoUUID::GattClientCharacteristicConfiguration);
+
+	foreach (const GatoService &service, services) {
+		foreach (const GatoCharacteristic &characteristic, service.characteristics()) {
+			if (characteristic.uuid() == service_changed_uuid && characteristic.containsDescriptor(cccd_uuid)) {
+				q->writeValue(characteristic.getDescriptor(cccd_uuid), genClientCharConfiguration(false, true),
+				              GatoPeripheral::PriorityInteractive);
+				return;
+			}
+		}
+	}
+}
+
+void GatoPeripheralPrivate::handleServiceChanged(GatoHandle start, GatoHandle end)
+{
+	Q_Q(GatoPeripheral);
+
+	if (start == 0) start = 1;
+	if (end < start) return;
+
+	// Widen the range to cover every service it overlaps whole.
+	foreach (const GatoService &service, services) {
+		if (service.startHandle() <= end && service.endHandle() >= start) {
+			start = qMin(start, service.startHandle());
+			end = qMax(end, service.endHandle());
+		}
+	}
+
+	// Responses still due for the range would land in services that are gone.
+	const bool discovering_all = cancelDiscovery(start, end);
+
+	QMap<GatoHandle, GatoService>::iterator it = services.begin();
+	while (it != services.end()) {
+		if (it->startHandle() <= end && it->endHandle() >= start) {
+			clearServiceCharacteristics(&*it);
+			clearAttributes(it->startHandle(), it->startHandle());
+			it = services.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	database_hash.clear();
+	cache_dirty = true;
+
+	if (q->state() == GatoPeripheral::StateConnected) {
+		if (discovering_all) {
+			// Start the interrupted discoverAll() over; it covers the range too.
+			complete_services = false;
+			q->discoverAll();
+		} else {
+			att->requestReadByGroupType(start, end, GatoUUID::GattPrimaryService,
+			                            [this, end](uint req, const GatoAttClient::AttributeGroupDataList &list) { handlePrimaryInRange(req, list, end); });
+		}
+	}
+}
+
 void GatoPeripheralPrivate::handleAttConnected()
 {
 	Q_Q(GatoPeripheral);
 
+	if (cache_loaded && !database_hash.isEmpty()) {
+		// Hold connected() back until we know whether the cached attributes can be used.
+		validating_cache = true;
+		readDatabaseHash();
+		return;
+	}
+
+	if (!cache_dir.isEmpty()) {
+		readDatabaseHash();
+	}
+	subscribeServiceChanged();
+
 	emit q->connected();
 }
 
@@ -592,8 +1172,19 @@ void GatoPeripheralPrivate::handleAttDisconnected()
 	pending_primary_reqs.clear();
 	pending_characteristic_reqs.clear();
 	pending_characteristic_read_reqs.clear();
+	pending_characteristic_stream_reqs.clear();
+	pending_characteristic_multi_read_reqs.clear();
 	pending_descriptor_reqs.clear();
 	pending_descriptor_read_reqs.clear();
+	characteristic_builders.clear();
+	descriptor_builders.clear();
+	discover_all_reqs.clear();
+	discover_all_chars.clear();
+	pending_discover_all = 0;
+
+	if (cache_dirty) {
+		saveCache();
+	}
 
 	emit q->disconnected();
 }
@@ -604,42 +1195,45 @@ void GatoPeripheralPrivate::handleAttAttributeUpdated(GatoHandle handle, const Q
 	Q_UNUSED(confirmed);
 
 	// Let's see if this is a handle we know about.
-	if (value_to_characteristic.contains(handle)) {
+	const AttributeEntry &entry = attribute(handle);
+	if (entry.type == AttributeValue) {
 		// Ok, it's a characteristic value.
-		GatoHandle char_handle = value_to_characteristic.value(handle);
-		GatoHandle service_handle = characteristic_to_service.value(char_handle);
-		if (!service_handle) {
-			qWarning() << "Got a notification for a characteristic I don't know about";
-			return;
-		}
+		const GatoCharacteristic characteristic = entry.object;
 
-		GatoService &service = services[service_handle];
-		GatoCharacteristic characteristic = service.getCharacteristic(char_handle);
+		if (characteristic.uuid() == GatoUUID(GatoUUID::GattServiceChanged) && value.size() >= 4) {
+			handleServiceChanged(read_le<quint16>(&value.constData()[0]), read_le<quint16>(&value.constData()[2]));
+		}
 
 		emit q->valueUpdated(characteristic, value);
 	}
 }
 
-void GatoPeripheralPrivate::handlePrimary(uint req, const QList<GatoAttClient::AttributeGroupData> &list)
+void GatoPeripheralPrivate::handlePrimary(uint req, const GatoAttClient::AttributeGroupDataList &list)
 {
 	Q_Q(GatoPeripheral);
 	Q_UNUSED(req);
 
+	if (att->requestAborted()) {
+		// Disconnecting; handleAttDisconnected() will forget about this request.
+		return;
+	}
+
 	if (list.isEmpty()) {
 		complete_services = true;
+		cache_dirty = true;
 		emit q->servicesDiscovered();
 	} else {
 		GatoHandle last_handle = 0;
 
-		foreach (const GatoAttClient::AttributeGroupData &data, list) {
-			GatoUUID uuid = bytearray_to_gatouuid(data.value);
+		foreach (const GatoAttClient::AttributeGroupRef &data, list) {
+			GatoUUID uuid = data.value.toUuid();
 			GatoService service;
 
 			service.setUuid(uuid);
 			service.setStartHandle(data.start);
 			service.setEndHandle(data.end);
 
-			services.insert(data.start, service);
+			addService(service);
 			service_uuids.insert(uuid);
 
 			last_handle = data.end;
@@ -647,14 +1241,61 @@ void GatoPeripheralPrivate::handlePrimary(uint req, const QList<GatoAttClient::A
 
 		// Fetch following attributes
 		att->requestReadByGroupType(last_handle + 1, 0xFFFF, GatoUUID::GattPrimaryService,
-		                            this, SLOT(handlePrimary(uint,QList<GatoAttClient::AttributeGroupData>)));
+		                            [this](uint req, const GatoAttClient::AttributeGroupDataList &list) { handlePrimary(req, list); });
 	}
 }
 
-void GatoPeripheralPrivate::handlePrimaryForService(uint req, const QList<GatoAttClient::HandleInformation> &list)
+void GatoPeripheralPrivate::handlePrimaryInRange(uint req, const GatoAttClient::AttributeGroupDataList &list, GatoHandle end)
+{
+	Q_Q(GatoPeripheral);
+	Q_UNUSED(req);
+
+	if (att->requestAborted()) {
+		// Disconnecting; the range will be rediscovered on the next full discovery.
+		complete_services = false;
+		return;
+	}
+
+	GatoHandle last_handle = end;
+
+	foreach (const GatoAttClient::AttributeGroupRef &data, list) {
+		GatoUUID uuid = data.value.toUuid();
+		GatoService service;
+
+		service.setUuid(uuid);
+		service.setStartHandle(data.start);
+		service.setEndHandle(data.end);
+
+		addService(service);
+		service_uuids.insert(uuid);
+
+		last_handle = data.end;
+	}
+
+	if (!list.isEmpty() && last_handle < end) {
+		// Fetch following attributes
+		att->requestReadByGroupType(last_handle + 1, end, GatoUUID::GattPrimaryService,
+		                            [this, end](uint req, const GatoAttClient::AttributeGroupDataList &list) { handlePrimaryInRange(req, list, end); });
+		return;
+	}
+
+	cache_dirty = true;
+	if (!cache_dir.isEmpty()) {
+		readDatabaseHash();
+	}
+
+	emit q->servicesDiscovered();
+}
+
+void GatoPeripheralPrivate::handlePrimaryForService(uint req, const GatoAttClient::HandleInformationList &list)
 {
 	Q_Q(GatoPeripheral);
 
+	if (att->requestAborted()) {
+		// Disconnecting; handleAttDisconnected() will forget about this request.
+		return;
+	}
+
 	GatoUUID uuid = pending_primary_reqs.value(req, GatoUUID());
 	if (uuid.isNull()) {
 		qDebug() << "Got primary for service response for a request I did not make";
@@ -676,23 +1317,28 @@ void GatoPeripheralPrivate::handlePrimaryForService(uint req, const QList<GatoAt
 			service.setStartHandle(data.start);
 			service.setEndHandle(data.end);
 
-			services.insert(data.start, service);
+			addService(service);
 			service_uuids.insert(uuid);
 
 			last_handle = data.end;
 		}
 
+		cache_dirty = true;
+
 		// Fetch following attributes
 		QByteArray value = gatouuid_to_bytearray(uuid, true, false);
 		uint req = att->requestFindByTypeValue(last_handle + 1, 0xFFFF, GatoUUID::GattPrimaryService, value,
-		                                       this, SLOT(handlePrimaryForService(uint,QList<GatoAttClient::HandleInformation>)));
+		                                       [this](uint req, const GatoAttClient::HandleInformationList &list) { handlePrimaryForService(req, list); });
 		pending_primary_reqs.insert(req, uuid);
 	}
 }
 
-void GatoPeripheralPrivate::handleCharacteristic(uint req, const QList<GatoAttClient::AttributeData> &list)
+void GatoPeripheralPrivate::handleCharacteristic(uint req, const GatoAttClient::AttributeDataList &list)
 {
-	Q_Q(GatoPeripheral);
+	if (att->requestAborted()) {
+		// Disconnecting; handleAttDisconnected() will forget about this request.
+		return;
+	}
 
 	GatoHandle service_start = pending_characteristic_reqs.value(req, 0);
 	if (!service_start) {
@@ -701,59 +1347,63 @@ void GatoPeripheralPrivate::handleCharacteristic(uint req, const QList<GatoAttCl
 	}
 	pending_characteristic_reqs.remove(req);
 
-	Q_ASSERT(services.contains(service_start));
-	GatoService &service = services[service_start];
-	Q_ASSERT(service.startHandle() == service_start);
+	if (!services.contains(service_start)) {
+		qDebug() << "Got characteristics for a service that is gone";
+		characteristic_builders.remove(service_start);
+		return;
+	}
+	const GatoHandle service_end = services.value(service_start).endHandle();
+	QList<GatoCharacteristic> &chars = characteristic_builders[service_start];
 
-	if (list.isEmpty()) {
-		emit q->characteristicsDiscovered(service);
-	} else {
+	if (!list.isEmpty()) {
 		GatoHandle last_handle = 0;
 
 		// If we are continuing a characteristic list, this means the
-		// last service we discovered in the previous iteration was not
+		// last characteristic we discovered in the previous iteration was not
 		// the last one, so we have to reduce its endHandle!
-		QList<GatoCharacteristic> cur_chars = service.characteristics();
-		if (!cur_chars.isEmpty()) {
-			GatoCharacteristic &last = cur_chars.back();
-			last.setEndHandle(list.front().handle - 1);
-			service.addCharacteristic(last);
+		if (!chars.isEmpty()) {
+			chars.last().setEndHandle(list.front().handle - 1);
 		}
 
 		for (int i = 0; i < list.size(); i++) {
-			const GatoAttClient::AttributeData &data = list.at(i);
+			const GatoAttClient::AttributeRef data = list.at(i);
 			GatoCharacteristic characteristic = parseCharacteristicValue(data.value);
 
 			characteristic.setStartHandle(data.handle);
 			if (i + 1 < list.size()) {
 				characteristic.setEndHandle(list.at(i + 1).handle - 1);
 			} else {
-				characteristic.setEndHandle(service.endHandle());
+				characteristic.setEndHandle(service_end);
 			}
 
-			service.addCharacteristic(characteristic);
-			characteristic_to_service.insert(data.handle, service_start);
-			value_to_characteristic.insert(characteristic.valueHandle(), data.handle);
+			chars.append(characteristic);
 
 			last_handle = data.handle;
 		}
 
-		if (last_handle >= service.endHandle()) {
-			// Already finished, no need to send another request
-			emit q->characteristicsDiscovered(service);
+		if (last_handle < service_end) {
+			// Fetch following attributes
+			uint req = att->requestReadByType(last_handle + 1, service_end, GatoUUID::GattCharacteristic,
+			                                  [this](uint req, const GatoAttClient::AttributeDataList &list) { handleCharacteristic(req, list); });
+			pending_characteristic_reqs.insert(req, service_start);
 			return;
 		}
+	}
 
-		// Fetch following attributes
-		uint req = att->requestReadByType(last_handle + 1, service.endHandle(), GatoUUID::GattCharacteristic,
-		                                  this, SLOT(handleCharacteristic(uint,QList<GatoAttClient::AttributeData>)));
-		pending_characteristic_reqs.insert(req, service.startHandle());
+	// Publish the whole list at once.
+	foreach (const GatoCharacteristic &characteristic, characteristic_builders.take(service_start)) {
+		storeCharacteristic(service_start, characteristic);
 	}
+
+	finishCharacteristicDiscovery(services.value(service_start));
 }
 
-void GatoPeripheralPrivate::handleDescriptors(uint req, const QList<GatoAttClient::InformationData> &list)
+void GatoPeripheralPrivate::handleDescriptors(uint req, const GatoAttClient::InformationDataList &list)
 {
-	Q_Q(GatoPeripheral);
+	if (att->requestAborted()) {
+		// Disconnecting; handleAttDisconnected() will forget about this request.
+		return;
+	}
 
 	GatoHandle char_handle = pending_descriptor_reqs.value(req);
 	if (!char_handle) {
@@ -761,26 +1411,19 @@ void GatoPeripheralPrivate::handleDescriptors(uint req, const QList<GatoAttClien
 		return;
 	}
 	pending_descriptor_reqs.remove(req);
-	GatoHandle service_handle = characteristic_to_service.value(char_handle);
-	if (!service_handle) {
+	GatoCharacteristic characteristic = characteristicAt(char_handle);
+	if (characteristic.isNull()) {
 		qWarning() << "Unknown characteristic during descriptor discovery: " << char_handle;
 		return;
 	}
 
-	Q_ASSERT(services.contains(service_handle));
-	GatoService &service = services[service_handle];
-	Q_ASSERT(service.startHandle() == service_handle);
-
-	Q_ASSERT(service.containsCharacteristic(char_handle));
-	GatoCharacteristic characteristic = service.getCharacteristic(char_handle);
-
-	if (list.isEmpty()) {
-		finishSetNotifyOperations(characteristic);
-		emit q->descriptorsDiscovered(characteristic);
-	} else {
+	if (!list.isEmpty()) {
+		QList<GatoDescriptor> &descs = descriptor_builders[char_handle];
 		GatoHandle last_handle = 0;
 
 		foreach (const GatoAttClient::InformationData &data, list) {
+			last_handle = data.handle;
+
 			// Skip the value attribute itself.
 			if (data.handle == characteristic.valueHandle()) continue;
 
@@ -789,28 +1432,197 @@ void GatoPeripheralPrivate::handleDescriptors(uint req, const QList<GatoAttClien
 			descriptor.setHandle(data.handle);
 			descriptor.setUuid(data.uuid);
 
-			characteristic.addDescriptor(descriptor);
+			descs.append(descriptor);
+		}
 
-			service.addCharacteristic(characteristic);
-			descriptor_to_characteristic.insert(data.handle, char_handle);
+		if (last_handle < characteristic.endHandle()) {
+			// Fetch following attributes
+			uint req = att->requestFindInformation(last_handle + 1, characteristic.endHandle(),
+			                                       [this](uint req, const GatoAttClient::InformationDataList &list) { handleDescriptors(req, list); });
+			pending_descriptor_reqs.insert(req, char_handle);
+			return;
+		}
+	}
 
-			last_handle = data.handle;
+	// Publish the whole list at once.
+	foreach (const GatoDescriptor &descriptor, descriptor_builders.take(char_handle)) {
+		characteristic.addDescriptor(descriptor);
+	}
+	storeCharacteristic(attribute(char_handle).service, characteristic);
+
+	finishDescriptorDiscovery(characteristic);
+}
+
+void GatoPeripheralPrivate::handleDiscoverAllPrimary(uint req, const GatoAttClient::AttributeGroupDataList &list)
+{
+	if (att->requestAborted()) {
+		pending_discover_all = 0;
+		discover_all_reqs.clear();
+		return;
+	}
+	if (!discover_all_reqs.remove(req)) {
+		qDebug() << "Got services for a request I did not make";
+		return;
+	}
+
+	GatoHandle last_handle = 0xFFFF;
+
+	foreach (const GatoAttClient::AttributeGroupRef &data, list) {
+		GatoUUID uuid = data.value.toUuid();
+		GatoService service;
+
+		service.setUuid(uuid);
+		service.setStartHandle(data.start);
+		service.setEndHandle(data.end);
+
+		addService(service);
+		service_uuids.insert(uuid);
+
+		last_handle = data.end;
+	}
+
+	if (last_handle < 0xFFFF) {
+		// Fetch following attributes
+		discover_all_reqs.insert(att->requestReadByGroupType(last_handle + 1, 0xFFFF, GatoUUID::GattPrimaryService,
+		                                                     [this](uint req, const GatoAttClient::AttributeGroupDataList &list) { handleDiscoverAllPrimary(req, list); }));
+		return;
+	}
+
+	complete_services = true;
+	finishDiscoverAllSweep();
+}
+
+void GatoPeripheralPrivate::handleDiscoverAllCharacteristics(uint req, const GatoAttClient::AttributeDataList &list)
+{
+	if (att->requestAborted()) {
+		pending_discover_all = 0;
+		discover_all_reqs.clear();
+		discover_all_chars.clear();
+		return;
+	}
+	if (!discover_all_reqs.remove(req)) {
+		qDebug() << "Got characteristics for a request I did not make";
+		return;
+	}
+
+	GatoHandle last_handle = 0xFFFF;
+
+	for (int i = 0; i < list.size(); i++) {
+		const GatoAttClient::AttributeRef data = list.at(i);
+		GatoCharacteristic characteristic = parseCharacteristicValue(data.value);
+
+		characteristic.setStartHandle(data.handle);
+		discover_all_chars.append(characteristic);
+
+		last_handle = data.handle;
+	}
+
+	if (last_handle < 0xFFFF) {
+		// Fetch following attributes
+		discover_all_reqs.insert(att->requestReadByType(last_handle + 1, 0xFFFF, GatoUUID::GattCharacteristic,
+		                                                [this](uint req, const GatoAttClient::AttributeDataList &list) { handleDiscoverAllCharacteristics(req, list); }));
+		return;
+	}
+
+	finishDiscoverAllSweep();
+}
+
+void GatoPeripheralPrivate::handleDiscoverAllDescriptors(uint req, const GatoAttClient::InformationDataList &list, GatoHandle service_start)
+{
+	if (att->requestAborted()) {
+		pending_discover_all = 0;
+		discover_all_reqs.clear();
+		return;
+	}
+	if (!discover_all_reqs.remove(req)) {
+		qDebug() << "Got descriptors for a request I did not make";
+		return;
+	}
+	if (!services.contains(service_start)) {
+		qDebug() << "Got descriptors for a service that is gone";
+		return;
+	}
+	const GatoHandle service_end = services.value(service_start).endHandle();
+	GatoHandle last_handle = service_end;
+
+	foreach (const GatoAttClient::InformationData &data, list) {
+		last_handle = data.handle;
+
+		const GatoHandle char_handle = characteristicOwning(data.handle);
+		if (!char_handle) continue;
+		// Skip the declaration and value attributes themselves.
+		if (data.handle <= attribute(char_handle).object.valueHandle()) continue;
+
+		GatoDescriptor descriptor;
+		descriptor.setHandle(data.handle);
+		descriptor.setUuid(data.uuid);
+
+		descriptor_builders[char_handle].append(descriptor);
+	}
+
+	if (!list.isEmpty() && last_handle < service_end) {
+		// Fetch following attributes
+		discover_all_reqs.insert(att->requestFindInformation(last_handle + 1, service_end,
+		                                                     [this, service_start](uint req, const GatoAttClient::InformationDataList &list) { handleDiscoverAllDescriptors(req, list, service_start); }));
+		return;
+	}
+
+	// Publish the descriptors of every characteristic in the service at once.
+	foreach (GatoCharacteristic characteristic, services.value(service_start).characteristics()) {
+		const QList<GatoDescriptor> descs = descriptor_builders.take(characteristic.startHandle());
+		if (!descs.isEmpty()) {
+			foreach (const GatoDescriptor &descriptor, descs) {
+				characteristic.addDescriptor(descriptor);
+			}
+			storeCharacteristic(service_start, characteristic);
 		}
+		known_handles.insert(characteristic.startHandle());
+	}
 
-		service.addCharacteristic(characteristic);
+	if (--pending_discover_all == 0) {
+		finishDiscoverAll();
+	}
+}
 
-		if (last_handle >= characteristic.endHandle()) {
-			// Already finished, no need to send another request
-			finishSetNotifyOperations(characteristic);
-			emit q->descriptorsDiscovered(characteristic);
-			return;
+void GatoPeripheralPrivate::handleDatabaseHash(uint req, const GatoAttClient::AttributeDataList &list)
+{
+	Q_Q(GatoPeripheral);
+	Q_UNUSED(req);
+
+	if (att->requestAborted()) {
+		if (validating_cache) {
+			// There is no telling whether the cached attributes are current, so do not
+			// use them; the file is kept for the next connection to validate again.
+			validating_cache = false;
+			complete_services = false;
+			clearServices();
+			// The link is going down, and disconnected() follows.
+			emit q->connected();
 		}
+		return;
+	}
 
-		// Fetch following attributes
-		uint req = att->requestFindInformation(last_handle + 1, characteristic.endHandle(),
-		                                       this, SLOT(handleDescriptors(uint,QList<GatoAttClient::InformationData>)));
-		pending_descriptor_reqs.insert(req, char_handle);
+	// Devices without a Database Hash answer with Attribute Not Found.
+	QByteArray hash;
+	if (!list.isEmpty()) {
+		hash = list.front().value.toByteArray();
+	}
 
+	if (validating_cache) {
+		validating_cache = false;
+		if (hash != database_hash) {
+			qDebug() << "Database hash of" << addr << "changed, discarding cached attributes";
+			GatoAttributeCache::remove(GatoAttributeCache::fileName(cache_dir, addr));
+			complete_services = false;
+			clearServices();
+			cache_dirty = true;
+		}
+		database_hash = hash;
+		subscribeServiceChanged();
+		emit q->connected();
+	} else if (hash != database_hash) {
+		database_hash = hash;
+		cache_dirty = true;
 	}
 }
 
@@ -818,55 +1630,121 @@ void GatoPeripheralPrivate::handleCharacteristicRead(uint req, const QByteArray
 {
 	Q_Q(GatoPeripheral);
 
+	if (att->requestAborted()) {
+		// Disconnecting; handleAttDisconnected() will forget about this request.
+		return;
+	}
+
 	GatoHandle char_handle = pending_characteristic_read_reqs.value(req);
 	if (!char_handle) {
 		qDebug() << "Got characteristics for a request I did not make";
 		return;
 	}
 	pending_characteristic_read_reqs.remove(req);
-	GatoHandle service_handle = characteristic_to_service.value(char_handle);
-	if (!service_handle) {
+	if (checkCacheError(att->lastError())) {
+		return;
+	}
+	GatoCharacteristic characteristic = characteristicAt(char_handle);
+	if (characteristic.isNull()) {
 		qWarning() << "Unknown characteristic during read: " << char_handle;
 		return;
 	}
 
-	Q_ASSERT(services.contains(service_handle));
-	GatoService &service = services[service_handle];
-	Q_ASSERT(service.startHandle() == service_handle);
+	emit q->valueUpdated(characteristic, value);
+}
 
-	Q_ASSERT(service.containsCharacteristic(char_handle));
-	GatoCharacteristic characteristic = service.getCharacteristic(char_handle);
+void GatoPeripheralPrivate::handleCharacteristicMultipleRead(uint req, const GatoAttClient::LengthValueList &values,
+                                                             GatoPeripheral::RequestPriority priority)
+{
+	Q_Q(GatoPeripheral);
 
-	emit q->valueUpdated(characteristic, value);
+	if (att->requestAborted()) {
+		// Disconnecting; handleAttDisconnected() will forget about this request.
+		return;
+	}
+
+	QList<GatoHandle> char_handles = pending_characteristic_multi_read_reqs.take(req);
+	if (char_handles.isEmpty()) {
+		qDebug() << "Got characteristics for a request I did not make";
+		return;
+	}
+
+	const GatoAttClient::Error error = att->lastError();
+	if (error == GatoAttClient::ErrorRequestNotSupported) {
+		read_multiple_variable = false;
+	} else if (error != GatoAttClient::ErrorNone) {
+		// The error only names the first offending handle;
+		// retry one by one so that the rest still get read.
+		qDebug() << "Read multiple failed with error" << error;
+	}
+
+	for (int i = 0; i < char_handles.size(); i++) {
+		GatoHandle char_handle = char_handles.at(i);
+		GatoCharacteristic characteristic = characteristicAt(char_handle);
+		if (characteristic.isNull()) {
+			qWarning() << "Unknown characteristic during read: " << char_handle;
+			continue;
+		}
+
+		if (i < values.size() && !values.at(i).isTruncated()) {
+			emit q->valueUpdated(characteristic, values.at(i).value.toByteArray());
+		} else {
+			// Did not fit in the response (or the request failed)
+			q->readValue(characteristic, priority);
+		}
+	}
+}
+
+void GatoPeripheralPrivate::handleCharacteristicChunk(uint req, int offset, const GatoAttClient::ValueRef &chunk, bool last)
+{
+	Q_Q(GatoPeripheral);
+
+	if (att->requestAborted()) {
+		// Disconnecting; handleAttDisconnected() will forget about this request.
+		return;
+	}
+
+	GatoHandle char_handle = pending_characteristic_stream_reqs.value(req);
+	if (!char_handle) {
+		qDebug() << "Got characteristic data for a request I did not make";
+		return;
+	}
+	if (last) {
+		pending_characteristic_stream_reqs.remove(req);
+	}
+	GatoCharacteristic characteristic = characteristicAt(char_handle);
+	if (characteristic.isNull()) {
+		qWarning() << "Unknown characteristic during read: " << char_handle;
+		return;
+	}
+
+	emit q->valueChunkReceived(characteristic, offset, chunk.toByteArray(), last);
 }
 
 void GatoPeripheralPrivate::handleDescriptorRead(uint req, const QByteArray &value)
 {
 	Q_Q(GatoPeripheral);
 
+	if (att->requestAborted()) {
+		// Disconnecting; handleAttDisconnected() will forget about this request.
+		return;
+	}
+
 	GatoHandle desc_handle = pending_descriptor_read_reqs.value(req);
 	if (!desc_handle) {
 		qDebug() << "Got characteristics for a request I did not make";
 		return;
 	}
 	pending_descriptor_read_reqs.remove(req);
-	GatoHandle char_handle = descriptor_to_characteristic.value(desc_handle);
-	if (!char_handle) {
-		qWarning() << "Unknown characteristic during read: " << char_handle;
+	if (checkCacheError(att->lastError())) {
 		return;
 	}
-	GatoHandle service_handle = characteristic_to_service.value(char_handle);
-	if (!service_handle) {
-		qWarning() << "Unknown characteristic during read: " << char_handle;
+	const AttributeEntry &entry = attribute(desc_handle);
+	if (entry.type != AttributeDescriptor) {
+		qWarning() << "Unknown descriptor during read: " << desc_handle;
 		return;
 	}
-
-	Q_ASSERT(services.contains(service_handle));
-	GatoService &service = services[service_handle];
-	Q_ASSERT(service.startHandle() == service_handle);
-
-	Q_ASSERT(service.containsCharacteristic(char_handle));
-	GatoCharacteristic characteristic = service.getCharacteristic(char_handle);
+	GatoCharacteristic characteristic = characteristicAt(entry.characteristic);
 
 	Q_ASSERT(characteristic.containsDescriptor(desc_handle));
 	GatoDescriptor descriptor = characteristic.getDescriptor(desc_handle);
@@ -877,7 +1755,7 @@ void GatoPeripheralPrivate::handleDescriptorRead(uint req, const QByteArray &val
 void GatoPeripheralPrivate::handleCharacteristicWrite(uint req, bool ok)
 {
 	Q_UNUSED(req);
-	if (!ok) {
+	if (!ok && !checkCacheError(att->lastError())) {
 		qWarning() << "Failed to write some characteristic";
 	}
 }
@@ -885,7 +1763,7 @@ void GatoPeripheralPrivate::handleCharacteristicWrite(uint req, bool ok)
 void GatoPeripheralPrivate::handleDescriptorWrite(uint req, bool ok)
 {
 	Q_UNUSED(req);
-	if (!ok) {
+	if (!ok && !checkCacheError(att->lastError())) {
 		qWarning() << "Failed to write some characteristic";
 	}
 }
@@ -10,6 +10,7 @@ class GatoService;
 class GatoCharacteristic;
 class GatoDescriptor;
 class GatoPeripheralPrivate;
+class GatoTransport;
 
 class LIBGATO_EXPORT GatoPeripheral : public QObject
 {
@@ -17,12 +18,16 @@ class LIBGATO_EXPORT GatoPeripheral : public QObject
 	Q_DECLARE_PRIVATE(GatoPeripheral)
 	Q_ENUMS(State)
 	Q_ENUMS(WriteType)
+	Q_ENUMS(RequestPriority)
 	Q_FLAGS(PeripheralConnectOptions)
 	Q_PROPERTY(GatoAddress address READ address)
 	Q_PROPERTY(QString name READ name NOTIFY nameChanged)
 
 public:
 	GatoPeripheral(const GatoAddress& addr, QObject *parent = 0);
+	/** Uses the given transport (and takes ownership of it) instead of a
+	 *  bluetooth socket; mainly useful to test or benchmark against a fake device. */
+	GatoPeripheral(GatoTransport *transport, const GatoAddress& addr, QObject *parent = 0);
 	~GatoPeripheral();
 
 	enum PeripheralConnectOption {
@@ -38,7 +43,16 @@ public:
 
 	enum WriteType {
 		WriteWithResponse = 0,
-		WriteWithoutResponse
+		WriteWithoutResponse,
+		/** Each fragment is verified and all of them are committed atomically. */
+		WriteReliable
+	};
+
+	/** Interactive requests skip ahead of queued normal and background ones. */
+	enum RequestPriority {
+		PriorityInteractive = 0,
+		PriorityNormal,
+		PriorityBackground
 	};
 
 	State state() const;
@@ -47,9 +61,27 @@ public:
 	QList<GatoService> services() const;
 	QByteArray advertData() const;
 
-	void parseEIR(quint8 data[], int len);
+	/** advertType is the report's event type; scan responses (0x04) are kept
+	 *  apart from the advertisement they answer. */
+	void parseEIR(quint8 data[], int len, quint8 advertType = 0);
 	bool advertisesService(const GatoUUID &uuid) const;
 
+	/** Whether a value write replaces a not yet sent one to the same attribute. */
+	bool writeCoalescing() const;
+	void setWriteCoalescing(bool enabled);
+
+	/** WriteWithoutResponse values are dropped while more than this many bytes
+	 *  are waiting to be sent; see canWriteWithoutResponse(). */
+	int writeHighWaterMark() const;
+	void setWriteHighWaterMark(int bytes);
+	bool canWriteWithoutResponse() const;
+
+	/** Discovered attributes are kept in this directory and restored by
+	 *  connectPeripheral(), so that discovery requests can be answered without
+	 *  asking the device again. Empty (the default) disables caching. */
+	QString cacheDirectory() const;
+	void setCacheDirectory(const QString &path);
+
 public slots:
 	void connectPeripheral(PeripheralConnectOptions options = 0);
 	void disconnectPeripheral();
@@ -59,11 +91,16 @@ public slots:
 	void discoverCharacteristics(const GatoService &service);
 	void discoverCharacteristics(const GatoService &service, const QList<GatoUUID>& characteristicUUIDs);
 	void discoverDescriptors(const GatoCharacteristic &characteristic);
-
-	void readValue(const GatoCharacteristic &characteristic);
-	void readValue(const GatoDescriptor &descriptor);
-	void writeValue(const GatoCharacteristic &characteristic, const QByteArray &data, WriteType type = WriteWithResponse);
-	void writeValue(const GatoDescriptor &descriptor, const QByteArray &data);
+	/** Discovers every service, characteristic and descriptor with as few
+	 *  round trips as possible; only discoveryFinished() is emitted. */
+	void discoverAll();
+
+	void readValue(const GatoCharacteristic &characteristic, RequestPriority priority = PriorityNormal);
+	void readValue(const GatoDescriptor &descriptor, RequestPriority priority = PriorityNormal);
+	void readValues(const QList<GatoCharacteristic> &characteristics, RequestPriority priority = PriorityNormal);
+	void streamValue(const GatoCharacteristic &characteristic, int maxLength = -1, RequestPriority priority = PriorityNormal);
+	void writeValue(const GatoCharacteristic &characteristic, const QByteArray &data, WriteType type = WriteWithResponse, RequestPriority priority = PriorityNormal);
+	void writeValue(const GatoDescriptor &descriptor, const QByteArray &data, RequestPriority priority = PriorityNormal);
 	void setNotification(const GatoCharacteristic &characteristic, bool enabled);
 
 signals:
@@ -74,10 +111,15 @@ signals:
 	void servicesDiscovered();
 	void characteristicsDiscovered(const GatoService &service);
 	void descriptorsDiscovered(const GatoCharacteristic &characteristic);
+	void discoveryFinished();
 
 	void valueUpdated(const GatoCharacteristic &characteristic, const QByteArray &value);
+	void valueChunkReceived(const GatoCharacteristic &characteristic, int offset, const QByteArray &chunk, bool last);
 	void descriptorValueUpdated(const GatoDescriptor &descriptor, const QByteArray &value);
 
+	/** Emitted once all queued WriteWithoutResponse values have been sent. */
+	void readyToWriteWithoutResponse();
+
 private:
 	GatoPeripheralPrivate *const d_ptr;
 };
@@ -1,6 +1,8 @@
 #ifndef GATOPERIPHERAL_P_H
 #define GATOPERIPHERAL_P_H
 
+#include <QtCore/QVector>
+
 #include "gatoperipheral.h"
 #include "gatoservice.h"
 #include "gatocharacteristic.h"
@@ -22,48 +24,146 @@ public:
 	QString name;
 	QSet<GatoUUID> service_uuids;
 	QMap<GatoHandle, GatoService> services;
+	/** Last payloads seen, kept apart since a device alternates between both. */
 	QByteArray advert_data;
+	QByteArray scan_rsp_data;
+	/** The name as advertised, to skip unchanged ones without decoding them. */
+	QByteArray name_data;
 
 	bool complete_name : 1;
 	bool complete_services : 1;
-
-	/** Maps attribute handles to service handles. */
-	QMap<GatoHandle, GatoHandle> characteristic_to_service;
-	QMap<GatoHandle, GatoHandle> value_to_characteristic;
-	QMap<GatoHandle, GatoHandle> descriptor_to_characteristic;
+	/** Cleared once the server rejects Read Multiple Variable requests. */
+	bool read_multiple_variable : 1;
+	/** The attribute table came from the cache and the device has not contradicted it yet. */
+	bool cache_loaded : 1;
+	/** Discovery results not written to the cache yet. */
+	bool cache_dirty : 1;
+	/** connected() is held back until the Database Hash has been compared with the cached one. */
+	bool validating_cache : 1;
+
+	/** Directory to keep the attribute cache in; empty disables caching. */
+	QString cache_dir;
+	/** Services and characteristics whose characteristics, resp. descriptors, are known. */
+	QSet<GatoHandle> known_handles;
+	/** Database Hash the attribute table corresponds to; empty if unknown. */
+	QByteArray database_hash;
+
+	/** Sweeps of the current discoverAll() still running; 0 if none is. */
+	int pending_discover_all;
+	/** Characteristics found by discoverAll(), until the services are known too. */
+	QList<GatoCharacteristic> discover_all_chars;
+	/** Requests of the current discoverAll() on the wire or queued, so it can be stopped. */
+	QSet<uint> discover_all_reqs;
+
+	enum AttributeType {
+		AttributeNone = 0,
+		AttributeService,
+		AttributeCharacteristic,
+		AttributeValue,
+		AttributeDescriptor
+	};
+
+	/** What the attribute at some handle is and where it belongs. */
+	struct AttributeEntry
+	{
+		AttributeEntry() : type(AttributeNone), service(0), characteristic(0) { }
+
+		AttributeType type;
+		/** Start handle of the service it belongs to. */
+		GatoHandle service;
+		/** Declaration handle of the characteristic it belongs to, if any. */
+		GatoHandle characteristic;
+		/** Copy of that characteristic, for declaration and value entries. */
+		GatoCharacteristic object;
+	};
+
+	/** Indexed directly by handle, up to the highest handle known. */
+	QVector<AttributeEntry> attributes;
+
+	/** Characteristics (by service) and descriptors (by characteristic) found by
+	 *  discovery still in progress; they are moved into the tree in one go once
+	 *  their parent is done, instead of detaching it on every response. */
+	QHash<GatoHandle, QList<GatoCharacteristic> > characteristic_builders;
+	QHash<GatoHandle, QList<GatoDescriptor> > descriptor_builders;
 
 	GatoAttClient *att;
 	QMap<uint, GatoUUID> pending_primary_reqs;
 	QMap<uint, GatoHandle> pending_characteristic_reqs;
 	QMap<uint, GatoHandle> pending_characteristic_read_reqs;
+	QMap<uint, GatoHandle> pending_characteristic_stream_reqs;
+	QMap<uint, QList<GatoHandle> > pending_characteristic_multi_read_reqs;
 	QMap<uint, GatoHandle> pending_descriptor_reqs;
 	QMap<uint, GatoHandle> pending_descriptor_read_reqs;
 
 	QMap<GatoHandle, bool> pending_set_notify;
 
-	void parseEIRFlags(quint8 data[], int len);
-	void parseEIRUUIDs(int size, bool complete, quint8 data[], int len);
-	void parseName(bool complete, quint8 data[], int len);
+	void parseEIRFlags(const quint8 data[], int len);
+	void parseEIRUUIDs(int size, bool complete, const quint8 data[], int len);
+	void parseName(bool complete, const quint8 data[], int len);
 
-	static GatoCharacteristic parseCharacteristicValue(const QByteArray &ba);
+	static GatoCharacteristic parseCharacteristicValue(const GatoAttClient::ValueRef &value);
 
 	static QByteArray genClientCharConfiguration(bool notification, bool indication);
 
+	const AttributeEntry &attribute(GatoHandle handle) const;
+	bool knowsCharacteristic(GatoHandle char_handle) const;
+	bool knowsDescriptor(GatoHandle desc_handle) const;
+	/** Declaration handle of the known characteristic whose range contains handle, or 0. */
+	GatoHandle characteristicOwning(GatoHandle handle) const;
+	/** Returns a null characteristic if char_handle is not a known declaration. */
+	GatoCharacteristic characteristicAt(GatoHandle char_handle) const;
+
+	void addService(const GatoService &service);
+	/** Adds or replaces a characteristic in its service and in the attribute table. */
+	void storeCharacteristic(GatoHandle service_start, const GatoCharacteristic &characteristic);
+	void indexCharacteristic(GatoHandle service_start, const GatoCharacteristic &characteristic);
+	void clearAttributes(GatoHandle start, GatoHandle end);
+
 	void clearServices();
+	/** Forgets discovery requests and partial results for attributes in [start, end].
+	 *  A running discoverAll() is stopped as a whole; returns whether one was. */
+	bool cancelDiscovery(GatoHandle start, GatoHandle end);
 	void clearServiceCharacteristics(GatoService *service);
 	void clearCharacteristicDescriptors(GatoCharacteristic *characteristic);
 
 	void finishSetNotifyOperations(const GatoCharacteristic &characteristic);
+	void finishCharacteristicDiscovery(const GatoService &service);
+	void finishDescriptorDiscovery(const GatoCharacteristic &characteristic);
+
+	bool isFullyDiscovered() const;
+	void finishDiscoverAllSweep();
+	void finishDiscoverAll();
+
+	void readDatabaseHash();
+	void subscribeServiceChanged();
+	/** Rediscovers the services in the range given by a Service Changed indication. */
+	void handleServiceChanged(GatoHandle start, GatoHandle end);
+
+	void loadCache();
+	void saveCache();
+	/** Drops a cached attribute table the device just contradicted; returns
+	 *  true if it did, in which case services are being rediscovered. */
+	bool checkCacheError(GatoAttClient::Error error);
 
 public slots:
 	void handleAttConnected();
 	void handleAttDisconnected();
 	void handleAttAttributeUpdated(GatoHandle handle, const QByteArray &value, bool confirmed);
-	void handlePrimary(uint req, const QList<GatoAttClient::AttributeGroupData>& list);
-	void handlePrimaryForService(uint req, const QList<GatoAttClient::HandleInformation>& list);
-	void handleCharacteristic(uint req, const QList<GatoAttClient::AttributeData> &list);
-	void handleDescriptors(uint req, const QList<GatoAttClient::InformationData> &list);
+
+public:
+	void handlePrimary(uint req, const GatoAttClient::AttributeGroupDataList &list);
+	void handlePrimaryInRange(uint req, const GatoAttClient::AttributeGroupDataList &list, GatoHandle end);
+	void handlePrimaryForService(uint req, const GatoAttClient::HandleInformationList &list);
+	void handleCharacteristic(uint req, const GatoAttClient::AttributeDataList &list);
+	void handleDescriptors(uint req, const GatoAttClient::InformationDataList &list);
+	void handleDiscoverAllPrimary(uint req, const GatoAttClient::AttributeGroupDataList &list);
+	void handleDiscoverAllCharacteristics(uint req, const GatoAttClient::AttributeDataList &list);
+	void handleDiscoverAllDescriptors(uint req, const GatoAttClient::InformationDataList &list, GatoHandle service_start);
+	void handleDatabaseHash(uint req, const GatoAttClient::AttributeDataList &list);
 	void handleCharacteristicRead(uint req, const QByteArray &value);
+	void handleCharacteristicMultipleRead(uint req, const GatoAttClient::LengthValueList &values,
+	                                      GatoPeripheral::RequestPriority priority);
+	void handleCharacteristicChunk(uint req, int offset, const GatoAttClient::ValueRef &chunk, bool last);
 	void handleDescriptorRead(uint req, const QByteArray &value);
 	void handleCharacteristicWrite(uint req, bool ok);
 	void handleDescriptorWrite(uint req, bool ok);
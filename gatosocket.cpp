@@ -23,13 +23,30 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
 #include "gatosocket.h"
 
+#define DEFAULT_WRITE_HIGH_WATER_MARK 4096
+
+/** Upper bound of packets read per wakeup, so a flood cannot starve the event loop. */
+#define MAX_READS_PER_NOTIFY 64
+#define MAX_POOLED_BUFFERS MAX_READS_PER_NOTIFY
+/** Packets handed to the kernel in a single sendmmsg() call. */
+#define MAX_WRITES_PER_CALL 32
+
+#if defined(__linux__)
+#define HAVE_SENDMMSG 1
+#endif
+
+/** Used until the socket is connected and reports its own. */
+#define DEFAULT_RECEIVE_MTU 1024
+
 GatoSocket::GatoSocket(QObject *parent)
-    : QObject(parent), s(StateDisconnected), fd(-1)
+    : GatoTransport(parent), s(StateDisconnected), fd(-1), receiveMtu(DEFAULT_RECEIVE_MTU),
+      writeQueueBytes(0), highWaterMark(DEFAULT_WRITE_HIGH_WATER_MARK)
 {
 }
 
@@ -52,18 +69,13 @@ bool GatoSocket::connectTo(const GatoAddress &addr, unsigned short cid)
 		return false;
 	}
 
-	fd = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
-	if (fd == -1) {
+	int l2fd = socket(PF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK, BTPROTO_L2CAP);
+	if (l2fd == -1) {
 		qErrnoWarning("Could not create L2CAP socket");
 		return false;
 	}
 
-	s = StateConnecting;
-
-	readNotifier = new QSocketNotifier(fd, QSocketNotifier::Read, this);
-	writeNotifier = new QSocketNotifier(fd, QSocketNotifier::Write, this);
-	connect(readNotifier, SIGNAL(activated(int)), SLOT(readNotify()));
-	connect(writeNotifier, SIGNAL(activated(int)), SLOT(writeNotify()));
+	attach(l2fd);
 
 	struct sockaddr_l2 l2addr;
 	memset(&l2addr, 0, sizeof(l2addr));
@@ -71,10 +83,9 @@ bool GatoSocket::connectTo(const GatoAddress &addr, unsigned short cid)
 	l2addr.l2_family = AF_BLUETOOTH;
 	l2addr.l2_cid = htobs(cid);
 
-	// These are NOT mapped the way you expect.
-	if(addr.addressType() == 1) // 1 = Random device address.
+	if (addr.addressType() == BDADDR_LE_RANDOM)
 		l2addr.l2_bdaddr_type = BDADDR_LE_RANDOM;
-	else // 0 = Public device address.
+	else
 		l2addr.l2_bdaddr_type = BDADDR_LE_PUBLIC;
 
 	// Save the device address.
@@ -90,6 +101,19 @@ bool GatoSocket::connectTo(const GatoAddress &addr, unsigned short cid)
 	return true;
 }
 
+void GatoSocket::attach(int fd)
+{
+	Q_ASSERT(s == StateDisconnected);
+
+	this->fd = fd;
+	s = StateConnecting;
+
+	readNotifier = new QSocketNotifier(fd, QSocketNotifier::Read, this);
+	writeNotifier = new QSocketNotifier(fd, QSocketNotifier::Write, this);
+	connect(readNotifier, SIGNAL(activated(int)), SLOT(readNotify()));
+	connect(writeNotifier, SIGNAL(activated(int)), SLOT(writeNotify()));
+}
+
 void GatoSocket::close()
 {
 	if (s != StateDisconnected) {
@@ -97,7 +121,9 @@ void GatoSocket::close()
 		delete readNotifier;
 		delete writeNotifier;
 		readQueue.clear();
+		bufferPool.clear();
 		writeQueue.clear();
+		writeQueueBytes = 0;
 		::close(fd);
 		fd = -1;
 		s = StateDisconnected;
@@ -114,17 +140,59 @@ QByteArray GatoSocket::receive()
 	}
 }
 
-void GatoSocket::send(const QByteArray &pkt)
+void GatoSocket::recycle(QByteArray &pkt)
+{
+	if (s != StateDisconnected && pkt.isDetached() && pkt.capacity() >= receiveMtu &&
+	        bufferPool.size() < MAX_POOLED_BUFFERS) {
+		bufferPool.append(pkt);
+	}
+	pkt.clear();
+}
+
+bool GatoSocket::send(const QByteArray &pkt)
 {
+	if (s == StateDisconnected) {
+		qWarning() << "Socket not connected";
+		return false;
+	}
+
 	if (s == StateConnected && writeQueue.isEmpty()) {
 		if (transmit(pkt)) {
-			// Packet transmited succesfully without any queuing
-			return;
+			// Packet transmited succesfully without any queuing,
+			// unless writing failed and closed the socket.
+			return s == StateConnected;
 		}
 	}
 
 	writeQueue.enqueue(pkt);
+	writeQueueBytes += pkt.size();
 	writeNotifier->setEnabled(true);
+	return true;
+}
+
+int GatoSocket::pendingWritePackets() const
+{
+	return writeQueue.size();
+}
+
+int GatoSocket::pendingWriteBytes() const
+{
+	return writeQueueBytes;
+}
+
+int GatoSocket::writeHighWaterMark() const
+{
+	return highWaterMark;
+}
+
+void GatoSocket::setWriteHighWaterMark(int bytes)
+{
+	highWaterMark = bytes;
+}
+
+bool GatoSocket::canWrite() const
+{
+	return s == StateConnected && (highWaterMark <= 0 || writeQueueBytes < highWaterMark);
 }
 
 GatoSocket::SecurityLevel GatoSocket::securityLevel() const
@@ -188,41 +256,121 @@ bool GatoSocket::setSecurityLevel(SecurityLevel level)
 	}
 }
 
+/** Returns false if there is no room in the socket right now and the packet
+ *  must be retried later; errors close the socket and count as done. */
 bool GatoSocket::transmit(const QByteArray &pkt)
 {
 	int written = ::write(fd, pkt.constData(), pkt.size());
 	if (written < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+			return false;
+		}
 		qErrnoWarning("Could not write to L2 socket");
 		close();
-		return false;
+		return true;
 	} else if (written < pkt.size()) {
+		// Each packet is a single SDU; the remainder cannot be sent on its own,
+		// and the peer would be left with a truncated PDU.
 		qWarning("Could not write full packet to L2 socket");
+		close();
 		return true;
 	} else {
 		return true;
 	}
 }
 
-void GatoSocket::readNotify()
+/** Writes as much of the queue as the socket accepts.
+ *  Returns true if the whole queue was written. */
+bool GatoSocket::transmitQueue()
 {
-	QByteArray buf;
-	buf.resize(1024); // Max packet size
+	while (!writeQueue.isEmpty()) {
+#if HAVE_SENDMMSG
+		struct mmsghdr msgs[MAX_WRITES_PER_CALL];
+		struct iovec iovs[MAX_WRITES_PER_CALL];
+		const int count = qMin(writeQueue.size(), MAX_WRITES_PER_CALL);
+
+		memset(msgs, 0, sizeof(msgs[0]) * count);
+		for (int i = 0; i < count; i++) {
+			const QByteArray &pkt = writeQueue.at(i);
+			iovs[i].iov_base = const_cast<char*>(pkt.constData());
+			iovs[i].iov_len = pkt.size();
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
 
-	int read = ::read(fd, buf.data(), buf.size());
-	if (read < 0) {
-		qErrnoWarning("Could not read from L2 socket");
-		close();
-		return;
-	} else if (read == 0) {
-		return;
+		int sent = ::sendmmsg(fd, msgs, count, 0);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+				return false;
+			}
+			qErrnoWarning("Could not write to L2 socket");
+			close();
+			return false;
+		}
+
+		for (int i = 0; i < sent; i++) {
+			if (int(msgs[i].msg_len) < writeQueue.head().size()) {
+				// See transmit(); a truncated SDU cannot be completed later.
+				qWarning("Could not write full packet to L2 socket");
+				close();
+				return false;
+			}
+			writeQueueBytes -= writeQueue.dequeue().size();
+		}
+
+		if (sent < count) {
+			// Socket buffer is full
+			return false;
+		}
+#else
+		if (!transmit(writeQueue.head())) {
+			return false;
+		}
+		if (s != StateConnected) {
+			return false;
+		}
+		writeQueueBytes -= writeQueue.dequeue().size();
+#endif
 	}
 
-	buf.resize(read);
+	return true;
+}
+
+void GatoSocket::readNotify()
+{
+	const bool was_empty = readQueue.isEmpty();
 
-	readQueue.enqueue(buf);
+	// Drain everything the socket has, instead of one packet per wakeup.
+	for (int i = 0; i < MAX_READS_PER_NOTIFY; i++) {
+		QByteArray buf;
+		if (!bufferPool.isEmpty()) {
+			buf = bufferPool.takeLast();
+		}
+		buf.resize(receiveMtu); // Max packet size
 
-	if (readQueue.size() == 1) {
-		// Read queue was empty, but now contains the item we just added.
+		int read = ::read(fd, buf.data(), buf.size());
+		if (read < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				bufferPool.append(buf);
+				break;
+			}
+			qErrnoWarning("Could not read from L2 socket");
+			close();
+			return;
+		} else if (read == 0) {
+			// Orderly shutdown by the other end
+			bufferPool.append(buf);
+			close();
+			return;
+		}
+
+		buf.resize(read);
+
+		readQueue.enqueue(buf);
+	}
+
+	if (was_empty && !readQueue.isEmpty()) {
+		// Read queue was empty, but now contains the items we just added.
 		// Signal readers there is data available.
 		emit readyRead();
 	}
@@ -245,17 +393,28 @@ void GatoSocket::writeNotify()
 			return;
 		}
 
+		quint16 mtu = 0;
+		len = sizeof(mtu);
+		if (::getsockopt(fd, SOL_BLUETOOTH, BT_RCVMTU, &mtu, &len) == 0 && mtu > 0) {
+			receiveMtu = mtu;
+		} else {
+			receiveMtu = DEFAULT_RECEIVE_MTU;
+		}
+
 		s = StateConnected;
 		emit connected();
 	} else if (s == StateConnected) {
-		if (!writeQueue.isEmpty()) {
-			if (transmit(writeQueue.head())) {
-				writeQueue.dequeue();
-			}
+		const bool queued = !writeQueue.isEmpty();
+
+		if (!transmitQueue()) {
+			// Socket buffer is full or the socket was closed;
+			// wait for the next notification.
+			return;
 		}
 
-		if (writeQueue.isEmpty()) {
-			writeNotifier->setEnabled(false);
+		writeNotifier->setEnabled(false);
+		if (queued) {
+			emit writeQueueDrained();
 		}
 	}
 }
@@ -5,58 +5,44 @@
 #include <QtCore/QQueue>
 #include <QtCore/QSocketNotifier>
 
-#include "gatoaddress.h"
+#include "gatotransport.h"
 
 /** This class encapsulates a message-oriented bluetooth L2CAP socket. */
-class GatoSocket : public QObject
+class GatoSocket : public GatoTransport
 {
 	Q_OBJECT
-	Q_ENUMS(State)
 
 public:
 	explicit GatoSocket(QObject *parent);
 	~GatoSocket();
 
-	enum State {
-		StateDisconnected,
-		StateConnecting,
-		StateConnected
-	};
-
-	enum Error {
-		TimeoutError,
-		UnknownError
-	};
-
-	enum SecurityLevel {
-		SecurityNone,
-		SecurityLow,
-		SecurityMedium,
-		SecurityHigh
-	};
-
 	State state() const;
 
 	bool connectTo(const GatoAddress &addr, unsigned short cid);
 	void close();
 
-	/** Dequeues a pending message from the rx queue.
-	 *  Doesn't block: if there are no pending messages, returns null QByteArray. */
 	QByteArray receive();
-	/** Adds a message to the tx queue. */
-	void send(const QByteArray &pkt);
+	void recycle(QByteArray &pkt);
+	bool send(const QByteArray &pkt);
+
+	int pendingWritePackets() const;
+	int pendingWriteBytes() const;
+
+	int writeHighWaterMark() const;
+	void setWriteHighWaterMark(int bytes);
+	bool canWrite() const;
 
 	SecurityLevel securityLevel() const;
 	bool setSecurityLevel(SecurityLevel level);
 
-signals:
-	void connected();
-	void disconnected();
-	void error(Error error);
-	void readyRead();
+protected:
+	/** Starts driving an already created, non-blocking SOCK_SEQPACKET socket whose
+	 *  connection is in progress; connected() is emitted once it is writable. */
+	void attach(int fd);
 
 private:
 	bool transmit(const QByteArray &pkt);
+	bool transmitQueue();
 
 private slots:
 	void readNotify();
@@ -67,8 +53,12 @@ private:
 	int fd;
 	QSocketNotifier *readNotifier;
 	QQueue<QByteArray> readQueue;
+	QList<QByteArray> bufferPool;
+	int receiveMtu;
 	QSocketNotifier *writeNotifier;
 	QQueue<QByteArray> writeQueue;
+	int writeQueueBytes;
+	int highWaterMark;
 };
 
 #endif // GATOSOCKET_H
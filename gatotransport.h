@@ -0,0 +1,77 @@
+#ifndef GATOTRANSPORT_H
+#define GATOTRANSPORT_H
+
+#include <QtCore/QObject>
+
+#include "gatoaddress.h"
+
+/** A message oriented, connection based channel that ATT PDUs travel over.
+ *  GatoSocket implements it on top of a bluetooth L2CAP socket. */
+class GatoTransport : public QObject
+{
+	Q_OBJECT
+	Q_ENUMS(State)
+
+public:
+	explicit GatoTransport(QObject *parent = 0) : QObject(parent) { }
+	virtual ~GatoTransport() { }
+
+	enum State {
+		StateDisconnected,
+		StateConnecting,
+		StateConnected
+	};
+
+	enum Error {
+		TimeoutError,
+		UnknownError
+	};
+
+	enum SecurityLevel {
+		SecurityNone,
+		SecurityLow,
+		SecurityMedium,
+		SecurityHigh
+	};
+
+	virtual State state() const = 0;
+
+	virtual bool connectTo(const GatoAddress &addr, unsigned short cid) = 0;
+	virtual void close() = 0;
+
+	/** Dequeues a pending message from the rx queue.
+	 *  Doesn't block: if there are no pending messages, returns null QByteArray.
+	 *  readyRead() is only emitted again once this has returned null, so readers
+	 *  should call it until then. */
+	virtual QByteArray receive() = 0;
+	/** Gives a buffer returned by receive() back for reuse, unless something
+	 *  else still holds a reference to it. Clears pkt. */
+	virtual void recycle(QByteArray &pkt) = 0;
+	/** Adds a message to the tx queue.
+	 *  Returns false if the transport is not connected or failed while writing. */
+	virtual bool send(const QByteArray &pkt) = 0;
+
+	/** Messages written by send() but still waiting to be written out. */
+	virtual int pendingWritePackets() const = 0;
+	virtual int pendingWriteBytes() const = 0;
+
+	/** Callers that can drop or delay data (e.g. streaming commands) should not
+	 *  send while more than this many bytes are pending; 0 means no limit. */
+	virtual int writeHighWaterMark() const = 0;
+	virtual void setWriteHighWaterMark(int bytes) = 0;
+	/** Whether pending writes are below the high water mark. */
+	virtual bool canWrite() const = 0;
+
+	virtual SecurityLevel securityLevel() const = 0;
+	virtual bool setSecurityLevel(SecurityLevel level) = 0;
+
+signals:
+	void connected();
+	void disconnected();
+	void error(GatoTransport::Error error);
+	void readyRead();
+	/** The tx queue became empty again after send() had to queue messages. */
+	void writeQueueDrained();
+};
+
+#endif // GATOTRANSPORT_H
@@ -25,101 +25,69 @@
 
 #include "gatouuid.h"
 
-// Bluetooth style UUIDs are like
-// {XXXXXXXX-0000-1000-8000-00805F9B34FB}
+static_assert(sizeof(GatoUUID) == 16, "GatoUUID should stay compact");
 
-static const quint16 baseuuid_data2 = 0x0000;
-static const quint16 baseuuid_data3 = 0x1000;
-static const quint8 baseuuid_data4[8] = {0x80, 0x00,
-                                         0x00, 0x80, 0x5F, 0x9B, 0x34, 0xFB};
-
-// Used in QUuid constructor, because it wants bytes as args instead of byte array
-#define BASEUUID_DATA4_VALUES baseuuid_data4[0], baseuuid_data4[1], baseuuid_data4[2], baseuuid_data4[3], \
-                              baseuuid_data4[4], baseuuid_data4[5], baseuuid_data4[6], baseuuid_data4[7]
-
-GatoUUID::GatoUUID()
-{
-
-}
-
-GatoUUID::GatoUUID(GattUuid uuid)
-    : QUuid(uuid, baseuuid_data2, baseuuid_data3, BASEUUID_DATA4_VALUES)
-{
-}
-
-GatoUUID::GatoUUID(quint16 uuid)
-    : QUuid(uuid, baseuuid_data2, baseuuid_data3, BASEUUID_DATA4_VALUES)
+GatoUUID::GatoUUID(const QString &uuid)
+    : GatoUUID(QUuid(uuid))
 {
-
 }
 
-GatoUUID::GatoUUID(quint32 uuid)
-    : QUuid(uuid, baseuuid_data2, baseuuid_data3, BASEUUID_DATA4_VALUES)
+GatoUUID::GatoUUID(const QUuid &uuid)
+    : hi((quint64(uuid.data1) << 32) | (quint64(uuid.data2) << 16) | uuid.data3),
+      lo(qFromBigEndian<quint64>(uuid.data4))
 {
 }
 
-GatoUUID::GatoUUID(const QString &uuid)
-    : QUuid(uuid)
+quint16 GatoUUID::toUInt16(bool *ok) const
 {
-
+	if (minimumSize() <= 2) {
+		if (ok) *ok = true;
+		return quint16(hi >> 32);
+	} else {
+		if (ok) *ok = false;
+		return 0;
+	}
 }
 
-GatoUUID::GatoUUID(const GatoUUID &o)
-	: QUuid(o)
+quint32 GatoUUID::toUInt32(bool *ok) const
 {
-
+	if (minimumSize() <= 4) {
+		if (ok) *ok = true;
+		return quint32(hi >> 32);
+	} else {
+		if (ok) *ok = false;
+		return 0;
+	}
 }
 
-GatoUUID::GatoUUID(const QUuid &uuid)
-    : QUuid(uuid)
+QUuid GatoUUID::toQUuid() const
 {
-
+	return QUuid(uint(hi >> 32), ushort(hi >> 16), ushort(hi),
+	             uchar(lo >> 56), uchar(lo >> 48), uchar(lo >> 40), uchar(lo >> 32),
+	             uchar(lo >> 24), uchar(lo >> 16), uchar(lo >> 8), uchar(lo));
 }
 
-GatoUUID::~GatoUUID()
+QString GatoUUID::toString() const
 {
+	return toQUuid().toString();
 }
 
-int GatoUUID::minimumSize() const
+QByteArray GatoUUID::toRfc4122() const
 {
-	if (isNull()) {
-		return 0;
-	}
-
-	if (data2 == baseuuid_data2 && data3 == baseuuid_data3 &&
-	        memcmp(data4, baseuuid_data4, sizeof(baseuuid_data4)) == 0) {
-		if (data1 & 0xFFFF0000) {
-			return 4;
-		} else {
-			return 2;
-		}
-	}
-
-	return 16;
+	QByteArray bytes(16, Qt::Uninitialized);
+	toRfc4122(reinterpret_cast<uchar*>(bytes.data()));
+	return bytes;
 }
 
-quint16 GatoUUID::toUInt16(bool *ok) const
+void GatoUUID::toRfc4122(uchar dst[]) const
 {
-	/*if (minimumSize() <= 2) {
-		if (ok) *ok = true;
-		return data1;
-	} else {
-		if (ok) *ok = false;
-		return 0;
-	}*/
-	if (ok) *ok = true;
-	return data1;
+	qToBigEndian<quint64>(hi, dst);
+	qToBigEndian<quint64>(lo, dst + 8);
 }
 
-quint32 GatoUUID::toUInt32(bool *ok) const
+GatoUUID GatoUUID::fromRfc4122(const uchar src[])
 {
-	if (minimumSize() <= 4) {
-		if (ok) *ok = true;
-		return data1;
-	} else {
-		if (ok) *ok = false;
-		return 0;
-	}
+	return GatoUUID(qFromBigEndian<quint64>(src), qFromBigEndian<quint64>(src + 8));
 }
 
 QDebug operator<<(QDebug debug, const GatoUUID &uuid)
@@ -143,15 +111,3 @@ QDebug operator<<(QDebug debug, const GatoUUID &uuid)
 	debug.nospace() << uuid.toString().toLatin1().constData();
     return debug.space();
 }
-
-uint qHash(const GatoUUID &uuid, uint seed)
-{
-#if QT_VERSION < QT_VERSION_CHECK(5, 0, 0)
-	return uuid.data1 ^ uuid.data2 ^ (uuid.data3 << 16)
-			^ ((uuid.data4[0] << 24) | (uuid.data4[1] << 16) | (uuid.data4[2] << 8) | uuid.data4[3])
-			^ ((uuid.data4[4] << 24) | (uuid.data4[5] << 16) | (uuid.data4[6] << 8) | uuid.data4[7])
-			^ seed;
-#else
-	return qHash<QUuid>(uuid, seed);
-#endif
-}
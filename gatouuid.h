@@ -6,9 +6,9 @@
 #include <QtCore/QUuid>
 #include "libgato_global.h"
 
-class GatoUUIDPrivate;
-
-class LIBGATO_EXPORT GatoUUID : public QUuid
+/** A 128 bit UUID, stored as two integers so that the 16 and 32 bit short forms
+ *  of Bluetooth UUIDs can be checked and extracted without any byte shuffling. */
+class LIBGATO_EXPORT GatoUUID
 {
 public:
 	enum GattUuid {
@@ -29,26 +29,73 @@ public:
 		GattPeripheralPrivacyFlag = 0x2A02,
 		GattReconnectionAddress = 0x2A03,
 		GattPeripheralPreferredConnectionParameters = 0x2A04,
-		GattServiceChanged = 0x2A05
+		GattServiceChanged = 0x2A05,
+		GattClientSupportedFeatures = 0x2B29,
+		GattDatabaseHash = 0x2B2A
 	};
 
-	GatoUUID();
-	GatoUUID(GattUuid uuid);
-	explicit GatoUUID(quint16 uuid);
-	explicit GatoUUID(quint32 uuid);
+	Q_DECL_CONSTEXPR GatoUUID() : hi(0), lo(0) { }
+	Q_DECL_CONSTEXPR GatoUUID(GattUuid uuid) : hi(baseHi(uuid)), lo(BaseLo) { }
+	Q_DECL_CONSTEXPR explicit GatoUUID(quint16 uuid) : hi(baseHi(uuid)), lo(BaseLo) { }
+	Q_DECL_CONSTEXPR explicit GatoUUID(quint32 uuid) : hi(baseHi(uuid)), lo(BaseLo) { }
+	/** The most and least significant halves of the UUID. */
+	Q_DECL_CONSTEXPR GatoUUID(quint64 high, quint64 low) : hi(high), lo(low) { }
 	explicit GatoUUID(const QString &uuid);
-	GatoUUID(const GatoUUID &o);
 	GatoUUID(const QUuid &uuid);
-	~GatoUUID();
 
-	int minimumSize() const;
+	Q_DECL_CONSTEXPR bool isNull() const { return hi == 0 && lo == 0; }
+
+	/** 2 or 4 if the UUID has a short form of that many bytes, 16 if not; 0 if null. */
+	Q_DECL_CONSTEXPR int minimumSize() const
+	{
+		return isNull() ? 0 : !isShort() ? 16 : (hi >> 48) ? 4 : 2;
+	}
 
 	quint16 toUInt16(bool *ok = 0) const;
 	quint32 toUInt32(bool *ok = 0) const;
+	QUuid toQUuid() const;
+	QString toString() const;
+
+	/** 16 bytes in network order. */
+	QByteArray toRfc4122() const;
+	void toRfc4122(uchar dst[]) const;
+	static GatoUUID fromRfc4122(const uchar src[]);
+
+	Q_DECL_CONSTEXPR quint64 high() const { return hi; }
+	Q_DECL_CONSTEXPR quint64 low() const { return lo; }
+
+	Q_DECL_CONSTEXPR friend bool operator==(const GatoUUID &a, const GatoUUID &b) { return a.hi == b.hi && a.lo == b.lo; }
+	Q_DECL_CONSTEXPR friend bool operator!=(const GatoUUID &a, const GatoUUID &b) { return !(a == b); }
+	Q_DECL_CONSTEXPR friend bool operator<(const GatoUUID &a, const GatoUUID &b) { return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo); }
+
+private:
+	// Bluetooth style UUIDs are like
+	// {XXXXXXXX-0000-1000-8000-00805F9B34FB}
+	enum : quint64 {
+		BaseHi = Q_UINT64_C(0x0000000000001000),
+		BaseLo = Q_UINT64_C(0x800000805F9B34FB)
+	};
+
+	static Q_DECL_CONSTEXPR quint64 baseHi(quint32 uuid) { return (quint64(uuid) << 32) | BaseHi; }
+	Q_DECL_CONSTEXPR bool isShort() const { return lo == BaseLo && quint32(hi) == BaseHi; }
+
+	quint64 hi, lo;
 };
 
+Q_DECLARE_TYPEINFO(GatoUUID, Q_PRIMITIVE_TYPE);
+
+/** Short form of a Bluetooth UUID, e.g. 0x2902_uuid. */
+Q_DECL_CONSTEXPR inline GatoUUID operator"" _uuid(unsigned long long uuid)
+{
+	return GatoUUID(quint32(uuid));
+}
+
 LIBGATO_EXPORT QDebug operator<<(QDebug debug, const GatoUUID &uuid);
 
-LIBGATO_EXPORT uint qHash(const GatoUUID &a, uint seed = 0);
+inline uint qHash(const GatoUUID &a, uint seed = 0)
+{
+	const quint64 x = a.high() ^ a.low();
+	return uint(x ^ (x >> 32)) ^ seed;
+}
 
 #endif // GATOUUID_H
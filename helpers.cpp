@@ -21,55 +21,53 @@
 #include <QtCore/QDataStream>
 #include "helpers.h"
 
-static QByteArray reverse(const QByteArray &ba)
+GatoUUID read_gatouuid(const char *data, int size)
 {
-	int size = ba.size();
-	QByteArray r(size, Qt::Uninitialized);
-	for (int i = 0; i < size; i++) {
-		r[i] = ba[size - i - 1];
-	}
-	return r;
-}
-
-GatoUUID bytearray_to_gatouuid(const QByteArray &ba)
-{
-	switch (ba.size()) {
+	const uchar *p = reinterpret_cast<const uchar*>(data);
+	switch (size) {
 	case 2:
-		return GatoUUID(read_le<quint16>(ba.constData()));
+		return GatoUUID(read_le<quint16>(p));
 	case 4:
-		return GatoUUID(read_le<quint32>(ba.constData()));
+		return GatoUUID(read_le<quint32>(p));
 	case 16:
 		// For some reason, Bluetooth UUIDs use "reversed big endian" order.
-		return GatoUUID(QUuid::fromRfc4122(reverse(ba)));
+		return GatoUUID(read_le<quint64>(&p[8]), read_le<quint64>(p));
 	default:
 		return GatoUUID();
 	}
 }
 
-QByteArray gatouuid_to_bytearray(const GatoUUID &uuid, bool use_uuid16, bool use_uuid32)
+GatoUUID bytearray_to_gatouuid(const QByteArray &ba)
 {
-	if (use_uuid16) {
-		quint16 uuid16 = uuid.toUInt16(&use_uuid16);
-		if (use_uuid16) {
-			QByteArray bytes(sizeof(quint16), Qt::Uninitialized);
-			write_le(uuid16, bytes.data());
-			return bytes;
-		}
-	}
-	if (use_uuid32) {
-		quint32 uuid32 = uuid.toUInt32(&use_uuid32);
-		if (use_uuid32) {
-			QByteArray bytes(sizeof(quint32), Qt::Uninitialized);
-			write_le(uuid32, bytes.data());
-			return bytes;
-		}
+	return read_gatouuid(ba.constData(), ba.size());
+}
+
+int write_gatouuid(const GatoUUID &uuid, bool use_uuid16, bool use_uuid32, uchar *dst)
+{
+	const int size = uuid.minimumSize();
+	if (use_uuid16 && size <= 2) {
+		write_le<quint16>(uuid.toUInt16(), dst);
+		return 2;
+	} else if (use_uuid32 && size <= 4) {
+		write_le<quint32>(uuid.toUInt32(), dst);
+		return 4;
+	} else {
+		write_le<quint64>(uuid.low(), dst);
+		write_le<quint64>(uuid.high(), dst + 8);
+		return 16;
 	}
+}
 
-	return reverse(uuid.toRfc4122());
+QByteArray gatouuid_to_bytearray(const GatoUUID &uuid, bool use_uuid16, bool use_uuid32)
+{
+	uchar bytes[16];
+	int size = write_gatouuid(uuid, use_uuid16, use_uuid32, bytes);
+	return QByteArray(reinterpret_cast<char*>(bytes), size);
 }
 
 void write_gatouuid(QDataStream &s, const GatoUUID &uuid, bool use_uuid16, bool use_uuid32)
 {
-	QByteArray bytes = gatouuid_to_bytearray(uuid, use_uuid16, use_uuid32);
-	s.writeRawData(bytes.constData(), bytes.size());
+	uchar bytes[16];
+	int size = write_gatouuid(uuid, use_uuid16, use_uuid32, bytes);
+	s.writeRawData(reinterpret_cast<char*>(bytes), size);
 }
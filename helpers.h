@@ -5,6 +5,75 @@
 #include <QtCore/QtEndian>
 #include "gatouuid.h"
 
+class QDataStream;
+
+/* Consult Bluetooth.org "Generic Access Profile" assigned numbers specification */
+enum EIRDataFields {
+	EIRFlags = 0x01,
+	EIRIncompleteUUID16List = 0x02,
+	EIRCompleteUUID16List = 0x03,
+	EIRIncompleteUUID32List = 0x04,
+	EIRCompleteUUID32List = 0x05,
+	EIRIncompleteUUID128List = 0x06,
+	EIRCompleteUUID128List = 0x07,
+	EIRIncompleteLocalName = 0x08,
+	EIRCompleteLocalName = 0x09,
+	EIRTxPowerLevel = 0x0A,
+	EIRDeviceClass = 0x0D,
+	EIRSecurityManagerTKValue = 0x10,
+	EIRSecurityManagerOutOfBandFlags = 0x11,
+	EIRSolicitedUUID16List = 0x14,
+	EIRSolicitedUUID32List = 0x1F,
+	EIRSolicitedUUID128List = 0x15,
+	EIRAppearance = 0x19,
+	EIRAdvertisingInterval = 0x1A,
+	EIRLEBluetoothDeviceAddress = 0x1B,
+	EIRLERole = 0x1C,
+	EIRManufacturerData = 0xFF
+};
+
+/** Walks the data structures of an advertising or EIR payload in place:
+ *
+ *      GatoEIRIterator it(data, len);
+ *      while (it.next()) {
+ *          switch (it.type()) ...
+ *      }
+ *
+ *  next() returns false at the end of the payload, at the zero length structure
+ *  that starts the padding, or at the first structure that does not fit. */
+class GatoEIRIterator
+{
+public:
+	GatoEIRIterator(const quint8 *data, int len)
+	    : pos(data), end(data + len), item(0), malformed(false)
+	{ }
+
+	bool next()
+	{
+		if (pos >= end || *pos == 0) {
+			return false;
+		}
+		if (*pos > end - pos - 1) {
+			malformed = true;
+			return false;
+		}
+		item = pos;
+		pos += 1 + *pos;
+		return true;
+	}
+
+	bool isMalformed() const { return malformed; }
+
+	quint8 type() const { return item[1]; }
+	const quint8 *data() const { return item + 2; }
+	int size() const { return item[0] - 1; }
+
+private:
+	const quint8 *pos, *end;
+	const quint8 *item;
+	bool malformed;
+};
+
 template<typename T>
 inline T read_le(const uchar *src)
 {
@@ -29,7 +98,11 @@ void write_le(T src, char *dst)
 	qToLittleEndian<T>(src, reinterpret_cast<uchar*>(dst));
 }
 
+GatoUUID read_gatouuid(const char *data, int size);
 GatoUUID bytearray_to_gatouuid(const QByteArray &ba);
+/** Writes uuid in little endian order, in its 16 or 32 bit form if allowed and
+ *  possible; dst must have room for 16 bytes. Returns the bytes written. */
+int write_gatouuid(const GatoUUID &uuid, bool use_uuid16, bool use_uuid32, uchar *dst);
 QByteArray gatouuid_to_bytearray(const GatoUUID &uuid, bool use_uuid16, bool use_uuid32);
 void write_gatouuid(QDataStream &s, const GatoUUID &uuid, bool use_uuid16, bool use_uuid32);
 
@@ -1,9 +1,11 @@
 TEMPLATE = lib
 TARGET = gato
-VERSION = 1.0.0
+VERSION = 2.0.0
 
 QT -= gui
 
+CONFIG += c++11
+
 DEFINES += LIBGATO_LIBRARY
 
 CONFIG += link_pkgconfig
@@ -15,6 +17,10 @@ SOURCES += \
     gatoperipheral.cpp \
     gatoaddress.cpp \
     gatosocket.cpp \
+    gatolocaltransport.cpp \
+    gatolinkemulator.cpp \
+    gatoattributecache.cpp \
+    gatoadvertisementtable.cpp \
     helpers.cpp \
     gatoservice.cpp \
     gatocharacteristic.cpp \
@@ -26,7 +32,12 @@ HEADERS += libgato_global.h gato.h \
     gatouuid.h \
     gatoperipheral.h \
     gatoaddress.h \
+    gatotransport.h \
     gatosocket.h \
+    gatolocaltransport.h \
+    gatolinkemulator.h \
+    gatoattributecache.h \
+    gatoadvertisementtable.h \
     helpers.h \
     gatoperipheral_p.h \
     gatocentralmanager_p.h \
@@ -71,9 +71,9 @@ rm -rf %{buildroot}
 %files
 %defattr(-,root,root,-)
 # >> files
-%{_libdir}/libgato.so.1
-%{_libdir}/libgato.so.1.0
-%{_libdir}/libgato.so.1.0.0
+%{_libdir}/libgato.so.2
+%{_libdir}/libgato.so.2.0
+%{_libdir}/libgato.so.2.0.0
 # << files
 
 %files devel
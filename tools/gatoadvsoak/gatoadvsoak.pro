@@ -0,0 +1,14 @@
+TEMPLATE = app
+TARGET = gatoadvsoak
+
+QT -= gui
+
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+# Links against the library built in the top level directory, and uses
+# its internal headers (advertisement table).
+INCLUDEPATH += ../..
+LIBS += -L../.. -lgato
+
+SOURCES += main.cpp
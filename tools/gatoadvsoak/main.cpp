@@ -0,0 +1,142 @@
+/*
+ *  libgato - A GATT/ATT library for use with Bluez
+ *
+ *  Copyright (C) 2013 Javier S. Pedro <maemo@javispedro.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QStringList>
+#include <QtCore/QTextStream>
+
+#include <unistd.h>
+#include <bluetooth/bluetooth.h>
+
+#include "gatoadvertisementtable.h"
+#include "helpers.h"
+
+/* Feeds a day of simulated advertising from a crowd of devices using rotating
+ * random addresses into the advertisement table, on a simulated clock, and
+ * prints its size and the process memory every simulated hour. */
+
+static void usage()
+{
+	QTextStream err(stderr);
+	err << "Usage: gatoadvsoak [--devices N] [--interval MS] [--rotate S] [--hours H]\n"
+	       "                   [--capacity N] [--timeout MS]" << endl;
+}
+
+static qint64 resident_bytes()
+{
+	QFile statm("/proc/self/statm");
+	if (!statm.open(QIODevice::ReadOnly)) return 0;
+	QList<QByteArray> fields = statm.readAll().split(' ');
+	if (fields.size() < 2) return 0;
+	return fields.at(1).toLongLong() * sysconf(_SC_PAGESIZE);
+}
+
+/** Static random address the given device uses during the given rotation period. */
+static GatoAddress device_address(int device, qint64 period)
+{
+	quint64 x = (quint64(device) << 32) ^ quint64(period) ^ Q_UINT64_C(0x9E3779B97F4A7C15);
+	x ^= x >> 33;
+	x *= Q_UINT64_C(0xFF51AFD7ED558CCD);
+	x ^= x >> 33;
+	// The two most significant bits of a static random address are set.
+	return GatoAddress((x & Q_UINT64_C(0x3FFFFFFFFFFF)) | Q_UINT64_C(0xC00000000000), BDADDR_LE_RANDOM);
+}
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+	QStringList args = app.arguments();
+	int devices = 500, interval = 1000, rotate = 900, hours = 24;
+	int capacity = 1024, timeout = 5 * 60 * 1000;
+
+	for (int i = 1; i < args.size(); i++) {
+		const QString &arg = args.at(i);
+		bool ok = true;
+		if (arg == "--devices" && i + 1 < args.size()) {
+			devices = args.at(++i).toInt(&ok);
+		} else if (arg == "--interval" && i + 1 < args.size()) {
+			interval = args.at(++i).toInt(&ok);
+		} else if (arg == "--rotate" && i + 1 < args.size()) {
+			rotate = args.at(++i).toInt(&ok);
+		} else if (arg == "--hours" && i + 1 < args.size()) {
+			hours = args.at(++i).toInt(&ok);
+		} else if (arg == "--capacity" && i + 1 < args.size()) {
+			capacity = args.at(++i).toInt(&ok);
+		} else if (arg == "--timeout" && i + 1 < args.size()) {
+			timeout = args.at(++i).toInt(&ok);
+		} else {
+			ok = false;
+		}
+		if (!ok || devices <= 0 || interval <= 0 || rotate <= 0) {
+			usage();
+			return 1;
+		}
+	}
+
+	GatoAdvertisementTable table;
+	table.setCapacity(capacity);
+	table.setTimeout(timeout);
+
+	// Flags, a 16 bit service UUID (heart rate) and a short name.
+	static const quint8 payload[] = {
+		0x02, EIRFlags, 0x06,
+		0x03, EIRCompleteUUID16List, 0x0D, 0x18,
+		0x05, EIRCompleteLocalName, 's', 'o', 'a', 'k'
+	};
+
+	QTextStream out(stdout);
+	QElapsedTimer wall;
+	wall.start();
+
+	const qint64 end = qint64(hours) * 3600 * 1000;
+	const qint64 rotate_ms = qint64(rotate) * 1000;
+	qint64 reports = 0;
+	qint64 first_hour_rss = 0, peak_rss = 0;
+
+	out << "hour\treports\tdevices\ttable bytes\tRSS bytes" << endl;
+
+	for (qint64 now = 0; now < end; now += interval) {
+		for (int device = 0; device < devices; device++) {
+			// Stagger the rotations so that addresses change all the time.
+			qint64 period = (now + device * rotate_ms / devices) / rotate_ms;
+			GatoAddress addr = device_address(device, period);
+			table.expire(now);
+			table.update(addr, 0 /* ADV_IND */, -60 - device % 30, payload, sizeof(payload), now);
+			reports++;
+		}
+
+		if ((now + interval) / 3600000 != now / 3600000) {
+			qint64 rss = resident_bytes();
+			if (first_hour_rss == 0) first_hour_rss = rss;
+			peak_rss = qMax(peak_rss, rss);
+			out << (now + interval) / 3600000 << '\t' << reports << '\t'
+			    << table.size() << '\t' << table.allocatedSize() << '\t' << rss << endl;
+		}
+	}
+
+	out << "Simulated " << hours << "h (" << reports << " reports) in "
+	    << wall.elapsed() << " ms; RSS growth after the first hour: "
+	    << (peak_rss - first_hour_rss) << " bytes" << endl;
+
+	return 0;
+}
@@ -0,0 +1,334 @@
+/*
+ *  libgato - A GATT/ATT library for use with Bluez
+ *
+ *  Copyright (C) 2013 Javier S. Pedro <maemo@javispedro.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include <QtCore/QDebug>
+#include <QtCore/QTimer>
+#include <QtCore/QTextStream>
+
+#include "gatolocaltransport.h"
+#include "gatolinkemulator.h"
+#include "gatofakeserver.h"
+#include "benchmark.h"
+
+Benchmark::Benchmark(GatoFakeServer *server, QObject *parent) :
+	QObject(parent), reads(1000), notifyRate(1000), notifySeconds(5), discoverAll(false),
+	server(server), transport(new GatoLocalTransport(this)),
+	emulator(new GatoLinkEmulator(transport, this)),
+	peripheral(new GatoPeripheral(emulator, GatoAddress(), this)),
+	phase(PhaseIdle), pending_services(0), check_failed(false), notifications(0)
+{
+	connect(peripheral, SIGNAL(connected()), SLOT(handleConnected()));
+	connect(peripheral, SIGNAL(disconnected()), SLOT(handleDisconnected()));
+	connect(peripheral, SIGNAL(servicesDiscovered()), SLOT(handleServicesDiscovered()));
+	connect(peripheral, SIGNAL(characteristicsDiscovered(GatoService)),
+	        SLOT(handleCharacteristicsDiscovered(GatoService)));
+	connect(peripheral, SIGNAL(descriptorsDiscovered(GatoCharacteristic)),
+	        SLOT(handleDescriptorsDiscovered(GatoCharacteristic)));
+	connect(peripheral, SIGNAL(discoveryFinished()), SLOT(handleDiscoveryFinished()));
+	connect(peripheral, SIGNAL(valueUpdated(GatoCharacteristic,QByteArray)),
+	        SLOT(handleValueUpdated(GatoCharacteristic,QByteArray)));
+	connect(server, SIGNAL(notificationSent()), SLOT(handleNotificationSent()));
+
+	emulator->setConnectionInterval(0);
+}
+
+bool Benchmark::failed() const
+{
+	return check_failed;
+}
+
+GatoLinkEmulator *Benchmark::link() const
+{
+	return emulator;
+}
+
+void Benchmark::start()
+{
+	peripheral->connectPeripheral();
+	if (!server->serve(transport->takePeerDescriptor())) {
+		qWarning() << "Could not start the fake server";
+		emit finished();
+	}
+}
+
+void Benchmark::handleConnected()
+{
+	phase = PhaseDiscovery;
+	timer.start();
+	if (discoverAll) {
+		peripheral->discoverAll();
+	} else {
+		peripheral->discoverServices();
+	}
+}
+
+void Benchmark::handleDisconnected()
+{
+	if (phase != PhaseIdle) {
+		qWarning() << "Disconnected during benchmark";
+		phase = PhaseIdle;
+		emit finished();
+	}
+}
+
+void Benchmark::handleServicesDiscovered()
+{
+	if (phase != PhaseDiscovery || discoverAll) return;
+
+	QList<GatoService> services = peripheral->services();
+	pending_services = services.size();
+	pending_characteristics.clear();
+	if (pending_services == 0) {
+		startCheckPhase();
+		return;
+	}
+	foreach (const GatoService &service, services) {
+		peripheral->discoverCharacteristics(service);
+	}
+}
+
+void Benchmark::handleCharacteristicsDiscovered(const GatoService &service)
+{
+	if (phase != PhaseDiscovery) return;
+
+	// The peripheral may look up some descriptors on its own, so track
+	// characteristics by handle instead of counting signals.
+	QList<GatoCharacteristic> characteristics = service.characteristics();
+	pending_services--;
+	foreach (const GatoCharacteristic &characteristic, characteristics) {
+		pending_characteristics.insert(characteristic.startHandle());
+	}
+	foreach (const GatoCharacteristic &characteristic, characteristics) {
+		peripheral->discoverDescriptors(characteristic);
+	}
+	// Cached descriptors are reported right away and may have finished the phase already.
+	if (phase == PhaseDiscovery && pending_services == 0 && pending_characteristics.isEmpty()) {
+		startCheckPhase();
+	}
+}
+
+void Benchmark::handleDescriptorsDiscovered(const GatoCharacteristic &characteristic)
+{
+	if (phase != PhaseDiscovery) return;
+
+	pending_characteristics.remove(characteristic.startHandle());
+	if (pending_services == 0 && pending_characteristics.isEmpty()) {
+		startCheckPhase();
+	}
+}
+
+void Benchmark::handleDiscoveryFinished()
+{
+	if (phase != PhaseDiscovery) return;
+
+	startCheckPhase();
+}
+
+void Benchmark::handleValueUpdated(const GatoCharacteristic &characteristic, const QByteArray &value)
+{
+	switch (phase) {
+	case PhaseCheck:
+		if (characteristic.valueHandle() != check_char.valueHandle()) break;
+		finishCheckPhase(value);
+		break;
+	case PhaseRead:
+		if (characteristic.valueHandle() != read_char.valueHandle()) break;
+		read_latencies.append(timer.nsecsElapsed());
+		if (read_latencies.size() < reads) {
+			timer.start();
+			peripheral->readValue(read_char);
+		} else {
+			startNotifyPhase();
+		}
+		break;
+	case PhaseNotify:
+		notifications++;
+		if (!notify_sent.isEmpty()) {
+			notify_latencies.append(timer.nsecsElapsed() - notify_sent.dequeue());
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void Benchmark::handleNotificationSent()
+{
+	if (phase == PhaseNotify) {
+		notify_sent.enqueue(timer.nsecsElapsed());
+	}
+}
+
+void Benchmark::handleNotifyPhaseDone()
+{
+	qint64 elapsed = timer.elapsed();
+	server->setNotificationRate(0);
+
+	QTextStream out(stdout);
+	out << "notifications: " << notifications << " received, "
+	    << server->notificationsSent() << " sent, "
+	    << server->notificationsDropped() << " dropped by server, "
+	    << (elapsed > 0 ? notifications * 1000LL / elapsed : 0) << "/s" << endl;
+
+	if (!notify_latencies.isEmpty()) {
+		qint64 total = 0, min = notify_latencies.first(), max = min;
+		foreach (qint64 latency, notify_latencies) {
+			total += latency;
+			if (latency < min) min = latency;
+			if (latency > max) max = latency;
+		}
+		out << "notification latency: avg " << total / notify_latencies.size() / 1000
+		    << " us, min " << min / 1000 << " us, max " << max / 1000 << " us" << endl;
+	}
+
+	finish();
+}
+
+void Benchmark::startCheckPhase()
+{
+	QTextStream out(stdout);
+	out << "discovery: " << timer.nsecsElapsed() / 1000 << " us for "
+	    << server->attributeCount() << " attributes" << endl;
+
+	check_char = GatoCharacteristic();
+	foreach (const GatoService &service, peripheral->services()) {
+		foreach (const GatoCharacteristic &characteristic, service.characteristics()) {
+			const GatoCharacteristic::Properties props = characteristic.properties();
+			if ((props & GatoCharacteristic::PropertyRead) && (props & GatoCharacteristic::PropertyWrite)) {
+				check_char = characteristic;
+				break;
+			}
+		}
+		if (!check_char.isNull()) break;
+	}
+
+	if (check_char.isNull()) {
+		out << "long values: skipped, no readable and writable characteristic" << endl;
+		startReadPhase();
+		return;
+	}
+
+	// The longest value an attribute may have never fits in a single PDU,
+	// so this goes through Prepare Write and Read Blob whatever MTU was negotiated.
+	check_value.resize(512);
+	for (int i = 0; i < check_value.size(); i++) {
+		check_value[i] = char(i * 7);
+	}
+
+	phase = PhaseCheck;
+	peripheral->writeValue(check_char, check_value);
+	peripheral->readValue(check_char);
+}
+
+void Benchmark::finishCheckPhase(const QByteArray &value)
+{
+	QTextStream out(stdout);
+	if (value != check_value || server->value(check_char.valueHandle()) != check_value) {
+		out << "long values: FAILED, read back " << value.size() << " bytes of "
+		    << check_value.size() << " with an MTU of " << server->mtu() << endl;
+		check_failed = true;
+	} else if (server->largestRequest() > server->mtu()) {
+		out << "long values: FAILED, sent a " << server->largestRequest()
+		    << " byte request with an MTU of " << server->mtu() << endl;
+		check_failed = true;
+	} else {
+		out << "long values: ok with an MTU of " << server->mtu()
+		    << " (server offered " << server->serverMtu() << ")" << endl;
+	}
+
+	startReadPhase();
+}
+
+void Benchmark::startReadPhase()
+{
+	QTextStream out(stdout);
+
+	read_char = GatoCharacteristic();
+	foreach (const GatoService &service, peripheral->services()) {
+		foreach (const GatoCharacteristic &characteristic, service.characteristics()) {
+			if (characteristic.properties() & GatoCharacteristic::PropertyRead) {
+				read_char = characteristic;
+				break;
+			}
+		}
+		if (!read_char.isNull()) break;
+	}
+
+	if (read_char.isNull() || reads <= 0) {
+		out << "reads: skipped, no readable characteristic" << endl;
+		startNotifyPhase();
+		return;
+	}
+
+	phase = PhaseRead;
+	read_latencies.clear();
+	read_latencies.reserve(reads);
+	timer.start();
+	peripheral->readValue(read_char);
+}
+
+void Benchmark::startNotifyPhase()
+{
+	QTextStream out(stdout);
+
+	if (!read_latencies.isEmpty()) {
+		qint64 total = 0, min = read_latencies.first(), max = min;
+		foreach (qint64 latency, read_latencies) {
+			total += latency;
+			if (latency < min) min = latency;
+			if (latency > max) max = latency;
+		}
+		out << "reads: " << read_latencies.size() << " in " << total / 1000 << " us, latency avg "
+		    << total / read_latencies.size() / 1000 << " us, min " << min / 1000
+		    << " us, max " << max / 1000 << " us" << endl;
+	}
+
+	int subscribed = 0;
+	foreach (const GatoService &service, peripheral->services()) {
+		foreach (const GatoCharacteristic &characteristic, service.characteristics()) {
+			if (characteristic.properties() & GatoCharacteristic::PropertyNotify) {
+				peripheral->setNotification(characteristic, true);
+				subscribed++;
+			}
+		}
+	}
+
+	if (subscribed == 0 || notifyRate <= 0 || notifySeconds <= 0) {
+		out << "notifications: skipped, nothing to subscribe to" << endl;
+		finish();
+		return;
+	}
+
+	phase = PhaseNotify;
+	notifications = 0;
+	notify_sent.clear();
+	notify_latencies.clear();
+	timer.start();
+	server->setNotificationRate(notifyRate);
+	QTimer::singleShot(notifySeconds * 1000, this, SLOT(handleNotifyPhaseDone()));
+}
+
+void Benchmark::finish()
+{
+	phase = PhaseIdle;
+	peripheral->disconnectPeripheral();
+	emit finished();
+}
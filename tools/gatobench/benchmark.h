@@ -0,0 +1,99 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QObject>
+#include <QtCore/QQueue>
+#include <QtCore/QSet>
+#include <QtCore/QVector>
+
+#include "gatoperipheral.h"
+#include "gatoservice.h"
+#include "gatocharacteristic.h"
+
+class GatoFakeServer;
+class GatoLocalTransport;
+class GatoLinkEmulator;
+
+/** Drives a GatoPeripheral against an in-process GatoFakeServer and reports
+ *  discovery time, read latency, and notification throughput and latency.
+ *
+ *  Before measuring, it writes a maximum length value to the first readable and
+ *  writable characteristic and reads it back, and fails if it does not arrive
+ *  intact or a request was larger than the negotiated MTU. */
+class Benchmark : public QObject
+{
+	Q_OBJECT
+
+public:
+	Benchmark(GatoFakeServer *server, QObject *parent = 0);
+
+	int reads;
+	int notifyRate;
+	int notifySeconds;
+	/** Use GatoPeripheral::discoverAll() instead of discovering level by level. */
+	bool discoverAll;
+
+	/** Sits between the peripheral and the server; passes everything straight
+	 *  through unless given a connection interval. */
+	GatoLinkEmulator *link() const;
+
+	/** Whether the long value check failed. */
+	bool failed() const;
+
+public slots:
+	void start();
+
+signals:
+	void finished();
+
+private slots:
+	void handleConnected();
+	void handleDisconnected();
+	void handleServicesDiscovered();
+	void handleCharacteristicsDiscovered(const GatoService &service);
+	void handleDescriptorsDiscovered(const GatoCharacteristic &characteristic);
+	void handleDiscoveryFinished();
+	void handleValueUpdated(const GatoCharacteristic &characteristic, const QByteArray &value);
+	void handleNotificationSent();
+	void handleNotifyPhaseDone();
+
+private:
+	void startCheckPhase();
+	void finishCheckPhase(const QByteArray &value);
+	void startReadPhase();
+	void startNotifyPhase();
+	void finish();
+
+private:
+	enum Phase {
+		PhaseIdle,
+		PhaseDiscovery,
+		PhaseCheck,
+		PhaseRead,
+		PhaseNotify
+	};
+
+	GatoFakeServer *server;
+	GatoLocalTransport *transport;
+	GatoLinkEmulator *emulator;
+	GatoPeripheral *peripheral;
+	Phase phase;
+	QElapsedTimer timer;
+	int pending_services;
+	QSet<GatoHandle> pending_characteristics;
+
+	GatoCharacteristic check_char;
+	QByteArray check_value;
+	bool check_failed;
+
+	GatoCharacteristic read_char;
+	QVector<qint64> read_latencies;
+
+	int notifications;
+	/** When the server sent each notification not received yet; the link keeps them in order. */
+	QQueue<qint64> notify_sent;
+	QVector<qint64> notify_latencies;
+};
+
+#endif // BENCHMARK_H
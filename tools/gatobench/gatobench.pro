@@ -0,0 +1,22 @@
+TEMPLATE = app
+TARGET = gatobench
+
+QT -= gui
+
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+# Links against the library built in the top level directory, and uses
+# its internal headers (transports, ATT client). The fake server is built
+# here rather than shipped in the library.
+INCLUDEPATH += ../..
+LIBS += -L../.. -lgato
+
+SOURCES += main.cpp \
+    benchmark.cpp \
+    gatofakeserver.cpp
+
+HEADERS += benchmark.h \
+    gatofakeserver.h
+
+OTHER_FILES += heartrate.gatt
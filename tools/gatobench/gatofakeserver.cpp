@@ -0,0 +1,724 @@
+/*
+ *  libgato - A GATT/ATT library for use with Bluez
+ *
+ *  Copyright (C) 2013 Javier S. Pedro <maemo@javispedro.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <QtCore/QDebug>
+#include <QtCore/QFile>
+#include <QtCore/QStringList>
+#include <QtCore/QTextStream>
+
+#include "gatofakeserver.h"
+#include "gatolocaltransport.h"
+#include "gatoattclient.h"
+#include "gatocharacteristic.h"
+#include "helpers.h"
+
+#define ATT_DEFAULT_LE_MTU 23
+#define ATT_MAX_LE_MTU 0x200
+
+/** Timer period used to generate notifications; higher rates send several per tick. */
+#define NOTIFY_TICK_MSEC 1
+
+static QByteArray uuid_bytes(const GatoUUID &uuid)
+{
+	return gatouuid_to_bytearray(uuid, uuid.minimumSize() <= 2, false);
+}
+
+static GatoUUID parse_uuid(const QString &str, bool *ok)
+{
+	if (str.length() <= 4) {
+		return GatoUUID(quint16(str.toUShort(ok, 16)));
+	}
+
+	GatoUUID uuid(str);
+	*ok = !uuid.isNull();
+	return uuid;
+}
+
+static GatoUUID pdu_uuid(const QByteArray &pkt, int pos)
+{
+	return read_gatouuid(pkt.constData() + pos, pkt.size() - pos);
+}
+
+static GatoCharacteristic::Properties parse_properties(const QString &str, bool *ok)
+{
+	GatoCharacteristic::Properties props = 0;
+	*ok = true;
+
+	foreach (const QString &prop, str.split(',', QString::SkipEmptyParts)) {
+		if (prop == "broadcast") {
+			props |= GatoCharacteristic::PropertyBroadcast;
+		} else if (prop == "read") {
+			props |= GatoCharacteristic::PropertyRead;
+		} else if (prop == "write-without-response") {
+			props |= GatoCharacteristic::PropertyWriteWithoutResponse;
+		} else if (prop == "write") {
+			props |= GatoCharacteristic::PropertyWrite;
+		} else if (prop == "notify") {
+			props |= GatoCharacteristic::PropertyNotify;
+		} else if (prop == "indicate") {
+			props |= GatoCharacteristic::PropertyIndicate;
+		} else {
+			*ok = false;
+		}
+	}
+
+	return props;
+}
+
+GatoFakeServer::GatoFakeServer(QObject *parent)
+    : QObject(parent), link(new GatoLocalTransport(this)),
+      server_mtu(ATT_MAX_LE_MTU), cur_mtu(ATT_DEFAULT_LE_MTU), largest_request(0),
+      last_value_handle(0), notify_timer(new QTimer(this)), notify_rate(0), notify_next(0),
+      notify_started_count(0), notifications_sent(0), notifications_dropped(0), requests_handled(0)
+{
+	notify_timer->setInterval(NOTIFY_TICK_MSEC);
+
+	connect(link, SIGNAL(readyRead()), SLOT(handleReadyRead()));
+	connect(link, SIGNAL(disconnected()), SLOT(handleDisconnected()));
+	connect(notify_timer, SIGNAL(timeout()), SLOT(handleNotifyTimer()));
+}
+
+GatoFakeServer::~GatoFakeServer()
+{
+}
+
+bool GatoFakeServer::load(const QString &fileName)
+{
+	QFile file(fileName);
+	if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+		qWarning() << "Could not open" << fileName;
+		return false;
+	}
+
+	return load(&file);
+}
+
+bool GatoFakeServer::load(QIODevice *device)
+{
+	attributes.clear();
+	cccd_to_value.clear();
+	subscribed.clear();
+	last_value_handle = 0;
+
+	QTextStream stream(device);
+	int line_num = 0;
+	while (!stream.atEnd()) {
+		const QString line = stream.readLine();
+		line_num++;
+		if (!parseLine(line)) {
+			qWarning() << "Invalid attribute description at line" << line_num << ":" << line;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool GatoFakeServer::parseLine(const QString &line)
+{
+	const QStringList fields = line.section('#', 0, 0).simplified().split(' ', QString::SkipEmptyParts);
+	if (fields.isEmpty()) {
+		return true;
+	}
+
+	const QString &kind = fields[0];
+	bool ok = fields.size() >= 2;
+	GatoUUID uuid;
+	if (ok) {
+		uuid = parse_uuid(fields[1], &ok);
+	}
+	if (!ok) {
+		return false;
+	}
+
+	if (kind == "service" && fields.size() == 2) {
+		addAttribute(GatoUUID::GattPrimaryService, uuid_bytes(uuid));
+		last_value_handle = 0;
+		return true;
+	} else if (kind == "characteristic" && (fields.size() == 3 || fields.size() == 4)) {
+		if (attributes.isEmpty()) {
+			return false;
+		}
+
+		GatoCharacteristic::Properties props = parse_properties(fields[2], &ok);
+		if (!ok) {
+			return false;
+		}
+
+		const GatoHandle value_handle = attributes.size() + 2;
+		QByteArray decl(1 + sizeof(GatoHandle), Qt::Uninitialized);
+		decl[0] = char(props);
+		write_le<GatoHandle>(value_handle, decl.data() + 1);
+		decl.append(uuid_bytes(uuid));
+
+		addAttribute(GatoUUID::GattCharacteristic, decl);
+		addAttribute(uuid, fields.size() == 4 ? QByteArray::fromHex(fields[3].toLatin1()) : QByteArray());
+		last_value_handle = value_handle;
+		return true;
+	} else if (kind == "descriptor" && (fields.size() == 2 || fields.size() == 3)) {
+		if (!last_value_handle) {
+			return false;
+		}
+
+		GatoHandle handle = addAttribute(uuid, fields.size() == 3 ? QByteArray::fromHex(fields[2].toLatin1()) : QByteArray());
+		if (uuid == GatoUUID(GatoUUID::GattClientCharacteristicConfiguration)) {
+			cccd_to_value.insert(handle, last_value_handle);
+		}
+		return true;
+	}
+
+	return false;
+}
+
+GatoHandle GatoFakeServer::addAttribute(const GatoUUID &type, const QByteArray &value)
+{
+	Attribute attr;
+	attr.type = type;
+	attr.value = value;
+	attr.group_end = 0;
+	attributes.append(attr);
+
+	const GatoHandle handle = attributes.size();
+
+	// Grow the group of the service this attribute belongs to.
+	for (int i = attributes.size() - 1; i >= 0; i--) {
+		if (attributes[i].type == GatoUUID(GatoUUID::GattPrimaryService)) {
+			attributes[i].group_end = handle;
+			break;
+		}
+	}
+
+	return handle;
+}
+
+bool GatoFakeServer::serve(int fd)
+{
+	if (!link->open(fd)) {
+		return false;
+	}
+
+	cur_mtu = ATT_DEFAULT_LE_MTU;
+	largest_request = 0;
+	prepared_writes.clear();
+	subscribed.clear();
+	return true;
+}
+
+int GatoFakeServer::serverMtu() const
+{
+	return server_mtu;
+}
+
+void GatoFakeServer::setServerMtu(int mtu)
+{
+	server_mtu = qBound(ATT_DEFAULT_LE_MTU, mtu, 0xFFFF);
+}
+
+int GatoFakeServer::mtu() const
+{
+	return cur_mtu;
+}
+
+int GatoFakeServer::largestRequest() const
+{
+	return largest_request;
+}
+
+void GatoFakeServer::close()
+{
+	link->close();
+}
+
+int GatoFakeServer::attributeCount() const
+{
+	return attributes.size();
+}
+
+QByteArray GatoFakeServer::value(GatoHandle handle) const
+{
+	const Attribute *attr = attribute(handle);
+	return attr ? attr->value : QByteArray();
+}
+
+void GatoFakeServer::setValue(GatoHandle handle, const QByteArray &value)
+{
+	if (attribute(handle)) {
+		attributes[handle - 1].value = value;
+	}
+}
+
+void GatoFakeServer::setNotificationRate(int per_second)
+{
+	notify_rate = per_second;
+	notify_started_count = notifications_sent + notifications_dropped;
+	notify_clock.start();
+
+	if (notify_rate > 0) {
+		notify_timer->start();
+	} else {
+		notify_timer->stop();
+	}
+}
+
+int GatoFakeServer::notificationsSent() const
+{
+	return notifications_sent;
+}
+
+int GatoFakeServer::notificationsDropped() const
+{
+	return notifications_dropped;
+}
+
+int GatoFakeServer::requestsHandled() const
+{
+	return requests_handled;
+}
+
+const GatoFakeServer::Attribute *GatoFakeServer::attribute(GatoHandle handle) const
+{
+	if (handle == 0 || handle > attributes.size()) {
+		return 0;
+	}
+	return &attributes.at(handle - 1);
+}
+
+void GatoFakeServer::storeValue(GatoHandle handle, const QByteArray &value)
+{
+	attributes[handle - 1].value = value;
+
+	GatoHandle value_handle = cccd_to_value.value(handle);
+	if (value_handle) {
+		const bool notify = value.size() >= 1 && (value[0] & 0x1);
+		if (notify && !subscribed.contains(value_handle)) {
+			subscribed.append(value_handle);
+		} else if (!notify) {
+			subscribed.removeAll(value_handle);
+		}
+	}
+}
+
+QByteArray GatoFakeServer::errorResponse(quint8 req_opcode, GatoHandle handle, quint8 error)
+{
+	QByteArray pkt(5, Qt::Uninitialized);
+	pkt[0] = AttOpErrorResponse;
+	pkt[1] = req_opcode;
+	write_le<GatoHandle>(handle, pkt.data() + 2);
+	pkt[4] = error;
+	return pkt;
+}
+
+void GatoFakeServer::handleReadyRead()
+{
+	QByteArray pkt;
+	while (!(pkt = link->receive()).isEmpty()) {
+		handleRequest(pkt);
+		link->recycle(pkt);
+	}
+}
+
+void GatoFakeServer::handleDisconnected()
+{
+	notify_timer->stop();
+	emit disconnected();
+}
+
+void GatoFakeServer::handleRequest(const QByteArray &pkt)
+{
+	const quint8 opcode = pkt[0];
+	QByteArray response;
+
+	largest_request = qMax(largest_request, pkt.size());
+
+	switch (opcode) {
+	case AttOpExchangeMTURequest:
+		if (pkt.size() < 3) {
+			response = errorResponse(opcode, 0, GatoAttClient::ErrorInvalidPdu);
+		} else {
+			cur_mtu = qBound<int>(ATT_DEFAULT_LE_MTU, read_le<quint16>(pkt.constData() + 1), server_mtu);
+			response.resize(3);
+			response[0] = AttOpExchangeMTUResponse;
+			write_le<quint16>(server_mtu, response.data() + 1);
+		}
+		break;
+	case AttOpReadByGroupTypeRequest:
+		response = handleReadByGroupType(pkt);
+		break;
+	case AttOpReadByTypeRequest:
+		response = handleReadByType(pkt);
+		break;
+	case AttOpFindInformationRequest:
+		response = handleFindInformation(pkt);
+		break;
+	case AttOpFindByTypeValueRequest:
+		response = handleFindByTypeValue(pkt);
+		break;
+	case AttOpReadRequest:
+		response = handleRead(pkt);
+		break;
+	case AttOpReadBlobRequest:
+		response = handleReadBlob(pkt);
+		break;
+	case AttOpWriteRequest:
+		response = handleWrite(pkt, true);
+		break;
+	case AttOpWriteCommand:
+		handleWrite(pkt, false);
+		break;
+	case AttOpPrepareWriteRequest:
+		response = handlePrepareWrite(pkt);
+		break;
+	case AttOpExecuteWriteRequest:
+		response = handleExecuteWrite(pkt);
+		break;
+	case AttOpHandleValueConfirmation:
+		break;
+	default:
+		if (opcode & 0x40) {
+			// Unknown commands are ignored
+			break;
+		}
+		response = errorResponse(opcode, 0, GatoAttClient::ErrorRequestNotSupported);
+		break;
+	}
+
+	requests_handled++;
+
+	if (!response.isEmpty()) {
+		link->send(response);
+	}
+}
+
+QByteArray GatoFakeServer::handleReadByGroupType(const QByteArray &pkt)
+{
+	if (pkt.size() != 7 && pkt.size() != 21) {
+		return errorResponse(pkt[0], 0, GatoAttClient::ErrorInvalidPdu);
+	}
+
+	const GatoHandle start = read_le<GatoHandle>(pkt.constData() + 1);
+	const GatoHandle end = read_le<GatoHandle>(pkt.constData() + 3);
+	const GatoUUID type = pdu_uuid(pkt, 5);
+
+	if (start == 0 || start > end) {
+		return errorResponse(pkt[0], start, GatoAttClient::ErrorInvalidHandle);
+	}
+	if (type != GatoUUID(GatoUUID::GattPrimaryService)) {
+		return errorResponse(pkt[0], start, GatoAttClient::ErrorUnsupportedGroupType);
+	}
+
+	QByteArray response(2, Qt::Uninitialized);
+	response[0] = AttOpReadByGroupTypeResponse;
+	int item_len = 0;
+
+	for (int handle = start; handle <= end && handle <= attributes.size(); handle++) {
+		const Attribute &attr = attributes.at(handle - 1);
+		if (attr.type != type) {
+			continue;
+		}
+
+		const int len = 4 + attr.value.size();
+		if (item_len == 0) {
+			item_len = len;
+		} else if (len != item_len) {
+			break;
+		}
+		if (response.size() + len > cur_mtu) {
+			break;
+		}
+
+		QByteArray item(4, Qt::Uninitialized);
+		write_le<GatoHandle>(handle, item.data());
+		write_le<GatoHandle>(attr.group_end, item.data() + 2);
+		response.append(item);
+		response.append(attr.value);
+	}
+
+	if (item_len == 0) {
+		return errorResponse(pkt[0], start, GatoAttClient::ErrorAttributeNotFound);
+	}
+
+	response[1] = item_len;
+	return response;
+}
+
+QByteArray GatoFakeServer::handleReadByType(const QByteArray &pkt)
+{
+	if (pkt.size() != 7 && pkt.size() != 21) {
+		return errorResponse(pkt[0], 0, GatoAttClient::ErrorInvalidPdu);
+	}
+
+	const GatoHandle start = read_le<GatoHandle>(pkt.constData() + 1);
+	const GatoHandle end = read_le<GatoHandle>(pkt.constData() + 3);
+	const GatoUUID type = pdu_uuid(pkt, 5);
+
+	if (start == 0 || start > end) {
+		return errorResponse(pkt[0], start, GatoAttClient::ErrorInvalidHandle);
+	}
+
+	QByteArray response(2, Qt::Uninitialized);
+	response[0] = AttOpReadByTypeResponse;
+	int item_len = 0;
+
+	for (int handle = start; handle <= end && handle <= attributes.size(); handle++) {
+		const Attribute &attr = attributes.at(handle - 1);
+		if (attr.type != type) {
+			continue;
+		}
+
+		// Values that do not fit are truncated, as with a Read Request
+		const int len = 2 + qMin(attr.value.size(), qMin(cur_mtu - 4, 253));
+		if (item_len == 0) {
+			item_len = len;
+		} else if (len != item_len) {
+			break;
+		}
+		if (response.size() + len > cur_mtu) {
+			break;
+		}
+
+		QByteArray item(2, Qt::Uninitialized);
+		write_le<GatoHandle>(handle, item.data());
+		response.append(item);
+		response.append(attr.value.constData(), len - 2);
+	}
+
+	if (item_len == 0) {
+		return errorResponse(pkt[0], start, GatoAttClient::ErrorAttributeNotFound);
+	}
+
+	response[1] = item_len;
+	return response;
+}
+
+QByteArray GatoFakeServer::handleFindInformation(const QByteArray &pkt)
+{
+	if (pkt.size() != 5) {
+		return errorResponse(pkt[0], 0, GatoAttClient::ErrorInvalidPdu);
+	}
+
+	const GatoHandle start = read_le<GatoHandle>(pkt.constData() + 1);
+	const GatoHandle end = read_le<GatoHandle>(pkt.constData() + 3);
+
+	if (start == 0 || start > end) {
+		return errorResponse(pkt[0], start, GatoAttClient::ErrorInvalidHandle);
+	}
+
+	QByteArray response(2, Qt::Uninitialized);
+	response[0] = AttOpFindInformationResponse;
+	int format = 0;
+
+	for (int handle = start; handle <= end && handle <= attributes.size(); handle++) {
+		const QByteArray uuid = uuid_bytes(attributes.at(handle - 1).type);
+		const int item_format = uuid.size() == 2 ? 1 : 2;
+		if (format == 0) {
+			format = item_format;
+		} else if (item_format != format) {
+			break;
+		}
+		if (response.size() + 2 + uuid.size() > cur_mtu) {
+			break;
+		}
+
+		QByteArray item(2, Qt::Uninitialized);
+		write_le<GatoHandle>(handle, item.data());
+		response.append(item);
+		response.append(uuid);
+	}
+
+	if (format == 0) {
+		return errorResponse(pkt[0], start, GatoAttClient::ErrorAttributeNotFound);
+	}
+
+	response[1] = format;
+	return response;
+}
+
+QByteArray GatoFakeServer::handleFindByTypeValue(const QByteArray &pkt)
+{
+	if (pkt.size() < 7) {
+		return errorResponse(pkt[0], 0, GatoAttClient::ErrorInvalidPdu);
+	}
+
+	const GatoHandle start = read_le<GatoHandle>(pkt.constData() + 1);
+	const GatoHandle end = read_le<GatoHandle>(pkt.constData() + 3);
+	const GatoUUID type(read_le<quint16>(pkt.constData() + 5));
+	const QByteArray value = pkt.mid(7);
+
+	if (start == 0 || start > end) {
+		return errorResponse(pkt[0], start, GatoAttClient::ErrorInvalidHandle);
+	}
+
+	QByteArray response(1, AttOpFindByTypeValueResponse);
+
+	for (int handle = start; handle <= end && handle <= attributes.size(); handle++) {
+		const Attribute &attr = attributes.at(handle - 1);
+		if (attr.type != type || attr.value != value) {
+			continue;
+		}
+		if (response.size() + 4 > cur_mtu) {
+			break;
+		}
+
+		QByteArray item(4, Qt::Uninitialized);
+		write_le<GatoHandle>(handle, item.data());
+		write_le<GatoHandle>(attr.group_end ? attr.group_end : handle, item.data() + 2);
+		response.append(item);
+	}
+
+	if (response.size() == 1) {
+		return errorResponse(pkt[0], start, GatoAttClient::ErrorAttributeNotFound);
+	}
+
+	return response;
+}
+
+QByteArray GatoFakeServer::handleRead(const QByteArray &pkt)
+{
+	if (pkt.size() != 3) {
+		return errorResponse(pkt[0], 0, GatoAttClient::ErrorInvalidPdu);
+	}
+
+	const GatoHandle handle = read_le<GatoHandle>(pkt.constData() + 1);
+	const Attribute *attr = attribute(handle);
+	if (!attr) {
+		return errorResponse(pkt[0], handle, GatoAttClient::ErrorInvalidHandle);
+	}
+
+	QByteArray response(1, AttOpReadResponse);
+	response.append(attr->value.constData(), qMin(attr->value.size(), cur_mtu - 1));
+	return response;
+}
+
+QByteArray GatoFakeServer::handleReadBlob(const QByteArray &pkt)
+{
+	if (pkt.size() != 5) {
+		return errorResponse(pkt[0], 0, GatoAttClient::ErrorInvalidPdu);
+	}
+
+	const GatoHandle handle = read_le<GatoHandle>(pkt.constData() + 1);
+	const int offset = read_le<quint16>(pkt.constData() + 3);
+	const Attribute *attr = attribute(handle);
+	if (!attr) {
+		return errorResponse(pkt[0], handle, GatoAttClient::ErrorInvalidHandle);
+	}
+	if (offset > attr->value.size()) {
+		return errorResponse(pkt[0], handle, GatoAttClient::ErrorInvalidOffset);
+	}
+
+	QByteArray response(1, AttOpReadBlobResponse);
+	response.append(attr->value.constData() + offset, qMin(attr->value.size() - offset, cur_mtu - 1));
+	return response;
+}
+
+QByteArray GatoFakeServer::handleWrite(const QByteArray &pkt, bool respond)
+{
+	if (pkt.size() < 3) {
+		return respond ? errorResponse(pkt[0], 0, GatoAttClient::ErrorInvalidPdu) : QByteArray();
+	}
+
+	const GatoHandle handle = read_le<GatoHandle>(pkt.constData() + 1);
+	if (!attribute(handle)) {
+		return respond ? errorResponse(pkt[0], handle, GatoAttClient::ErrorInvalidHandle) : QByteArray();
+	}
+
+	storeValue(handle, pkt.mid(3));
+
+	return respond ? QByteArray(1, AttOpWriteResponse) : QByteArray();
+}
+
+QByteArray GatoFakeServer::handlePrepareWrite(const QByteArray &pkt)
+{
+	if (pkt.size() < 5) {
+		return errorResponse(pkt[0], 0, GatoAttClient::ErrorInvalidPdu);
+	}
+
+	PreparedWrite write;
+	write.handle = read_le<GatoHandle>(pkt.constData() + 1);
+	write.offset = read_le<quint16>(pkt.constData() + 3);
+	write.value = pkt.mid(5);
+
+	if (!attribute(write.handle)) {
+		return errorResponse(pkt[0], write.handle, GatoAttClient::ErrorInvalidHandle);
+	}
+
+	prepared_writes.append(write);
+
+	// Echo the request back
+	QByteArray response = pkt;
+	response[0] = AttOpPrepareWriteResponse;
+	return response;
+}
+
+QByteArray GatoFakeServer::handleExecuteWrite(const QByteArray &pkt)
+{
+	if (pkt.size() != 2) {
+		return errorResponse(pkt[0], 0, GatoAttClient::ErrorInvalidPdu);
+	}
+
+	if (pkt[1]) {
+		// Check every fragment before applying any of them
+		foreach (const PreparedWrite &write, prepared_writes) {
+			if (write.offset > attribute(write.handle)->value.size()) {
+				prepared_writes.clear();
+				return errorResponse(pkt[0], write.handle, GatoAttClient::ErrorInvalidOffset);
+			}
+		}
+		foreach (const PreparedWrite &write, prepared_writes) {
+			QByteArray value = attribute(write.handle)->value;
+			value.resize(write.offset);
+			value.append(write.value);
+			storeValue(write.handle, value);
+		}
+	}
+
+	prepared_writes.clear();
+
+	return QByteArray(1, AttOpExecuteWriteResponse);
+}
+
+void GatoFakeServer::handleNotifyTimer()
+{
+	if (subscribed.isEmpty() || link->state() != GatoTransport::StateConnected) {
+		return;
+	}
+
+	const qint64 due = notify_started_count + notify_rate * notify_clock.elapsed() / 1000;
+
+	while (notifications_sent + notifications_dropped < due) {
+		if (notify_next >= subscribed.size()) {
+			notify_next = 0;
+		}
+		const GatoHandle handle = subscribed.at(notify_next++);
+		const QByteArray &value = attributes.at(handle - 1).value;
+
+		if (!link->canWrite()) {
+			notifications_dropped++;
+			continue;
+		}
+
+		QByteArray pkt(3, Qt::Uninitialized);
+		pkt[0] = AttOpHandleValueNotification;
+		write_le<GatoHandle>(handle, pkt.data() + 1);
+		pkt.append(value.constData(), qMin(value.size(), cur_mtu - 3));
+		link->send(pkt);
+		notifications_sent++;
+		emit notificationSent();
+	}
+}
@@ -0,0 +1,135 @@
+#ifndef GATOFAKESERVER_H
+#define GATOFAKESERVER_H
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
+#include <QtCore/QObject>
+#include <QtCore/QTimer>
+#include <QtCore/QVector>
+
+#include "gatouuid.h"
+
+class QIODevice;
+class GatoLocalTransport;
+
+/** An ATT server answering from an in-memory attribute database, to test and
+ *  benchmark the client side against a local transport without any radio.
+ *
+ *  The database is loaded from a text description, one attribute per line,
+ *  with handles assigned in order:
+ *
+ *      # Heart rate
+ *      service 180d
+ *        characteristic 2a37 read,notify 0064
+ *          descriptor 2902 0000
+ *        characteristic 2a38 read 01
+ *
+ *  UUIDs are either 16 bit hex numbers or full 128 bit UUIDs, values are hex.
+ *  Characteristic properties are a comma separated list of: broadcast, read,
+ *  write-without-response, write, notify, indicate. */
+class GatoFakeServer : public QObject
+{
+	Q_OBJECT
+
+public:
+	explicit GatoFakeServer(QObject *parent = 0);
+	~GatoFakeServer();
+
+	bool load(const QString &fileName);
+	bool load(QIODevice *device);
+
+	/** Starts answering requests coming over fd (see GatoLocalTransport::takePeerDescriptor()),
+	 *  taking ownership of it. */
+	bool serve(int fd);
+	void close();
+
+	/** Receive MTU given in Exchange MTU responses; the MTU in use is the smaller
+	 *  of this and the client's. */
+	int serverMtu() const;
+	void setServerMtu(int mtu);
+	/** MTU negotiated with the current client. */
+	int mtu() const;
+	/** Size of the largest request received, to check the client keeps to the MTU. */
+	int largestRequest() const;
+
+	int attributeCount() const;
+	QByteArray value(GatoHandle handle) const;
+	void setValue(GatoHandle handle, const QByteArray &value);
+
+	/** Sends this many notifications per second, spread over all characteristics
+	 *  whose notifications the client enabled; 0 stops. */
+	void setNotificationRate(int per_second);
+	int notificationsSent() const;
+	/** Notifications skipped because the link was above its high water mark. */
+	int notificationsDropped() const;
+	int requestsHandled() const;
+
+signals:
+	void disconnected();
+	/** Emitted as each generated notification is handed to the link. */
+	void notificationSent();
+
+private:
+	struct Attribute
+	{
+		GatoUUID type;
+		QByteArray value;
+		/** Last handle of the group for service declarations. */
+		GatoHandle group_end;
+	};
+
+	struct PreparedWrite
+	{
+		GatoHandle handle;
+		int offset;
+		QByteArray value;
+	};
+
+	bool parseLine(const QString &line);
+	GatoHandle addAttribute(const GatoUUID &type, const QByteArray &value);
+
+	void handleRequest(const QByteArray &pkt);
+	QByteArray handleReadByGroupType(const QByteArray &pkt);
+	QByteArray handleReadByType(const QByteArray &pkt);
+	QByteArray handleFindInformation(const QByteArray &pkt);
+	QByteArray handleFindByTypeValue(const QByteArray &pkt);
+	QByteArray handleRead(const QByteArray &pkt);
+	QByteArray handleReadBlob(const QByteArray &pkt);
+	QByteArray handleWrite(const QByteArray &pkt, bool respond);
+	QByteArray handlePrepareWrite(const QByteArray &pkt);
+	QByteArray handleExecuteWrite(const QByteArray &pkt);
+
+	const Attribute *attribute(GatoHandle handle) const;
+	void storeValue(GatoHandle handle, const QByteArray &value);
+
+	static QByteArray errorResponse(quint8 req_opcode, GatoHandle handle, quint8 error);
+
+private slots:
+	void handleReadyRead();
+	void handleDisconnected();
+	void handleNotifyTimer();
+
+private:
+	GatoLocalTransport *link;
+	quint16 server_mtu;
+	quint16 cur_mtu;
+	int largest_request;
+	QVector<Attribute> attributes;
+	/** Value handle of the last characteristic loaded, to link its CCCD to. */
+	GatoHandle last_value_handle;
+	QList<PreparedWrite> prepared_writes;
+	/** Value handles the client enabled notifications for. */
+	QList<GatoHandle> subscribed;
+	QHash<GatoHandle, GatoHandle> cccd_to_value;
+
+	QTimer *notify_timer;
+	QElapsedTimer notify_clock;
+	int notify_rate;
+	int notify_next;
+	qint64 notify_started_count;
+	int notifications_sent;
+	int notifications_dropped;
+	int requests_handled;
+};
+
+#endif // GATOFAKESERVER_H
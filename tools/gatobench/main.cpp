@@ -0,0 +1,112 @@
+/*
+ *  libgato - A GATT/ATT library for use with Bluez
+ *
+ *  Copyright (C) 2013 Javier S. Pedro <maemo@javispedro.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QStringList>
+#include <QtCore/QTextStream>
+#include <QtCore/QTimer>
+
+#include "gatofakeserver.h"
+#include "gatolinkemulator.h"
+#include "benchmark.h"
+
+static void usage()
+{
+	QTextStream err(stderr);
+	err << "Usage: gatobench <description> [--reads N] [--rate HZ] [--seconds S] [--discover-all]\n"
+	       "                 [--interval MS] [--packets N] [--link-mtu BYTES]\n"
+	       "                 [--bandwidth BYTES/S] [--jitter MS] [--server-mtu BYTES]" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+	QStringList args = app.arguments();
+	QString description;
+	int reads = 1000, rate = 1000, seconds = 5;
+	bool discover_all = false;
+	int interval = 0, packets = 6, link_mtu = 27, bandwidth = 0, jitter = 0;
+	// Larger than the client's on purpose, as many phones do.
+	int server_mtu = 517;
+
+	for (int i = 1; i < args.size(); i++) {
+		const QString &arg = args.at(i);
+		bool ok = true;
+		if (arg == "--reads" && i + 1 < args.size()) {
+			reads = args.at(++i).toInt(&ok);
+		} else if (arg == "--rate" && i + 1 < args.size()) {
+			rate = args.at(++i).toInt(&ok);
+		} else if (arg == "--seconds" && i + 1 < args.size()) {
+			seconds = args.at(++i).toInt(&ok);
+		} else if (arg == "--discover-all") {
+			discover_all = true;
+		} else if (arg == "--interval" && i + 1 < args.size()) {
+			interval = args.at(++i).toInt(&ok);
+		} else if (arg == "--packets" && i + 1 < args.size()) {
+			packets = args.at(++i).toInt(&ok);
+		} else if (arg == "--link-mtu" && i + 1 < args.size()) {
+			link_mtu = args.at(++i).toInt(&ok);
+		} else if (arg == "--bandwidth" && i + 1 < args.size()) {
+			bandwidth = args.at(++i).toInt(&ok);
+		} else if (arg == "--jitter" && i + 1 < args.size()) {
+			jitter = args.at(++i).toInt(&ok);
+		} else if (arg == "--server-mtu" && i + 1 < args.size()) {
+			server_mtu = args.at(++i).toInt(&ok);
+		} else if (!arg.startsWith("--") && description.isEmpty()) {
+			description = arg;
+		} else {
+			ok = false;
+		}
+		if (!ok) {
+			usage();
+			return 1;
+		}
+	}
+
+	if (description.isEmpty()) {
+		usage();
+		return 1;
+	}
+
+	GatoFakeServer server;
+	if (!server.load(description)) {
+		QTextStream(stderr) << "Could not load " << description << endl;
+		return 1;
+	}
+	server.setServerMtu(server_mtu);
+
+	Benchmark bench(&server);
+	bench.reads = reads;
+	bench.notifyRate = rate;
+	bench.notifySeconds = seconds;
+	bench.discoverAll = discover_all;
+	bench.link()->setConnectionInterval(interval);
+	bench.link()->setPacketsPerEvent(packets);
+	bench.link()->setLinkMtu(link_mtu);
+	bench.link()->setBandwidth(bandwidth);
+	bench.link()->setJitter(jitter);
+	QObject::connect(&bench, SIGNAL(finished()), &app, SLOT(quit()));
+	QTimer::singleShot(0, &bench, SLOT(start()));
+
+	app.exec();
+
+	return bench.failed() ? 2 : 0;
+}
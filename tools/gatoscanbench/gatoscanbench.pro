@@ -0,0 +1,17 @@
+TEMPLATE = app
+TARGET = gatoscanbench
+
+QT -= gui
+
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+# Links against the library built in the top level directory, and uses
+# its internal headers (EIR constants).
+INCLUDEPATH += ../..
+LIBS += -L../.. -lgato
+
+SOURCES += main.cpp \
+    scanbench.cpp
+
+HEADERS += scanbench.h
@@ -0,0 +1,100 @@
+/*
+ *  libgato - A GATT/ATT library for use with Bluez
+ *
+ *  Copyright (C) 2013 Javier S. Pedro <maemo@javispedro.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QStringList>
+#include <QtCore/QTextStream>
+#include <QtCore/QTimer>
+
+#include "scanbench.h"
+
+static void usage()
+{
+	QTextStream err(stderr);
+	err << "Usage: gatoscanbench [--rate N] [--seconds S] [--devices N] [--batch N]\n"
+	       "                     [--churn FRACTION] [--duplicates FRACTION]\n"
+	       "                     [--mix name,uuid16,uuid128,manufacturer] [--filter] [--peripherals]\n"
+	       "A rate of 0 floods the manager as fast as it takes reports." << endl;
+}
+
+static bool parse_mix(const QString &arg, QList<ScanBench::PayloadKind> *mix)
+{
+	mix->clear();
+	foreach (const QString &kind, arg.split(',')) {
+		if (kind == "name") {
+			mix->append(ScanBench::PayloadName);
+		} else if (kind == "uuid16") {
+			mix->append(ScanBench::PayloadUUID16);
+		} else if (kind == "uuid128") {
+			mix->append(ScanBench::PayloadUUID128);
+		} else if (kind == "manufacturer") {
+			mix->append(ScanBench::PayloadManufacturer);
+		} else {
+			return false;
+		}
+	}
+	return !mix->isEmpty();
+}
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+	QStringList args = app.arguments();
+	ScanBench bench;
+
+	for (int i = 1; i < args.size(); i++) {
+		const QString &arg = args.at(i);
+		bool ok = true;
+		if (arg == "--rate" && i + 1 < args.size()) {
+			bench.rate = args.at(++i).toInt(&ok);
+		} else if (arg == "--seconds" && i + 1 < args.size()) {
+			bench.seconds = args.at(++i).toInt(&ok);
+		} else if (arg == "--devices" && i + 1 < args.size()) {
+			bench.devices = args.at(++i).toInt(&ok);
+		} else if (arg == "--batch" && i + 1 < args.size()) {
+			bench.batch = args.at(++i).toInt(&ok);
+		} else if (arg == "--churn" && i + 1 < args.size()) {
+			bench.churn = args.at(++i).toDouble(&ok);
+		} else if (arg == "--duplicates" && i + 1 < args.size()) {
+			bench.duplicates = args.at(++i).toDouble(&ok);
+		} else if (arg == "--mix" && i + 1 < args.size()) {
+			ok = parse_mix(args.at(++i), &bench.mix);
+		} else if (arg == "--filter") {
+			bench.filter = true;
+		} else if (arg == "--peripherals") {
+			bench.peripherals = true;
+		} else {
+			ok = false;
+		}
+		if (!ok) {
+			usage();
+			return 1;
+		}
+	}
+
+	QObject::connect(&bench, SIGNAL(finished()), &app, SLOT(quit()));
+	QTimer::singleShot(0, &bench, SLOT(start()));
+
+	app.exec();
+
+	return bench.failed() ? 2 : 0;
+}
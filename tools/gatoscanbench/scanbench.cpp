@@ -0,0 +1,356 @@
+/*
+ *  libgato - A GATT/ATT library for use with Bluez
+ *
+ *  Copyright (C) 2013 Javier S. Pedro <maemo@javispedro.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include <QtCore/QDebug>
+#include <QtCore/QFile>
+#include <QtCore/QTextStream>
+#include <QtCore/QTimer>
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "gatoperipheral.h"
+#include "helpers.h"
+#include "scanbench.h"
+
+static const int max_batch = 6;
+
+ScanBench::ScanBench(QObject *parent) :
+	GatoCentralManager(parent), rate(10000), seconds(5), devices(200), batch(1),
+	churn(0.0), duplicates(0.9), filter(false), peripherals(false),
+	gen_fd(-1), gen_timer(new QTimer(this)), rng(Q_UINT64_C(0x853C49E6748FEA9B)),
+	stopping(false), sent_reports(0), received_reports(0), unexpected_reports(0),
+	last_public(0), lookup_failed(false), stalls(0), run_nsecs(0), latency_max(0), rss_start(0)
+{
+	mix << PayloadName << PayloadUUID16 << PayloadUUID128 << PayloadManufacturer;
+	memset(latency_buckets, 0, sizeof(latency_buckets));
+
+	gen_timer->setTimerType(Qt::PreciseTimer);
+	connect(gen_timer, SIGNAL(timeout()), SLOT(generate()));
+}
+
+ScanBench::~ScanBench()
+{
+	if (gen_fd != -1) ::close(gen_fd);
+}
+
+bool ScanBench::failed() const
+{
+	return unexpected_reports > 0 || !pending.isEmpty() || lookup_failed;
+}
+
+void ScanBench::start()
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0) {
+		qErrnoWarning("Could not create the stand-in HCI socket");
+		emit finished();
+		return;
+	}
+	gen_fd = fds[0];
+
+	QList<GatoUUID> uuids;
+	if (filter) uuids << GatoUUID(quint16(0x180D));
+
+	if (peripherals) {
+		connect(this, SIGNAL(discoveredPeripheral(GatoPeripheral*,quint8,int)),
+		        SLOT(handlePeripheral(GatoPeripheral*,quint8,int)));
+	} else {
+		connect(this, SIGNAL(discoveredAdvertisement(GatoAddress,quint8,int)),
+		        SLOT(handleAdvertisement(GatoAddress,quint8,int)));
+	}
+
+	scanFromSocket(fds[1], uuids);
+
+	batch = qBound(1, batch, max_batch);
+	if (mix.isEmpty()) mix << PayloadName;
+	device_table.resize(qMax(1, devices));
+	for (int i = 0; i < device_table.size(); i++) {
+		device_table[i].is_public = i % 2;
+		device_table[i].addr = device_table[i].is_public ? publicAddress() : randomAddress();
+		device_table[i].kind = mix.at(i % mix.size());
+		device_table[i].variant = 0;
+	}
+
+	rss_start = residentBytes();
+	clock.start();
+	gen_timer->start(rate > 0 ? 1 : 0);
+	QTimer::singleShot(seconds * 1000, this, SLOT(finish()));
+}
+
+void ScanBench::generate()
+{
+	if (stopping) return;
+
+	// Reports the target rate asks for by now; when flooding, just a good chunk.
+	qint64 due = rate > 0 ? qint64(rate) * clock.nsecsElapsed() / 1000000000 - sent_reports
+	                      : 64 * batch;
+
+	while (due > 0) {
+		quint8 buf[HCI_MAX_EVENT_SIZE];
+		Pending passing[max_batch];
+		int num_passing = 0;
+		int num_reports = int(qMin<qint64>(due, batch));
+
+		buf[0] = HCI_EVENT_PKT;
+		buf[1] = EVT_LE_META_EVENT;
+		buf[3] = EVT_LE_ADVERTISING_REPORT;
+		buf[4] = num_reports;
+		int pos = 5;
+
+		for (int r = 0; r < num_reports; r++) {
+			const int i = int(random() % device_table.size());
+			Device &dev = device_table[i];
+
+			if (churn > 0 && random() % 1000000 < quint64(churn * 1000000)) {
+				dev.addr = dev.is_public ? publicAddress() : randomAddress();
+			}
+			if (random() % 1000000 >= quint64(duplicates * 1000000)) {
+				dev.variant++;
+			}
+
+			le_advertising_info *info = reinterpret_cast<le_advertising_info*>(&buf[pos]);
+			info->evt_type = 0; // ADV_IND
+			info->bdaddr_type = dev.is_public ? 0 : 1;
+			GatoAddress(dev.addr).toUInt8Array(info->bdaddr.b);
+			if (dev.is_public) last_public = dev.addr;
+			info->length = buildPayload(info->data, i, dev);
+			pos += LE_ADVERTISING_INFO_SIZE + info->length;
+			buf[pos++] = quint8(-40 - int(random() % 60)); // RSSI
+
+			if (!filter || dev.kind == PayloadUUID16) {
+				passing[num_passing].addr = dev.addr;
+				num_passing++;
+			}
+		}
+
+		buf[2] = pos - (1 + HCI_EVENT_HDR_SIZE);
+
+		if (::send(gen_fd, buf, pos, MSG_DONTWAIT) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				// The manager is not keeping up; try again on the next tick.
+				stalls++;
+			} else {
+				qErrnoWarning("Could not write to the stand-in HCI socket");
+			}
+			return;
+		}
+
+		const qint64 now = clock.nsecsElapsed();
+		for (int p = 0; p < num_passing; p++) {
+			passing[p].sent = now;
+			pending.enqueue(passing[p]);
+		}
+
+		sent_reports += num_reports;
+		due -= num_reports;
+	}
+}
+
+void ScanBench::handleAdvertisement(const GatoAddress &address, quint8 advertType, int rssi)
+{
+	Q_UNUSED(advertType);
+	Q_UNUSED(rssi);
+	received(address);
+}
+
+void ScanBench::handlePeripheral(GatoPeripheral *peripheral, quint8 advertType, int rssi)
+{
+	Q_UNUSED(advertType);
+	Q_UNUSED(rssi);
+	received(peripheral->address());
+}
+
+void ScanBench::received(const GatoAddress &address)
+{
+	if (pending.isEmpty() || pending.head().addr != address.toUInt64()) {
+		unexpected_reports++;
+		return;
+	}
+
+	const Pending p = pending.dequeue();
+	const qint64 usecs = (clock.nsecsElapsed() - p.sent) / 1000;
+	int bucket = 0;
+	while (bucket < 31 && (Q_INT64_C(1) << bucket) <= usecs) bucket++;
+	latency_buckets[bucket]++;
+	latency_max = qMax(latency_max, usecs);
+	received_reports++;
+
+	if (stopping && pending.isEmpty()) {
+		finish();
+	}
+}
+
+void ScanBench::finish()
+{
+	if (!stopping) {
+		// Stop generating, and give the manager a second to catch up.
+		stopping = true;
+		run_nsecs = clock.nsecsElapsed();
+		gen_timer->stop();
+		if (!pending.isEmpty()) {
+			QTimer::singleShot(1000, this, SLOT(finish()));
+			return;
+		}
+	} else if (gen_fd == -1) {
+		return; // Already reported
+	}
+
+	const qint64 rss_end = residentBytes();
+	lookup_failed = !checkLookup();
+	stopScan();
+	::close(gen_fd);
+	gen_fd = -1;
+
+	QTextStream out(stdout);
+	const double secs = run_nsecs / 1e9;
+	out << "Sent " << sent_reports << " reports in " << secs << " s: "
+	    << qint64(sent_reports / secs) << " reports/s";
+	if (rate > 0) out << " (target " << rate << ")";
+	out << ", " << stalls << " stalls" << endl;
+	out << "Signalled " << received_reports << " reports, "
+	    << unexpected_reports << " unexpected, " << pending.size() << " missing" << endl;
+
+	if (received_reports > 0) {
+		qint64 p50 = -1, p99 = -1, seen = 0;
+		for (int b = 0; b < 32; b++) {
+			seen += latency_buckets[b];
+			if (p50 < 0 && seen * 2 >= received_reports) p50 = Q_INT64_C(1) << b;
+			if (p99 < 0 && seen * 100 >= received_reports * 99) p99 = Q_INT64_C(1) << b;
+		}
+		out << "Latency: p50 < " << p50 << " us, p99 < " << p99 << " us, max "
+		    << latency_max << " us" << endl;
+	}
+
+	if (lookup_failed) {
+		out << "Lookup of public address " << GatoAddress(last_public).toString()
+		    << " FAILED" << endl;
+	}
+
+	out << "RSS: " << rss_start << " -> " << rss_end << " bytes ("
+	    << (rss_end - rss_start) << ")" << endl;
+
+	emit finished();
+}
+
+quint64 ScanBench::random()
+{
+	// xorshift64*
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return rng * Q_UINT64_C(0x2545F4914F6CDD1D);
+}
+
+quint64 ScanBench::randomAddress()
+{
+	// The two most significant bits of a static random address are set.
+	return (random() & Q_UINT64_C(0x3FFFFFFFFFFF)) | Q_UINT64_C(0xC00000000000);
+}
+
+quint64 ScanBench::publicAddress()
+{
+	return random() & Q_UINT64_C(0xFFFFFFFFFFFF);
+}
+
+bool ScanBench::checkLookup()
+{
+	if (!last_public) return true;
+
+	// Built from a string, as an application would from a saved address.
+	GatoAddress addr(GatoAddress(last_public).toString());
+	if (advertData(addr).isEmpty()) return false;
+
+	GatoPeripheral *peripheral = getPeripheral(addr);
+	return peripheral && !peripheral->advertData().isEmpty();
+}
+
+int ScanBench::buildPayload(quint8 *dst, int device, const Device &dev) const
+{
+	// Some random 128 bit service nobody filters for.
+	static const quint8 uuid128[16] = {
+		0x9E, 0xCA, 0xDC, 0x24, 0x0E, 0xE5, 0xA9, 0xE0,
+		0x93, 0xF3, 0xA3, 0xB5, 0x01, 0x00, 0x40, 0x6E
+	};
+	int len = 0;
+
+	dst[len++] = 2;
+	dst[len++] = EIRFlags;
+	dst[len++] = 0x06;
+
+	switch (dev.kind) {
+	case PayloadName:
+		dst[len++] = 1 + 8;
+		dst[len++] = EIRCompleteLocalName;
+		dst[len++] = 'd';
+		dst[len++] = 'e';
+		dst[len++] = 'v';
+		for (int shift = 12; shift >= 0; shift -= 4) {
+			dst[len++] = "0123456789abcdef"[(device >> shift) & 0xF];
+		}
+		dst[len++] = 'a' + dev.variant % 26;
+		break;
+	case PayloadUUID16:
+		dst[len++] = 1 + 4;
+		dst[len++] = EIRCompleteUUID16List;
+		write_le<quint16>(0x180D, &dst[len]); // Heart rate
+		write_le<quint16>(0x180F, &dst[len + 2]); // Battery
+		len += 4;
+		dst[len++] = 1 + 3;
+		dst[len++] = EIRIncompleteLocalName;
+		dst[len++] = 'h';
+		dst[len++] = 'r';
+		dst[len++] = 'a' + dev.variant % 26;
+		break;
+	case PayloadUUID128:
+		dst[len++] = 1 + 16;
+		dst[len++] = EIRCompleteUUID128List;
+		memcpy(&dst[len], uuid128, 16);
+		len += 16;
+		dst[len++] = 1 + 1;
+		dst[len++] = EIRTxPowerLevel;
+		dst[len++] = dev.variant;
+		break;
+	case PayloadManufacturer:
+		dst[len++] = 1 + 2 + 4;
+		dst[len++] = EIRManufacturerData;
+		write_le<quint16>(0x0059, &dst[len]);
+		write_le<quint32>(quint32(device) << 8 | dev.variant, &dst[len + 2]);
+		len += 6;
+		break;
+	}
+
+	return len;
+}
+
+qint64 ScanBench::residentBytes()
+{
+	QFile statm("/proc/self/statm");
+	if (!statm.open(QIODevice::ReadOnly)) return 0;
+	QList<QByteArray> fields = statm.readAll().split(' ');
+	if (fields.size() < 2) return 0;
+	return fields.at(1).toLongLong() * sysconf(_SC_PAGESIZE);
+}
@@ -0,0 +1,113 @@
+#ifndef SCANBENCH_H
+#define SCANBENCH_H
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QQueue>
+#include <QtCore/QVector>
+
+#include "gatocentralmanager.h"
+#include "gatoaddress.h"
+
+class QTimer;
+
+/** Feeds synthetic LE advertising report events into the manager through a
+ *  stand-in HCI socket and reports the sustained throughput, the latency from
+ *  writing a report to its discovered signal, and memory growth.
+ *
+ *  Every report the manager signals is checked against the ones sent that
+ *  should pass the service filter, so the run fails if parsing or filtering
+ *  drops, invents or reorders reports. Half the devices use public addresses,
+ *  and the last of those must be found again from its address string. */
+class ScanBench : public GatoCentralManager
+{
+	Q_OBJECT
+
+public:
+	explicit ScanBench(QObject *parent = 0);
+	~ScanBench();
+
+	enum PayloadKind {
+		PayloadName,
+		PayloadUUID16,
+		PayloadUUID128,
+		PayloadManufacturer
+	};
+
+	/** Reports per second; 0 writes as fast as the socket takes them. */
+	int rate;
+	int seconds;
+	/** Devices advertising at the same time. */
+	int devices;
+	/** Reports per HCI event, up to 6. */
+	int batch;
+	/** Fraction of reports coming from a device with a new address. */
+	double churn;
+	/** Fraction of reports repeating the device's previous payload. */
+	double duplicates;
+	/** Payload kinds, given to the devices in turn. */
+	QList<PayloadKind> mix;
+	/** Scan for the heart rate service only; only PayloadUUID16 devices advertise it. */
+	bool filter;
+	/** Listen to discoveredPeripheral() instead of discoveredAdvertisement(). */
+	bool peripherals;
+
+	bool failed() const;
+
+public slots:
+	void start();
+
+signals:
+	void finished();
+
+private slots:
+	void generate();
+	void handleAdvertisement(const GatoAddress &address, quint8 advertType, int rssi);
+	void handlePeripheral(GatoPeripheral *peripheral, quint8 advertType, int rssi);
+	void finish();
+
+private:
+	struct Device
+	{
+		quint64 addr;
+		PayloadKind kind;
+		quint8 variant;
+		bool is_public;
+	};
+
+	struct Pending
+	{
+		quint64 addr;
+		qint64 sent;
+	};
+
+	quint64 random();
+	quint64 randomAddress();
+	quint64 publicAddress();
+	bool checkLookup();
+	int buildPayload(quint8 *dst, int device, const Device &dev) const;
+	void received(const GatoAddress &address);
+	static qint64 residentBytes();
+
+private:
+	int gen_fd;
+	QTimer *gen_timer;
+	QElapsedTimer clock;
+	quint64 rng;
+	QVector<Device> device_table;
+	QQueue<Pending> pending;
+	bool stopping;
+	qint64 sent_reports;
+	qint64 received_reports;
+	qint64 unexpected_reports;
+	/** Last public address sent, to look up once the run ends. */
+	quint64 last_public;
+	bool lookup_failed;
+	qint64 stalls;
+	qint64 run_nsecs;
+	/** Latencies by powers of two microseconds. */
+	qint64 latency_buckets[32];
+	qint64 latency_max;
+	qint64 rss_start;
+};
+
+#endif // SCANBENCH_H